@@ -0,0 +1,73 @@
+/*********************************************************************
+ * File: arena.c                                                     *
+ * Description: bump allocator for short-lived data that is all     *
+ *              thrown away at once, like a search's nodes           *
+ *********************************************************************/
+
+#include "include/arena.h"
+#include "include/metrics.h"
+#include <stdlib.h>
+#include <string.h>
+
+static arena_block_t *new_block(arena_t *a, size_t size) {
+	arena_block_t *b = malloc(sizeof(arena_block_t) + size);
+	if (!b) return NULL;
+	b->prev = a->block;
+	b->size = size;
+	b->used = 0;
+	a->block = b;
+	a->capacity += size;
+	a->mallocs++;
+	metrics_add(METRIC_ARENA_MALLOCS, 1);
+	return b;
+}
+
+static void free_blocks(arena_t *a) {
+	while (a->block) {
+		arena_block_t *prev = a->block->prev;
+		free(a->block);
+		a->block = prev;
+	}
+	a->capacity = 0;
+}
+
+void arena_init(arena_t *a) {
+	memset(a, 0, sizeof(*a));
+}
+
+/* `size` bytes, aligned to ARENA_ALIGN and good until the next reset.
+ * returns NULL if a new block was needed and malloc() failed
+ */
+void *arena_alloc(arena_t *a, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	arena_block_t *b = a->block;
+	if (!b || b->size - b->used < size) {
+		// Each block doubles what the arena holds, so only a few are ever needed
+		size_t grow = a->capacity > ARENA_MIN_BLOCK ? a->capacity : ARENA_MIN_BLOCK;
+		b = new_block(a, grow > size ? grow : size);
+		if (!b) return NULL;
+	}
+	void *p = b->data + b->used;
+	b->used += size;
+	a->used += size;
+	if (a->used > a->peak) a->peak = a->used;
+	return p;
+}
+
+// Takes back everything allocated since the last reset, merging the blocks into one
+void arena_reset(arena_t *a) {
+	metrics_peak(METRIC_ARENA_PEAK, a->used);
+	if (a->block && a->block->prev) {
+		size_t total = a->capacity;
+		free_blocks(a);
+		new_block(a, total); // on failure the next alloc just tries again
+	}
+	if (a->block) a->block->used = 0;
+	a->used = 0;
+	a->resets++;
+}
+
+void arena_destroy(arena_t *a) {
+	free_blocks(a);
+	memset(a, 0, sizeof(*a));
+}
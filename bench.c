@@ -0,0 +1,329 @@
+/*********************************************************************
+ * File: bench.c                                                     *
+ * Description: micro-benchmarks for the engine and renderer's hot   *
+ *              paths, on fixed-seed boards, with one result a line  *
+ *********************************************************************/
+
+#define TB_IMPL
+
+#include "include/termbox.h"
+#include "include/engine.h"
+#include "include/render.h"
+#include "include/histogram.h"
+#include "include/crafted.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_BOARDS 256 // crafted boards (and pieces, games...) a benchmark cycles through
+#define BENCH_DEFAULT_MS 300 // each benchmark runs for at least this long
+#define BENCH_FRAME_MS 16 // game time per step in the simulated games, about one 60 Hz frame
+
+typedef struct {
+	const char *name;
+	const char *unit; // what one op is
+	const char *counts; // what the result counts
+	void (*setup)(void);
+	uint64_t (*run)(uint64_t ops); // does `ops` ops, returns something derived from them
+} bench_t;
+
+static rng_t rng;
+static bitboard_t boards[BENCH_BOARDS];
+static piece_t pieces[BENCH_BOARDS]; // a piece somewhere over each board, not always clear of it
+static piece_t resting[BENCH_BOARDS]; // a piece dropped as far as it goes on each board
+static piece_t falling[BENCH_BOARDS]; // the same piece at the top of the board, where it was dropped from
+static game_t games[BENCH_BOARDS];
+static struct tb_ctx *screen = NULL;
+static renderer_t renderer;
+static int null_fd = -1;
+static volatile uint64_t sink; // results go here so the compiler can't drop the work
+
+// Setup ////////////
+
+static void setup_boards() {
+	for (int i = 0; i < BENCH_BOARDS; i++) {
+		craft_board(&rng, &boards[i]);
+		pieces[i] = craft_piece(&rng);
+		resting[i] = craft_drop(&rng, &boards[i], &falling[i]);
+	}
+}
+
+/* Boards whose bottom four rows are full but for one column, each with the
+ * vertical I piece that fills it dropped in: every placement clears 4 lines
+ */
+static void setup_wells() {
+	for (int i = 0; i < BENCH_BOARDS; i++) {
+		// One whose well can't be filled is crafted again, so every board has its tetris
+		bool crafted = false;
+		while (!crafted) crafted = craft_well(&rng, &boards[i], &resting[i]);
+	}
+}
+
+// Games seeded 0..BENCH_BOARDS-1 over the crafted boards, a few pieces in
+static void setup_games() {
+	setup_boards();
+	for (int i = 0; i < BENCH_BOARDS; i++) craft_game(&games[i], i, &boards[i]);
+}
+
+// A termbox context the size of the game, whose output goes to /dev/null
+static void setup_screen() {
+	setup_games();
+	if (!screen) screen = tb_ctx_new(FRAME_COLS, FRAME_ROWS);
+	if (null_fd < 0) null_fd = open("/dev/null", O_WRONLY);
+	if (!screen || null_fd < 0) {
+		perror("Couldn't set up the screen");
+		exit(EXIT_FAILURE);
+	}
+	memset(&renderer, 0, sizeof(renderer));
+	renderer_resize(&renderer, FRAME_COLS, FRAME_ROWS, 0);
+	tb_ctx_set_present_mode(screen, TB_PRESENT_NORMAL);
+}
+
+// The same, presenting with as few bytes as it can (what --lean does)
+static void setup_lean_screen() {
+	setup_screen();
+	tb_ctx_set_present_mode(screen, TB_PRESENT_LEAN);
+}
+
+// Benchmarks ///////////
+
+// Collision tests, as done for every move, drop step and kick test
+static uint64_t run_collide(uint64_t ops) {
+	uint64_t hits = 0;
+	for (uint64_t i = 0; i < ops; i++) {
+		hits += piece_collides(&boards[i % BENCH_BOARDS], &pieces[(i * 7) % BENCH_BOARDS]);
+	}
+	return hits;
+}
+
+// Rotation with wall kicks
+static uint64_t run_rotate(uint64_t ops) {
+	uint64_t turned = 0;
+	for (uint64_t i = 0; i < ops; i++) {
+		piece_t p = resting[(i * 7) % BENCH_BOARDS];
+		turned += piece_rotate(&boards[i % BENCH_BOARDS], &p);
+	}
+	return turned;
+}
+
+// Writing a landed piece into the bitboard and clearing full lines
+static uint64_t run_place(uint64_t ops) {
+	uint64_t lines = 0;
+	for (uint64_t i = 0; i < ops; i++) {
+		bitboard_t bb = boards[i % BENCH_BOARDS];
+		lines += bitboard_place(&bb, &resting[i % BENCH_BOARDS]);
+	}
+	return lines;
+}
+
+// Placing a piece that clears 4 lines, so the clear itself dominates
+static uint64_t run_line_clear(uint64_t ops) {
+	uint64_t lines = 0;
+	for (uint64_t i = 0; i < ops; i++) {
+		bitboard_t bb = boards[i % BENCH_BOARDS];
+		lines += bitboard_place(&bb, &resting[i % BENCH_BOARDS]);
+	}
+	return lines;
+}
+
+/* A whole game's hard drop: drop distance, settle (colors too), line clear
+ * and the next piece from the bag. Includes copying the game_t.
+ */
+static uint64_t run_settle(uint64_t ops) {
+	static game_t g; // not on the stack: bigger than most
+	uint64_t lines = 0;
+	for (uint64_t i = 0; i < ops; i++) {
+		g = games[i % BENCH_BOARDS];
+		g.active_piece = resting[i % BENCH_BOARDS];
+		game_hard_drop(&g);
+		lines += g.lines_cleared;
+	}
+	return lines;
+}
+
+// The same from the top of the board, so finding where it lands counts too
+static uint64_t run_hard_drop(uint64_t ops) {
+	static game_t g;
+	uint64_t lines = 0;
+	for (uint64_t i = 0; i < ops; i++) {
+		g = games[i % BENCH_BOARDS];
+		g.active_piece = falling[i % BENCH_BOARDS];
+		game_hard_drop(&g);
+		lines += g.lines_cleared;
+	}
+	return lines;
+}
+
+// Presents what's been drawn and throws the bytes at /dev/null
+static uint64_t flush_screen() {
+	size_t len;
+	tb_present();
+	const char *out = tb_ctx_output(screen, &len);
+	if (write(null_fd, out, len) < 0) len = 0;
+	tb_ctx_consume(screen, len);
+	return len;
+}
+
+// Redrawing everything: frame, board and piece, then writing the frame out
+static uint64_t run_render_full(uint64_t ops) {
+	uint64_t bytes = 0;
+	tb_ctx_select(screen);
+	for (uint64_t i = 0; i < ops; i++) {
+		game_t *g = &games[i % BENCH_BOARDS];
+		renderer_invalidate(&renderer);
+		renderer_draw(&renderer, g);
+		bytes += flush_screen();
+	}
+	tb_ctx_select(NULL);
+	return bytes;
+}
+
+// The usual frame: the piece moved one step, draw and write just that
+static uint64_t run_render_move(uint64_t ops) {
+	static game_t g;
+	uint64_t bytes = 0;
+	tb_ctx_select(screen);
+	g = games[0];
+	renderer_invalidate(&renderer);
+	renderer_draw(&renderer, &g);
+	flush_screen();
+	for (uint64_t i = 0; i < ops; i++) {
+		if (!game_move(&g, (i / 4) % 2 ? LEFT : RIGHT)) game_rotate(&g);
+		renderer_draw(&renderer, &g);
+		bytes += flush_screen();
+	}
+	tb_ctx_select(NULL);
+	return bytes;
+}
+
+/* Whole games, start to game over, with random inputs every frame of game
+ * time. Seeds (and so pieces and inputs) are the same on every run.
+ */
+static uint64_t run_game(uint64_t ops) {
+	static game_t g;
+	uint64_t pieces_placed = 0;
+	for (uint64_t i = 0; i < ops; i++) {
+		rng_t inputs;
+		rng_seed(&inputs, i);
+		game_init(&g, i);
+		for (uint32_t t = 0; !g.over; t += BENCH_FRAME_MS) {
+			game_update(&g, t);
+			// A key on about half the frames, a hard drop on one in ten
+			uint32_t key = rng_below(&inputs, 2 * (INPUT_HARD_DROP + 1));
+			if (key <= INPUT_HARD_DROP) game_apply_input(&g, (input_t) key);
+			g.events = 0;
+		}
+		pieces_placed += g.pieces_placed;
+	}
+	return pieces_placed;
+}
+
+static const bench_t BENCHES[] = {
+	{"collide", "test", "hits", setup_boards, run_collide},
+	{"rotate", "rotation", "turns", setup_boards, run_rotate},
+	{"place", "piece", "lines", setup_boards, run_place},
+	{"settle", "drop", "lines", setup_games, run_settle},
+	{"hard_drop", "drop", "lines", setup_games, run_hard_drop},
+	{"line_clear", "tetris", "lines", setup_wells, run_line_clear},
+	{"render_full", "frame", "bytes", setup_screen, run_render_full},
+	{"render_move", "frame", "bytes", setup_screen, run_render_move},
+	{"render_full_lean", "frame", "bytes", setup_lean_screen, run_render_full},
+	{"render_move_lean", "frame", "bytes", setup_lean_screen, run_render_move},
+	{"game", "game", "pieces", NULL, run_game}
+};
+#define N_BENCHES (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+/* Runs `b` in growing batches until a batch takes at least `min_ms`, then
+ * prints one line of key=value pairs for it
+ */
+static void run_bench(const bench_t *b, double min_ms, uint64_t seed) {
+	rng_seed(&rng, seed);
+	if (b->setup) b->setup();
+
+	uint64_t ops = 1;
+	double elapsed_ms;
+	while (true) {
+		double start_ms = monotonic_ms();
+		sink = b->run(ops);
+		elapsed_ms = monotonic_ms() - start_ms;
+		if (elapsed_ms >= min_ms) break;
+		// Aim a little past min_ms next time, growing at most 10x at once
+		double scale = elapsed_ms > 0 ? 1.2 * min_ms / elapsed_ms : 10;
+		ops = (uint64_t) (ops * (scale > 10 ? 10 : scale)) + 1;
+	}
+	printf("bench=%s unit=%s ops=%llu ms=%.1f ns_per_op=%.1f ops_per_s=%.0f result=%llu %s_per_op=%.1f\n",
+	       b->name, b->unit, (unsigned long long) ops, elapsed_ms, elapsed_ms * 1e6 / ops,
+	       ops / (elapsed_ms / 1000.0), (unsigned long long) sink, b->counts, (double) sink / ops);
+	fflush(stdout);
+}
+
+static void print_usage(FILE *out, const char *prog) {
+	fprintf(out,
+		"Usage: %s [options] [BENCHMARK...]\n"
+		"  -m, --min-ms N  run each benchmark for at least N ms (default %d)\n"
+		"  -S, --seed N    seed for the crafted boards (default 1)\n"
+		"  -l, --list      list the benchmarks\n"
+		"  -h, --help      show this message\n"
+		"With no BENCHMARK, all of them run.\n", prog, BENCH_DEFAULT_MS);
+}
+
+int main(int argc, char **argv) {
+	static const struct option LONG_OPTIONS[] = {
+		{"min-ms", required_argument, NULL, 'm'},
+		{"seed", required_argument, NULL, 'S'},
+		{"list", no_argument, NULL, 'l'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	double min_ms = BENCH_DEFAULT_MS;
+	uint64_t seed = 1;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "m:S:lh", LONG_OPTIONS, NULL)) != -1) {
+		switch (opt) {
+			case 'm':
+				min_ms = strtod(optarg, NULL);
+				if (min_ms <= 0) {
+					fprintf(stderr, "--min-ms must be positive\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'S':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'l':
+				for (size_t i = 0; i < N_BENCHES; i++) printf("%s\n", BENCHES[i].name);
+				return EXIT_SUCCESS;
+			case 'h':
+				print_usage(stdout, argv[0]);
+				return EXIT_SUCCESS;
+			default:
+				print_usage(stderr, argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	// Header line: enough to tell whether two runs are comparable
+	printf("# tetris bench board=%dx%d seed=%llu min_ms=%.0f\n", BOARD_WIDTH, BOARD_HEIGHT,
+	       (unsigned long long) seed, min_ms);
+	int status = EXIT_SUCCESS;
+	if (optind == argc) {
+		for (size_t i = 0; i < N_BENCHES; i++) run_bench(&BENCHES[i], min_ms, seed);
+	}
+	for (int a = optind; a < argc; a++) {
+		size_t i = 0;
+		while (i < N_BENCHES && strcmp(BENCHES[i].name, argv[a]) != 0) i++;
+		if (i == N_BENCHES) {
+			fprintf(stderr, "no benchmark named %s (see --list)\n", argv[a]);
+			status = EXIT_FAILURE;
+			continue;
+		}
+		run_bench(&BENCHES[i], min_ms, seed);
+	}
+
+	tb_ctx_free(screen);
+	if (null_fd >= 0) close(null_fd);
+	return status;
+}
@@ -0,0 +1,597 @@
+/*********************************************************************
+ * File: bot.c                                                       *
+ * Description: a computer player. Searches every reachable          *
+ *              placement of the active and upcoming pieces and      *
+ *              plays toward the best one                            *
+ *********************************************************************/
+
+#include "include/bot.h"
+#include "include/metrics.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The batch evaluator uses the widest vectors the compiler was told it can
+// (e.g. -mavx2 or -march=native), SSE2 on any x86-64, NEON on ARM. Those
+// work on 16-bit rows; wider boards get the scalar loop on native popcounts.
+#if ROW_BITS != 16
+	#define EVAL_LANES 1
+#elif defined(__AVX2__)
+	#include <immintrin.h>
+	#define EVAL_LANES 16
+#elif defined(__SSE2__)
+	#include <emmintrin.h>
+	#define EVAL_LANES 8
+#elif defined(__ARM_NEON)
+	#include <arm_neon.h>
+	#define EVAL_LANES 8
+#else
+	#define EVAL_LANES 1
+#endif
+_Static_assert(BOT_BATCH % EVAL_LANES == 0, "a batch must be a whole number of vectors");
+
+// Evaluator weights, per unit of each feature (from a well known genetic
+// search over exactly these four features)
+#define WEIGHT_HEIGHT    -0.510066 // sum of the column heights
+#define WEIGHT_LINES      0.760666 // lines cleared on the way
+#define WEIGHT_HOLES     -0.356630 // empty cells with something above them
+#define WEIGHT_BUMPINESS -0.184483 // sum of the height differences of neighboring columns
+
+#define LOSS_SCORE -1e9 // a line of play that tops out
+
+// Every position a piece can be in, for the move search. Kicks can carry a
+// piece a little above the spawn rows, and no shape reaches past x = -2.
+#define MAP_X_MIN -3
+#define MAP_Y_MIN -4
+#define MAP_W (BOARD_WIDTH - MAP_X_MIN)
+#define MAP_H (BOARD_HEIGHT - MAP_Y_MIN)
+#define MAP_STATES (4 * MAP_W * MAP_H)
+
+// For each position reached from the start: 0 if it wasn't, otherwise
+// 1 + the first input of a shortest way there
+typedef struct {
+	uint8_t first[4][MAP_H][MAP_W];
+} move_map_t;
+
+static uint8_t *map_cell(move_map_t *map, const piece_t *p) {
+	int x = p->x - MAP_X_MIN, y = p->y - MAP_Y_MIN;
+	if (x < 0 || x >= MAP_W || y < 0 || y >= MAP_H) return NULL;
+	return &map->first[p->rotation][y][x];
+}
+
+/* Breadth-first search over every position the piece at `start` can reach
+ * with shifts, rotations and drops. Lateral moves are tried before dropping,
+ * so ties go to paths that line up high and drop last.
+ * Positions that can't move down (places the piece can settle) go to `out` if given.
+ */
+static uint16_t search_moves(const bitboard_t *bb, piece_t start, move_map_t *map, piece_t *out) {
+	static const input_t MOVES[4] = {INPUT_ROTATE, INPUT_LEFT, INPUT_RIGHT, INPUT_SOFT_DROP};
+	piece_t queue[MAP_STATES];
+	unsigned head = 0, tail = 0;
+	uint16_t n_out = 0;
+
+	memset(map, 0, sizeof(*map));
+	uint8_t *cell = map_cell(map, &start);
+	if (!cell || piece_collides(bb, &start)) return 0;
+	*cell = 1 + INPUT_HARD_DROP; // nowhere to go: the start is the destination
+	queue[tail++] = start;
+
+	while (head < tail) {
+		piece_t p = queue[head++];
+		uint8_t first = *map_cell(map, &p);
+		bool grounded = false;
+
+		for (uint8_t m = 0; m < 4; m++) {
+			piece_t next = p;
+			switch (MOVES[m]) {
+				case INPUT_ROTATE:
+					if (!piece_rotate(bb, &next)) continue;
+					break;
+				case INPUT_LEFT:
+					next.x--;
+					break;
+				case INPUT_RIGHT:
+					next.x++;
+					break;
+				default:
+					next.y++;
+					break;
+			}
+			if (MOVES[m] != INPUT_ROTATE && piece_collides(bb, &next)) {
+				if (MOVES[m] == INPUT_SOFT_DROP) grounded = true;
+				continue;
+			}
+
+			uint8_t *seen = map_cell(map, &next);
+			if (!seen || *seen) continue;
+			// Paths inherit the first step from the start
+			*seen = (head == 1) ? 1 + MOVES[m] : first;
+			queue[tail++] = next;
+		}
+		if (grounded && out && n_out < BOT_MAX_PLACEMENTS) out[n_out++] = p;
+	}
+	return n_out;
+}
+
+// Which cells a placement covers, whatever rotation/box position got it there:
+// the four cell indexes, sorted and packed into one number
+static uint64_t footprint(const piece_t *p) {
+	block_t blocks[4];
+	piece_blocks(p, blocks);
+	uint16_t cells[4];
+	for (uint8_t i = 0; i < 4; i++) {
+		uint16_t cell = (blocks[i].y - MAP_Y_MIN) * BOARD_WIDTH + blocks[i].x;
+		int8_t j = i - 1;
+		for (; j >= 0 && cells[j] > cell; j--) {
+			cells[j + 1] = cells[j];
+		}
+		cells[j + 1] = cell;
+	}
+	return (uint64_t) cells[0] | (uint64_t) cells[1] << 16 | (uint64_t) cells[2] << 32 | (uint64_t) cells[3] << 48;
+}
+
+/* Every distinct place the piece at `start` can come to rest on bb. I, S and Z
+ * pieces reach the same cells from two rotations, which only get listed once.
+ * returns how many went to `out`
+ */
+uint16_t bot_placements(const bitboard_t *bb, piece_t start, piece_t out[BOT_MAX_PLACEMENTS]) {
+	static _Thread_local move_map_t map; // too big for a worker's stack
+	uint16_t n = search_moves(bb, start, &map, out);
+	if (start.type != PIECE_I && start.type != PIECE_S && start.type != PIECE_Z) return n;
+
+	uint64_t keys[BOT_MAX_PLACEMENTS];
+	uint16_t kept = 0;
+	for (uint16_t i = 0; i < n; i++) {
+		uint64_t key = footprint(&out[i]);
+		bool duplicate = false;
+		for (uint16_t j = 0; j < kept && !duplicate; j++) {
+			duplicate = (keys[j] == key);
+		}
+		if (duplicate) continue;
+		keys[kept] = key;
+		out[kept++] = out[i];
+	}
+	return kept;
+}
+
+/* Scores a board, higher is better. Every feature comes from one pass down the
+ * rows with `seen` holding the columns that have been filled at or above the
+ * current row, so a column's height is the number of rows it's set in.
+ */
+double bot_evaluate(const bitboard_t *bb, int lines) {
+	row_t seen = 0;
+	int height = 0, holes = 0, bumpiness = 0;
+	for (uint8_t y = 0; y < BOARD_HEIGHT; y++) {
+		row_t row = bb->rows[y];
+		holes += ROW_POPCOUNT(seen & (row_t) ~row);
+		seen |= row;
+		height += ROW_POPCOUNT(seen);
+		// Neighboring columns where exactly one has started by this row
+		bumpiness += ROW_POPCOUNT((seen ^ (seen >> 1)) & (FULL_ROW >> 1));
+	}
+	return WEIGHT_HEIGHT * height + WEIGHT_LINES * lines
+	       + WEIGHT_HOLES * holes + WEIGHT_BUMPINESS * bumpiness;
+}
+
+void bot_batch_add(bot_batch_t *batch, const bitboard_t *bb, int lines) {
+	for (uint8_t y = 0; y < BOARD_HEIGHT; y++) {
+		batch->rows[y][batch->n] = bb->rows[y];
+	}
+	batch->lines[batch->n] = lines;
+	batch->n++;
+}
+
+/* Per-lane feature sums for lanes [lane, lane + EVAL_LANES), with exactly the same
+ * row pass as bot_evaluate(). Popcounts are done per 16-bit lane SWAR style
+ * (pairs, nibbles, bytes), which needs nothing past SSE2, and every sum fits
+ * in 16 bits: at most BOARD_HEIGHT * BOARD_WIDTH.
+ */
+#if EVAL_LANES == 16
+static inline __m256i popcount16(__m256i x) {
+	x = _mm256_sub_epi16(x, _mm256_and_si256(_mm256_srli_epi16(x, 1), _mm256_set1_epi16(0x5555)));
+	x = _mm256_add_epi16(_mm256_and_si256(x, _mm256_set1_epi16(0x3333)),
+	                     _mm256_and_si256(_mm256_srli_epi16(x, 2), _mm256_set1_epi16(0x3333)));
+	x = _mm256_and_si256(_mm256_add_epi16(x, _mm256_srli_epi16(x, 4)), _mm256_set1_epi16(0x0f0f));
+	return _mm256_and_si256(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), _mm256_set1_epi16(0x001f));
+}
+
+static void batch_features(const bot_batch_t *batch, uint8_t lane, uint16_t height[], uint16_t holes[], uint16_t bump[]) {
+	__m256i seen = _mm256_setzero_si256(), h = seen, o = seen, b = seen;
+	const __m256i inner = _mm256_set1_epi16(FULL_ROW >> 1);
+	for (uint8_t y = 0; y < BOARD_HEIGHT; y++) {
+		__m256i row = _mm256_loadu_si256((const __m256i *) &batch->rows[y][lane]);
+		o = _mm256_add_epi16(o, popcount16(_mm256_andnot_si256(row, seen)));
+		seen = _mm256_or_si256(seen, row);
+		h = _mm256_add_epi16(h, popcount16(seen));
+		b = _mm256_add_epi16(b, popcount16(_mm256_and_si256(_mm256_xor_si256(seen, _mm256_srli_epi16(seen, 1)), inner)));
+	}
+	_mm256_storeu_si256((__m256i *) &height[lane], h);
+	_mm256_storeu_si256((__m256i *) &holes[lane], o);
+	_mm256_storeu_si256((__m256i *) &bump[lane], b);
+}
+#elif EVAL_LANES == 8 && defined(__SSE2__)
+static inline __m128i popcount16(__m128i x) {
+	x = _mm_sub_epi16(x, _mm_and_si128(_mm_srli_epi16(x, 1), _mm_set1_epi16(0x5555)));
+	x = _mm_add_epi16(_mm_and_si128(x, _mm_set1_epi16(0x3333)),
+	                  _mm_and_si128(_mm_srli_epi16(x, 2), _mm_set1_epi16(0x3333)));
+	x = _mm_and_si128(_mm_add_epi16(x, _mm_srli_epi16(x, 4)), _mm_set1_epi16(0x0f0f));
+	return _mm_and_si128(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), _mm_set1_epi16(0x001f));
+}
+
+static void batch_features(const bot_batch_t *batch, uint8_t lane, uint16_t height[], uint16_t holes[], uint16_t bump[]) {
+	__m128i seen = _mm_setzero_si128(), h = seen, o = seen, b = seen;
+	const __m128i inner = _mm_set1_epi16(FULL_ROW >> 1);
+	for (uint8_t y = 0; y < BOARD_HEIGHT; y++) {
+		__m128i row = _mm_loadu_si128((const __m128i *) &batch->rows[y][lane]);
+		o = _mm_add_epi16(o, popcount16(_mm_andnot_si128(row, seen)));
+		seen = _mm_or_si128(seen, row);
+		h = _mm_add_epi16(h, popcount16(seen));
+		b = _mm_add_epi16(b, popcount16(_mm_and_si128(_mm_xor_si128(seen, _mm_srli_epi16(seen, 1)), inner)));
+	}
+	_mm_storeu_si128((__m128i *) &height[lane], h);
+	_mm_storeu_si128((__m128i *) &holes[lane], o);
+	_mm_storeu_si128((__m128i *) &bump[lane], b);
+}
+#elif EVAL_LANES == 8
+// NEON counts bits per byte; a pairwise widening add turns that into per-lane counts
+static inline uint16x8_t popcount16(uint16x8_t x) {
+	return vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u16(x)));
+}
+
+static void batch_features(const bot_batch_t *batch, uint8_t lane, uint16_t height[], uint16_t holes[], uint16_t bump[]) {
+	uint16x8_t seen = vdupq_n_u16(0), h = seen, o = seen, b = seen;
+	const uint16x8_t inner = vdupq_n_u16(FULL_ROW >> 1);
+	for (uint8_t y = 0; y < BOARD_HEIGHT; y++) {
+		uint16x8_t row = vld1q_u16(&batch->rows[y][lane]);
+		o = vaddq_u16(o, popcount16(vbicq_u16(seen, row)));
+		seen = vorrq_u16(seen, row);
+		h = vaddq_u16(h, popcount16(seen));
+		b = vaddq_u16(b, popcount16(vandq_u16(veorq_u16(seen, vshrq_n_u16(seen, 1)), inner)));
+	}
+	vst1q_u16(&height[lane], h);
+	vst1q_u16(&holes[lane], o);
+	vst1q_u16(&bump[lane], b);
+}
+#else
+static void batch_features(const bot_batch_t *batch, uint8_t lane, uint16_t height[], uint16_t holes[], uint16_t bump[]) {
+	row_t seen = 0;
+	height[lane] = holes[lane] = bump[lane] = 0;
+	for (uint8_t y = 0; y < BOARD_HEIGHT; y++) {
+		row_t row = batch->rows[y][lane];
+		holes[lane] += ROW_POPCOUNT(seen & (row_t) ~row);
+		seen |= row;
+		height[lane] += ROW_POPCOUNT(seen);
+		bump[lane] += ROW_POPCOUNT((seen ^ (seen >> 1)) & (FULL_ROW >> 1));
+	}
+}
+#endif
+
+/* Scores every board in the batch, the same as bot_evaluate() would one at a
+ * time. Lanes past batch->n are computed too (whatever is in them) but not stored.
+ */
+void bot_evaluate_batch(const bot_batch_t *batch, double scores[BOT_BATCH]) {
+	uint16_t height[BOT_BATCH], holes[BOT_BATCH], bump[BOT_BATCH];
+	for (uint8_t lane = 0; lane < batch->n; lane += EVAL_LANES) {
+		batch_features(batch, lane, height, holes, bump);
+	}
+	for (uint8_t i = 0; i < batch->n; i++) {
+		scores[i] = WEIGHT_HEIGHT * height[i] + WEIGHT_LINES * batch->lines[i]
+		            + WEIGHT_HOLES * holes[i] + WEIGHT_BUMPINESS * bump[i];
+	}
+}
+
+// Transposition table ///////////
+#define TT_MASK ((1u << BOT_TT_BITS) - 1)
+#define TT_ROOT 0x5bd1e9955bd1e995ULL // keys bot_choose()'s own entries apart from the search's
+
+static uint64_t mix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDULL;
+	k ^= k >> 33;
+	k *= 0xC4CEB9FE1A85EC53ULL;
+	return k ^ (k >> 33);
+}
+
+static uint64_t pack_piece(piece_t p) {
+	return (uint64_t) (uint8_t) p.type | (uint64_t) (uint8_t) p.rotation << 8
+	       | (uint64_t) (uint8_t) p.x << 16 | (uint64_t) (uint8_t) p.y << 24;
+}
+
+static piece_t unpack_piece(uint64_t v) {
+	return (piece_t) { .type = (uint8_t) v, .rotation = (uint8_t) (v >> 8), .x = (int8_t) (v >> 16), .y = (int8_t) (v >> 24) };
+}
+
+/* A board (by its bitboard_hash()) with `start` still to be placed and then
+ * `types[0..n)`: everything the search below it depends on
+ */
+static uint64_t node_key(uint64_t board_hash, piece_t start, const uint8_t *types, uint8_t n) {
+	uint64_t run = n;
+	for (uint8_t i = 0; i < n; i++) {
+		run = run << 3 | types[i];
+	}
+	return board_hash ^ mix64(pack_piece(start) | run << 32);
+}
+
+static bool tt_probe(const bot_tt_entry_t *tt, uint64_t key, double *score, piece_t *move, bot_thread_t *self) {
+	const bot_tt_entry_t *e = &tt[key & TT_MASK];
+	uint64_t check = atomic_load_explicit(&e->check, memory_order_relaxed);
+	uint64_t bits = atomic_load_explicit(&e->score, memory_order_relaxed);
+	uint64_t packed = atomic_load_explicit(&e->move, memory_order_relaxed);
+	self->tt_probes++;
+	if ((check ^ bits ^ packed) != key) return false;
+	self->tt_hits++;
+	memcpy(score, &bits, sizeof(*score));
+	if (move) *move = unpack_piece(packed);
+	return true;
+}
+
+static void tt_store(bot_tt_entry_t *tt, uint64_t key, double score, piece_t move) {
+	bot_tt_entry_t *e = &tt[key & TT_MASK];
+	uint64_t bits, packed = pack_piece(move);
+	memcpy(&bits, &score, sizeof(bits));
+	atomic_store_explicit(&e->check, key ^ bits ^ packed, memory_order_relaxed);
+	atomic_store_explicit(&e->score, bits, memory_order_relaxed);
+	atomic_store_explicit(&e->move, packed, memory_order_relaxed);
+}
+
+// Search ///////////
+
+/* The search tree, spread over the pool: one task per placement of the active
+ * piece, each of which hands out one task per placement of the next piece.
+ * Everything under root i folds its score into results[i].
+ */
+typedef struct {
+	pool_t *pool;
+	bot_thread_t *threads; // see bot_t
+	bot_tt_entry_t *tt;
+	uint8_t types[BOT_MAX_DEPTH]; // preview pieces after the active one
+	uint8_t n_types;
+	_Atomic double results[BOT_MAX_PLACEMENTS];
+} search_t;
+
+typedef struct {
+	search_t *search;
+	uint16_t root;
+	uint8_t level; // how many of search->types are already placed on `board`
+	int lines;
+	uint64_t hash; // bitboard_hash() of `board`
+	bitboard_t board;
+} search_task_t;
+
+static bot_thread_t *this_thread(search_t *search) {
+	int worker = search->pool ? pool_worker_index(search->pool) : -1;
+	return &search->threads[worker + 1];
+}
+
+/* Best score reachable by placing `types[0..n)` one after another, on the
+ * calling thread. Lines already cleared above this board don't count: the
+ * caller adds them, so the score depends on nothing but the board and the
+ * pieces, and can be cached under node_key() whatever way the board was
+ * reached.
+ */
+static double search_serial(search_t *search, bot_thread_t *self, const bitboard_t *bb, uint64_t hash,
+                            const uint8_t *types, uint8_t n) {
+	if (n == 0) return bot_evaluate(bb, 0);
+
+	piece_t start = piece_spawn(types[0]);
+	uint64_t key = node_key(hash, start, types + 1, n - 1);
+	double best = LOSS_SCORE;
+	if (tt_probe(search->tt, key, &best, NULL, self)) return best;
+
+	piece_t placements[BOT_MAX_PLACEMENTS];
+	uint16_t count = bot_placements(bb, start, placements);
+	uint16_t pick = 0;
+	self->nodes += count;
+
+	// The last piece's boards are the leaves, where nearly all the scoring
+	// happens: evaluate those a batch at a time
+	if (n == 1) {
+		bot_batch_t batch;
+		double scores[BOT_BATCH];
+		uint16_t batched[BOT_BATCH]; // which placement each board came from
+		batch.n = 0;
+		for (uint16_t i = 0; i < count; i++) {
+			bitboard_t after = *bb;
+			int8_t cleared = bitboard_place(&after, &placements[i]);
+			if (cleared >= 0) { // not above the board
+				batched[batch.n] = i;
+				bot_batch_add(&batch, &after, cleared);
+			}
+			if (batch.n < BOT_BATCH && i + 1 < count) continue;
+
+			bot_evaluate_batch(&batch, scores);
+			for (uint8_t j = 0; j < batch.n; j++) {
+				if (scores[j] > best) {
+					best = scores[j];
+					pick = batched[j];
+				}
+			}
+			batch.n = 0;
+		}
+	} else {
+		for (uint16_t i = 0; i < count; i++) {
+			bitboard_t after = *bb;
+			uint64_t after_hash = hash;
+			int8_t cleared = bitboard_place_hashed(&after, &placements[i], &after_hash);
+			if (cleared < 0) continue; // settled above the board
+			double score = WEIGHT_LINES * cleared + search_serial(search, self, &after, after_hash, types + 1, n - 1);
+			if (score > best) {
+				best = score;
+				pick = i;
+			}
+		}
+	}
+	if (count > 0) tt_store(search->tt, key, best, placements[pick]);
+	return best;
+}
+
+static void fold_max(_Atomic double *slot, double score) {
+	double current = atomic_load(slot);
+	while (score > current && !atomic_compare_exchange_weak(slot, &current, score))
+		continue;
+}
+
+// A task out of the calling thread's own arena, so allocating one never takes a lock
+static search_task_t *new_task(search_t *search) {
+	return arena_alloc(&this_thread(search)->arena, sizeof(search_task_t));
+}
+
+static void run_task(pool_t *pool, pool_task_fn fn, search_task_t *task) {
+	if (pool) pool_submit(pool, fn, task);
+	else fn(task);
+}
+
+static void search_task(void *arg) {
+	search_task_t *task = arg;
+	search_t *search = task->search;
+	uint8_t left = search->n_types - task->level;
+
+	// Deep enough that one more split isn't worth a task per node
+	if (task->level > 0 || left < 2) {
+		double score = WEIGHT_LINES * task->lines
+		               + search_serial(search, this_thread(search), &task->board, task->hash, search->types + task->level, left);
+		fold_max(&search->results[task->root], score);
+		return;
+	}
+
+	piece_t placements[BOT_MAX_PLACEMENTS];
+	uint16_t count = bot_placements(&task->board, piece_spawn(search->types[0]), placements);
+	this_thread(search)->nodes += count;
+	for (uint16_t i = 0; i < count; i++) {
+		bitboard_t after = task->board;
+		uint64_t after_hash = task->hash;
+		int8_t cleared = bitboard_place_hashed(&after, &placements[i], &after_hash);
+		if (cleared < 0) continue;
+		search_task_t *child = new_task(search);
+		if (!child) break;
+		*child = *task;
+		child->level = 1;
+		child->board = after;
+		child->hash = after_hash;
+		child->lines += cleared;
+		run_task(search->pool, search_task, child);
+	}
+}
+
+// returns false if the per-thread state or the transposition table couldn't be allocated
+bool bot_init(bot_t *bot, uint8_t depth, pool_t *pool) {
+	memset(bot, 0, sizeof(*bot));
+	bot->depth = (depth < 1) ? 1 : (depth > BOT_MAX_DEPTH) ? BOT_MAX_DEPTH : depth;
+	bot->pool = pool;
+	bot->n_threads = 1 + (pool ? pool->n_workers : 0);
+	bot->threads = aligned_alloc(_Alignof(bot_thread_t), bot->n_threads * sizeof(bot_thread_t));
+	bot->tt = aligned_alloc(_Alignof(bot_tt_entry_t), sizeof(bot_tt_entry_t) << BOT_TT_BITS);
+	if (!bot->threads || !bot->tt) {
+		bot_destroy(bot);
+		return false;
+	}
+	memset(bot->threads, 0, bot->n_threads * sizeof(bot_thread_t));
+	memset(bot->tt, 0, sizeof(bot_tt_entry_t) << BOT_TT_BITS); // an empty entry only matches key 0
+	return true;
+}
+
+void bot_destroy(bot_t *bot) {
+	for (unsigned i = 0; bot->threads && i < bot->n_threads; i++) {
+		arena_destroy(&bot->threads[i].arena);
+	}
+	free(bot->threads);
+	free(bot->tt);
+	bot->threads = NULL;
+	bot->tt = NULL;
+	bot->n_threads = 0;
+}
+
+/* Picks where the active piece should go: the placement whose best line of
+ * play through the next depth-1 preview pieces scores highest. The scores
+ * don't depend on how the work was split, or on what the transposition
+ * table held, so the choice is deterministic.
+ * returns false if the piece has nowhere to go
+ */
+bool bot_choose(bot_t *bot, const game_t *g, piece_t *best) {
+	static _Thread_local search_t search; // too big for the stack
+	search.pool = bot->pool;
+	search.threads = bot->threads;
+	search.tt = bot->tt;
+	search.n_types = bot->depth - 1;
+	for (uint8_t i = 0; i < search.n_types; i++) {
+		search.types[i] = game_preview(g, i);
+	}
+
+	// The same position again (say, the game was rewound) has its answer already
+	uint64_t hash = bitboard_hash(&g->bitboard);
+	uint64_t key = node_key(hash, g->active_piece, search.types, search.n_types) ^ TT_ROOT;
+	double score;
+	if (tt_probe(bot->tt, key, &score, best, &bot->threads[0])) return true;
+
+	piece_t roots[BOT_MAX_PLACEMENTS];
+	uint16_t n_roots = bot_placements(&g->bitboard, g->active_piece, roots);
+	if (n_roots == 0) return false;
+
+	// All of them before any task goes out: a root left without one (no room
+	// for its task) mustn't be picked on a score from an earlier search
+	for (uint16_t i = 0; i < n_roots; i++) atomic_init(&search.results[i], LOSS_SCORE - 1);
+	for (uint16_t i = 0; i < n_roots; i++) {
+		bitboard_t after = g->bitboard;
+		uint64_t after_hash = hash;
+		int lines = bitboard_place_hashed(&after, &roots[i], &after_hash);
+		if (lines < 0) continue;
+		search_task_t *task = new_task(&search);
+		if (!task) break;
+		*task = (search_task_t) { .search = &search, .root = i, .lines = lines, .hash = after_hash, .board = after };
+		run_task(bot->pool, search_task, task);
+	}
+	if (bot->pool) pool_wait(bot->pool);
+
+	// Every task has run, so the whole tree can go at once
+	size_t used = 0;
+	uint64_t nodes = n_roots;
+	for (unsigned i = 0; i < bot->n_threads; i++) {
+		used += bot->threads[i].arena.used;
+		arena_reset(&bot->threads[i].arena);
+		nodes += bot->threads[i].nodes;
+		bot->threads[i].nodes = 0;
+	}
+	if (used > bot->arena_peak) bot->arena_peak = used;
+	metrics_add(METRIC_BOT_SEARCHES, 1);
+	metrics_add(METRIC_BOT_NODES, nodes);
+
+	uint16_t pick = 0;
+	for (uint16_t i = 1; i < n_roots; i++) {
+		if (atomic_load(&search.results[i]) > atomic_load(&search.results[pick])) pick = i;
+	}
+	*best = roots[pick];
+	tt_store(bot->tt, key, atomic_load(&search.results[pick]), *best);
+	return true;
+}
+
+/* The next input to play toward the bot's chosen placement, picking a new one
+ * whenever a new piece is up (or gravity made the old one unreachable)
+ * returns an input_t, or -1 when there's nothing to do
+ */
+int bot_next_input(bot_t *bot, const game_t *g) {
+	static _Thread_local move_map_t map;
+	if (g->over) return -1;
+
+	for (uint8_t attempt = 0; attempt < 2; attempt++) {
+		if (!bot->planned || bot->planned_for != g->pieces_placed) {
+			if (!bot_choose(bot, g, &bot->target)) return INPUT_HARD_DROP; // topped out anyway
+			bot->planned = true;
+			bot->planned_for = g->pieces_placed;
+		}
+
+		search_moves(&g->bitboard, g->active_piece, &map, NULL);
+		uint8_t *first = map_cell(&map, &bot->target);
+		if (!first || !*first) {
+			bot->planned = false; // gravity took the piece past it
+			continue;
+		}
+
+		// Lined up over the target with nothing in the way: drop it there
+		const piece_t *p = &g->active_piece;
+		if (p->rotation == bot->target.rotation && p->x == bot->target.x
+		    && p->y + game_drop_distance(g, p) == bot->target.y)
+			return INPUT_HARD_DROP;
+		return *first - 1;
+	}
+	return INPUT_HARD_DROP;
+}
@@ -0,0 +1,359 @@
+/*********************************************************************
+ * File: broadcast.c                                                 *
+ * Description: one game watched by any number of spectators. Each   *
+ *              frame is drawn once and shared by every viewer       *
+ *********************************************************************/
+
+#define _GNU_SOURCE // accept4()
+#include "include/broadcast.h"
+#include "include/server.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MAX_EPOLL_EVENTS 64
+
+// Sent on connect after the telnet greeting players get: the alternate
+// screen with the cursor hidden. The first keyframe does the rest.
+static const char HELLO_SCREEN[] = "\033[?1049h\033[?25l";
+static const char BYE[] = "\033[0m\033[2J\033[?25h\033[?1049lThanks for watching!\r\n";
+
+_Static_assert((VIEWER_QUEUE_SIZE & (VIEWER_QUEUE_SIZE - 1)) == 0, "the queue is indexed with a mask");
+
+// Frames ////////////
+
+static broadcast_frame_t *frame_new(const char *data, size_t len) {
+	broadcast_frame_t *f = malloc(sizeof(broadcast_frame_t) + len);
+	if (!f) return NULL;
+	f->refs = 1;
+	f->len = len;
+	memcpy(f->data, data, len);
+	return f;
+}
+
+static void frame_unref(broadcast_frame_t *f) {
+	if (--f->refs == 0) free(f);
+}
+
+// Viewers ////////////
+
+static broadcast_frame_t *viewer_head(const viewer_t *v) {
+	return v->queue[v->head & (VIEWER_QUEUE_SIZE - 1)];
+}
+
+// Queues `f` as is, sync or not. Only for frames the caller knows fit.
+static void viewer_enqueue(viewer_t *v, broadcast_frame_t *f) {
+	f->refs++;
+	v->queue[v->tail++ & (VIEWER_QUEUE_SIZE - 1)] = f;
+	v->pending += f->len;
+}
+
+/* Drops every queued frame that hasn't started going out, short of the
+ * must_send ones. One that's partly written has to finish, or the terminal
+ * would be left in the middle of an escape sequence.
+ */
+static void viewer_skip(viewer_t *v) {
+	uint32_t keep = v->head + (v->head != v->tail && v->head_sent > 0);
+	if ((int32_t) (v->must_send - keep) > 0) keep = v->must_send;
+	while (v->tail != keep) {
+		broadcast_frame_t *f = v->queue[--v->tail & (VIEWER_QUEUE_SIZE - 1)];
+		v->pending -= f->len;
+		frame_unref(f);
+	}
+}
+
+// Throws the whole queue away, once nobody is left to read it
+static void viewer_drop(viewer_t *v) {
+	for (; v->head != v->tail; v->head++) {
+		frame_unref(viewer_head(v));
+	}
+	v->head_sent = 0;
+	v->pending = 0;
+}
+
+/* Hands a viewer this tick's frame: the changes since the last one if it is
+ * keeping up, else the keyframe if there is one this tick. A viewer that has
+ * fallen too far behind drops its queue and waits for the next keyframe, so
+ * a slow connection never holds up the game or the other viewers.
+ */
+static void viewer_push(viewer_t *v, broadcast_frame_t *delta, broadcast_frame_t *key) {
+	if (v->closing) return;
+	if (v->synced && delta) {
+		if (v->tail - v->head < VIEWER_QUEUE_SIZE && v->pending + delta->len <= VIEWER_BEHIND_MAX) {
+			viewer_enqueue(v, delta);
+			return;
+		}
+		viewer_skip(v);
+		v->synced = false;
+	}
+	if (!v->synced && key) {
+		viewer_skip(v);
+		viewer_enqueue(v, key);
+		v->synced = true;
+	}
+}
+
+/* Writes as much of the queue as the socket takes, all frames in one
+ * sendmsg() straight from the shared buffers.
+ * returns false if the client is gone
+ */
+static bool viewer_flush(viewer_t *v) {
+	while (v->head != v->tail) {
+		struct iovec iov[VIEWER_QUEUE_SIZE];
+		int n_iov = 0;
+		for (uint32_t i = v->head; i != v->tail; i++) {
+			broadcast_frame_t *f = v->queue[i & (VIEWER_QUEUE_SIZE - 1)];
+			size_t skip = (i == v->head) ? v->head_sent : 0;
+			iov[n_iov++] = (struct iovec) { .iov_base = f->data + skip, .iov_len = f->len - skip };
+		}
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n_iov };
+		ssize_t n = sendmsg(v->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+			viewer_drop(v);
+			return false;
+		}
+
+		// Let go of every frame that's all written now
+		bool short_write = (size_t) n < v->pending;
+		v->pending -= n;
+		while (v->head != v->tail) {
+			broadcast_frame_t *f = viewer_head(v);
+			size_t rest = f->len - v->head_sent;
+			if ((size_t) n < rest) {
+				v->head_sent += n;
+				break;
+			}
+			n -= rest;
+			v->head_sent = 0;
+			frame_unref(f);
+			v->head++;
+		}
+		if (short_write) return true; // the socket is full
+	}
+	return true;
+}
+
+static void set_interest(broadcast_t *b, viewer_t *v, bool writable) {
+	if (v->want_writable == writable) return;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0), .data.ptr = v };
+	epoll_ctl(b->epoll_fd, EPOLL_CTL_MOD, v->fd, &ev);
+	v->want_writable = writable;
+}
+
+static void viewer_destroy(broadcast_t *b, viewer_t *v) {
+	epoll_ctl(b->epoll_fd, EPOLL_CTL_DEL, v->fd, NULL);
+	close(v->fd);
+	viewer_drop(v);
+	free(v);
+}
+
+// Says goodbye and closes once that's written
+static void viewer_leave(broadcast_t *b, viewer_t *v) {
+	if (v->closing) return;
+	viewer_skip(v);
+	viewer_enqueue(v, b->bye);
+	v->must_send = v->tail;
+	v->closing = true;
+}
+
+static void accept_viewers(broadcast_t *b) {
+	while (true) {
+		int fd = accept4(b->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) return; // EAGAIN once the backlog is empty (or out of fds; try next time)
+
+		if (b->n_viewers == b->viewers_cap) {
+			size_t cap = b->viewers_cap ? b->viewers_cap * 2 : 64;
+			viewer_t **grown = realloc(b->viewers, cap * sizeof(viewer_t *));
+			if (!grown) {
+				close(fd);
+				continue;
+			}
+			b->viewers = grown;
+			b->viewers_cap = cap;
+		}
+		viewer_t *v = calloc(1, sizeof(viewer_t));
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = v };
+		if (!v || epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			free(v);
+			close(fd);
+			continue;
+		}
+		v->fd = fd;
+		viewer_enqueue(v, b->hello); // then nothing until a keyframe
+		v->must_send = v->tail;
+		b->viewers[b->n_viewers++] = v;
+	}
+}
+
+/* Spectators have nothing to play, so all that's looked for is q or Ctrl-C
+ * to leave. Telnet commands are filtered out as they are for players, so
+ * nothing inside one counts.
+ */
+static void read_viewer(broadcast_t *b, viewer_t *v) {
+	uint8_t buf[256];
+	while (true) {
+		ssize_t n = recv(v->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR) continue;
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			v->closing = true;
+			viewer_drop(v); // nobody left to write to
+			return;
+		}
+		if (n < 0) return;
+		for (ssize_t i = 0; i < n; i++) {
+			if (!telnet_filter(&v->parse, buf[i])) continue;
+			if (buf[i] == 'q' || buf[i] == 'Q' || buf[i] == 3) viewer_leave(b, v);
+		}
+	}
+}
+
+// Destroys whoever is done and waits on EPOLLOUT for whoever has output left
+static void sweep_viewers(broadcast_t *b) {
+	for (size_t i = 0; i < b->n_viewers; i++) {
+		viewer_t *v = b->viewers[i];
+		if (v->closing && (v->pending == 0 || !viewer_flush(v) || v->pending == 0)) {
+			viewer_destroy(b, v);
+			b->viewers[i--] = b->viewers[--b->n_viewers];
+			continue;
+		}
+		set_interest(b, v, v->pending > 0);
+	}
+}
+
+// Broadcast ////////////
+
+/* Starts taking spectators on `listen_fd` (which it now owns). Its epoll fd
+ * is b->epoll_fd; call broadcast_poll() whenever that is readable.
+ * `lean` presents with TB_PRESENT_LEAN.
+ */
+bool broadcast_init(broadcast_t *b, int listen_fd, bool lean) {
+	memset(b, 0, sizeof(*b));
+	b->listen_fd = listen_fd;
+	b->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	b->tb = tb_ctx_new(BROADCAST_COLS, BROADCAST_ROWS);
+	char hello[sizeof(TELNET_GREETING) + sizeof(HELLO_SCREEN) - 1];
+	memcpy(hello, TELNET_GREETING, sizeof(TELNET_GREETING));
+	memcpy(hello + sizeof(TELNET_GREETING), HELLO_SCREEN, sizeof(HELLO_SCREEN) - 1);
+	b->hello = frame_new(hello, sizeof(hello));
+	b->bye = frame_new(BYE, sizeof(BYE) - 1);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &b->listen_fd };
+	if (b->epoll_fd < 0 || !b->tb || !b->hello || !b->bye
+	    || epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+		broadcast_destroy(b);
+		return false;
+	}
+	if (lean) tb_ctx_set_present_mode(b->tb, TB_PRESENT_LEAN);
+	size_t len;
+	tb_ctx_output(b->tb, &len);
+	tb_ctx_consume(b->tb, len); // viewers get HELLO and a keyframe instead
+	renderer_resize(&b->renderer, BROADCAST_COLS, FRAME_ROWS, 0);
+	b->since_keyframe = KEYFRAME_MIN_TICKS;
+	return true;
+}
+
+// Accepts spectators, reads their keys and writes whatever their sockets take
+void broadcast_poll(broadcast_t *b) {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int n = epoll_wait(b->epoll_fd, events, MAX_EPOLL_EVENTS, 0);
+	for (int i = 0; i < n; i++) {
+		if (events[i].data.ptr == &b->listen_fd) {
+			accept_viewers(b);
+			continue;
+		}
+		viewer_t *v = events[i].data.ptr;
+		if (events[i].events & EPOLLIN) read_viewer(b, v);
+		if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+			v->closing = true;
+			viewer_drop(v);
+		}
+		else if (events[i].events & EPOLLOUT) {
+			if (!viewer_flush(v)) v->closing = true;
+		}
+	}
+	sweep_viewers(b);
+}
+
+/* One frame of the broadcast: draws `g` (NULL while nobody is playing) and
+ * queues what changed on screen to every viewer that's keeping up, as one
+ * shared frame. While anyone is waiting to join the stream, some frames also
+ * come with a keyframe for them: the whole screen from scratch.
+ */
+void broadcast_tick(broadcast_t *b, const game_t *g) {
+	bool waiting = false;
+	for (size_t i = 0; i < b->n_viewers && !waiting; i++) {
+		waiting = !b->viewers[i]->synced && !b->viewers[i]->closing;
+	}
+	bool keyframe = waiting && b->since_keyframe >= KEYFRAME_MIN_TICKS;
+	if (keyframe) b->since_keyframe = 0;
+	else if (b->since_keyframe < KEYFRAME_MIN_TICKS) b->since_keyframe++;
+
+	tb_ctx_select(b->tb);
+	if (g) {
+		// Another renderer consumes the game's dirty rows, so this one checks
+		// every cell against what it has drawn (cheap, and only changes go out)
+		game_t view = *g;
+		view.dirty_rows = ~0ULL;
+		if (!b->drew_game || (b->drew_over && !g->over)) renderer_invalidate(&b->renderer);
+		renderer_draw(&b->renderer, &view);
+		if (g->over) draw_game_over_text(&b->renderer.layout);
+		b->drew_over = g->over;
+	}
+	else if (!b->drew_waiting) {
+		tb_clear();
+		draw_board_text(&b->renderer.layout, BOARD_HEIGHT / 2 - 1, TB_WHITE, TB_DEFAULT, "waiting");
+		draw_board_text(&b->renderer.layout, BOARD_HEIGHT / 2, TB_WHITE, TB_DEFAULT, "for a game");
+	}
+	b->drew_game = (g != NULL);
+	b->drew_waiting = (g == NULL);
+	char status[BROADCAST_COLS + 1] = "";
+	if (g) snprintf(status, sizeof(status), "LIVE  %zu watching", b->n_viewers);
+	tb_printf(0, FRAME_ROWS, TB_WHITE, TB_DEFAULT, "%-*s", BROADCAST_COLS, status);
+
+	// The changes, then (after them in the same output) the keyframe
+	size_t delta_len, len;
+	tb_present();
+	tb_ctx_output(b->tb, &delta_len);
+	if (keyframe) tb_present_full();
+	tb_ctx_select(NULL);
+
+	// Copied once out of the context; every viewer sends from these buffers
+	const char *out = tb_ctx_output(b->tb, &len);
+	broadcast_frame_t *delta = delta_len ? frame_new(out, delta_len) : NULL;
+	broadcast_frame_t *key = keyframe ? frame_new(out + delta_len, len - delta_len) : NULL;
+	tb_ctx_consume(b->tb, len);
+
+	for (size_t i = 0; i < b->n_viewers; i++) {
+		viewer_t *v = b->viewers[i];
+		if (delta_len && !delta) v->synced = false; // missed a frame, start over from a keyframe
+		viewer_push(v, delta, key);
+		if (!viewer_flush(v)) v->closing = true;
+	}
+	if (delta) frame_unref(delta);
+	if (key) frame_unref(key);
+	sweep_viewers(b);
+}
+
+// Says goodbye to every viewer and frees everything, the listener included
+void broadcast_destroy(broadcast_t *b) {
+	for (size_t i = 0; i < b->n_viewers; i++) {
+		viewer_t *v = b->viewers[i];
+		viewer_leave(b, v);
+		viewer_flush(v);
+		viewer_destroy(b, v);
+	}
+	free(b->viewers);
+	if (b->hello) frame_unref(b->hello);
+	if (b->bye) frame_unref(b->bye);
+	tb_ctx_free(b->tb);
+	if (b->epoll_fd >= 0) close(b->epoll_fd);
+	if (b->listen_fd >= 0) close(b->listen_fd);
+	memset(b, 0, sizeof(*b));
+	b->epoll_fd = b->listen_fd = -1;
+}
@@ -0,0 +1,90 @@
+/*********************************************************************
+ * File: crafted.c                                                   *
+ * Description: boards, pieces and games made up to order from a     *
+ *              seed, for the benchmarks and tests                   *
+ *********************************************************************/
+
+#include "include/crafted.h"
+#include <string.h>
+
+// A row of random cells; rows wider than one draw take two
+row_t craft_row(rng_t *rng) {
+	row_t row = (row_t) rng_next(rng);
+#if ROW_BITS > 32
+	row = row << 32 | rng_next(rng);
+#endif
+	return row & FULL_ROW;
+}
+
+/* A board like one mid-game: a stack of random height whose top rows are
+ * ragged, with the odd hole, over rows that are one cell short of clearing
+ */
+void craft_board(rng_t *rng, bitboard_t *bb) {
+	memset(bb, 0, sizeof(*bb));
+	uint32_t height = 4 + rng_below(rng, BOARD_HEIGHT / 2);
+	for (uint32_t i = 0; i < height; i++) {
+		int8_t y = BOARD_HEIGHT - 1 - i;
+		if (i < 4) bb->rows[y] = FULL_ROW & ~ROW_BIT(rng_below(rng, BOARD_WIDTH));
+		else bb->rows[y] = craft_row(rng);
+	}
+}
+
+/* A crafted board whose bottom four rows are full but for one column, and in
+ * *tetris the vertical I piece dropped into it, which clears all 4. Returns
+ * false (leaving *tetris alone) if the stack above covers the well.
+ */
+bool craft_well(rng_t *rng, bitboard_t *bb, piece_t *tetris) {
+	craft_board(rng, bb);
+	row_t well = ROW_BIT(rng_below(rng, BOARD_WIDTH));
+	for (int8_t y = 0; y < BOARD_HEIGHT; y++) bb->rows[y] &= ~well;
+	for (int8_t y = BOARD_HEIGHT - 4; y < BOARD_HEIGHT; y++) bb->rows[y] = FULL_ROW & ~well;
+
+	// Whichever vertical I lands in the well
+	for (int8_t x = -2; x < BOARD_WIDTH; x++) {
+		piece_t p = piece_spawn(PIECE_I);
+		p.rotation = 1;
+		p.x = x;
+		p.y = -2;
+		if (piece_collides(bb, &p)) continue;
+		piece_t down = p;
+		while (down.y++, !piece_collides(bb, &down)) p = down;
+		bitboard_t placed = *bb;
+		if (bitboard_place(&placed, &p) == 4) {
+			*tetris = p;
+			return true;
+		}
+	}
+	return false;
+}
+
+// A piece somewhere over the top half of the board, not always clear of what's there
+piece_t craft_piece(rng_t *rng) {
+	piece_t p = piece_spawn((piece_type_t) rng_below(rng, PIECE_COUNT));
+	p.rotation = rng_below(rng, 4);
+	p.x = (int8_t) rng_below(rng, BOARD_WIDTH - 2) - 1;
+	p.y = (int8_t) rng_below(rng, BOARD_HEIGHT / 2);
+	return p;
+}
+
+// A piece that fits at the top of `bb` (left in *from), dropped until it lands
+piece_t craft_drop(rng_t *rng, const bitboard_t *bb, piece_t *from) {
+	piece_t p;
+	do {
+		p = craft_piece(rng);
+		p.y = -2;
+	} while (piece_collides(bb, &p));
+	*from = p;
+	piece_t down = p;
+	while (down.y++, !piece_collides(bb, &down)) p = down;
+	return p;
+}
+
+// A game seeded `seed` whose board is `bb`, its cells colored by position
+void craft_game(game_t *g, uint64_t seed, const bitboard_t *bb) {
+	game_init(g, seed);
+	g->bitboard = *bb;
+	for (int8_t y = 0; y < BOARD_HEIGHT; y++)
+		for (int8_t x = 0; x < BOARD_WIDTH; x++)
+			g->colors[y][x] = (bb->rows[y] >> x) & 1 ? PIECE_COLORS[(x + y) % PIECE_COUNT] : TB_BLACK;
+	game_refresh_columns(g);
+}
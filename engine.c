@@ -0,0 +1,693 @@
+/*********************************************************************
+ * File: engine.c                                                    *
+ * Description: headless game engine. Board, pieces and the rules    *
+ *              that move them, with no terminal I/O                 *
+ *********************************************************************/
+
+#include "include/engine.h"
+#include <string.h>
+#include <math.h>
+
+/* Every piece in every rotation, as block offsets inside its bounding box plus
+ * the same blocks as one row_t mask per box row (what collision checks use).
+ * SHAPE() derives the masks and extents from the offsets, so both views are
+ * always in sync and the whole table is a compile-time constant.
+ */
+typedef struct {
+	block_t blocks[4];
+	row_t rows[4]; // bit x of rows[y] set = box cell x,y is part of the piece
+	int8_t bottom[4]; // lowest block in each box column, -1 where there's none
+	int8_t min_x, max_x, min_y, max_y; // extents of the blocks within the box
+} shape_t;
+
+#define SHAPE_ROW(r, x0,y0, x1,y1, x2,y2, x3,y3) \
+	(row_t)(((y0) == (r) ? ROW_BIT(x0) : 0) | ((y1) == (r) ? ROW_BIT(x1) : 0) | \
+	        ((y2) == (r) ? ROW_BIT(x2) : 0) | ((y3) == (r) ? ROW_BIT(x3) : 0))
+#define SHAPE_BOTTOM(c, x0,y0, x1,y1, x2,y2, x3,y3) \
+	MAX2(MAX2((x0) == (c) ? (y0) : -1, (x1) == (c) ? (y1) : -1), MAX2((x2) == (c) ? (y2) : -1, (x3) == (c) ? (y3) : -1))
+#define MIN2(a, b) ((a) < (b) ? (a) : (b))
+#define MAX2(a, b) ((a) > (b) ? (a) : (b))
+#define SHAPE(x0,y0, x1,y1, x2,y2, x3,y3) { \
+	.blocks = {{x0,y0}, {x1,y1}, {x2,y2}, {x3,y3}}, \
+	.rows = {SHAPE_ROW(0, x0,y0, x1,y1, x2,y2, x3,y3), SHAPE_ROW(1, x0,y0, x1,y1, x2,y2, x3,y3), \
+	         SHAPE_ROW(2, x0,y0, x1,y1, x2,y2, x3,y3), SHAPE_ROW(3, x0,y0, x1,y1, x2,y2, x3,y3)}, \
+	.bottom = {SHAPE_BOTTOM(0, x0,y0, x1,y1, x2,y2, x3,y3), SHAPE_BOTTOM(1, x0,y0, x1,y1, x2,y2, x3,y3), \
+	           SHAPE_BOTTOM(2, x0,y0, x1,y1, x2,y2, x3,y3), SHAPE_BOTTOM(3, x0,y0, x1,y1, x2,y2, x3,y3)}, \
+	.min_x = MIN2(MIN2(x0, x1), MIN2(x2, x3)), \
+	.max_x = MAX2(MAX2(x0, x1), MAX2(x2, x3)), \
+	.min_y = MIN2(MIN2(y0, y1), MIN2(y2, y3)), \
+	.max_y = MAX2(MAX2(y0, y1), MAX2(y2, y3)) }
+
+// SRS orientations, y pointing down. Rotation r+1 is r turned clockwise.
+static const shape_t SHAPES[PIECE_COUNT][4] = {
+	[PIECE_I] = {SHAPE(0,1, 1,1, 2,1, 3,1), SHAPE(2,0, 2,1, 2,2, 2,3),
+	             SHAPE(0,2, 1,2, 2,2, 3,2), SHAPE(1,0, 1,1, 1,2, 1,3)},
+	[PIECE_L] = {SHAPE(2,0, 0,1, 1,1, 2,1), SHAPE(1,0, 1,1, 1,2, 2,2),
+	             SHAPE(0,1, 1,1, 2,1, 0,2), SHAPE(0,0, 1,0, 1,1, 1,2)},
+	[PIECE_J] = {SHAPE(0,0, 0,1, 1,1, 2,1), SHAPE(1,0, 2,0, 1,1, 1,2),
+	             SHAPE(0,1, 1,1, 2,1, 2,2), SHAPE(1,0, 1,1, 0,2, 1,2)},
+	[PIECE_O] = {SHAPE(1,0, 2,0, 1,1, 2,1), SHAPE(1,0, 2,0, 1,1, 2,1),
+	             SHAPE(1,0, 2,0, 1,1, 2,1), SHAPE(1,0, 2,0, 1,1, 2,1)},
+	[PIECE_S] = {SHAPE(1,0, 2,0, 0,1, 1,1), SHAPE(1,0, 1,1, 2,1, 2,2),
+	             SHAPE(1,1, 2,1, 0,2, 1,2), SHAPE(0,0, 0,1, 1,1, 1,2)},
+	[PIECE_Z] = {SHAPE(0,0, 1,0, 1,1, 2,1), SHAPE(2,0, 1,1, 2,1, 1,2),
+	             SHAPE(0,1, 1,1, 1,2, 2,2), SHAPE(1,0, 0,1, 1,1, 0,2)},
+	[PIECE_T] = {SHAPE(1,0, 0,1, 1,1, 2,1), SHAPE(1,0, 1,1, 2,1, 1,2),
+	             SHAPE(0,1, 1,1, 2,1, 1,2), SHAPE(1,0, 0,1, 1,1, 1,2)},
+};
+
+/* SRS wall kicks for a clockwise turn out of rotation [r], tried in order.
+ * These are the usual SRS offsets with y negated for our y-down board.
+ * The O piece never kicks (it doesn't rotate at all).
+ */
+#define KICK_TESTS 5
+static const block_t KICKS_JLSTZ[4][KICK_TESTS] = {
+	{{0,0}, {-1,0}, {-1,-1}, {0, 2}, {-1, 2}},
+	{{0,0}, { 1,0}, { 1, 1}, {0,-2}, { 1,-2}},
+	{{0,0}, { 1,0}, { 1,-1}, {0, 2}, { 1, 2}},
+	{{0,0}, {-1,0}, {-1, 1}, {0,-2}, {-1,-2}},
+};
+static const block_t KICKS_I[4][KICK_TESTS] = {
+	{{0,0}, {-2,0}, { 1,0}, {-2, 1}, { 1,-2}},
+	{{0,0}, {-1,0}, { 2,0}, {-1,-2}, { 2, 1}},
+	{{0,0}, { 2,0}, {-1,0}, { 2,-1}, {-1, 2}},
+	{{0,0}, { 1,0}, {-2,0}, { 1, 2}, {-2,-1}},
+};
+
+const uintattr_t PIECE_COLORS[PIECE_COUNT] = {
+	[PIECE_I] = TB_CYAN,
+	[PIECE_L] = TB_YELLOW,
+	[PIECE_J] = TB_BLUE,
+	[PIECE_O] = TB_RED,
+	[PIECE_S] = TB_GREEN,
+	[PIECE_Z] = TB_MAGENTA,
+	[PIECE_T] = TB_WHITE,
+};
+
+// Pieces spawn flat side up (rotation 2) with their top row on row 0, centered
+#define SPAWN_ROTATION 2
+#define SPAWN_X ((BOARD_WIDTH - 4) / 2)
+static const int8_t SPAWN_Y[PIECE_COUNT] = {
+	[PIECE_I] = -2, [PIECE_L] = -1, [PIECE_J] = -1, [PIECE_O] = 0,
+	[PIECE_S] = -1, [PIECE_Z] = -1, [PIECE_T] = -1,
+};
+
+static void settle_active_piece(game_t *g);
+static void raise_garbage(game_t *g);
+static void refresh_lock(game_t *g, bool reset);
+static double gravity_ms(const game_t *g);
+
+static const uint8_t GARBAGE_SENT[5] = GARBAGE_FOR_LINES;
+#define GARBAGE_SEED_SALT 0x6761726261676521ULL // so the holes don't follow the pieces
+
+_Static_assert(BOARD_WIDTH >= 4 && BOARD_HEIGHT >= 4, "every piece must fit on the board");
+_Static_assert(BOARD_WIDTH <= 8 * sizeof(row_t), "a board row must fit in a row_t");
+_Static_assert(BOARD_HEIGHT <= 64, "every row needs a bit in game_t.dirty_rows");
+
+// Where (and how) a new piece of the given type enters the board
+piece_t piece_spawn(piece_type_t type) {
+	return (piece_t) { .type = type, .rotation = SPAWN_ROTATION, .x = SPAWN_X, .y = SPAWN_Y[type] };
+}
+
+// Writes the board positions of p's 4 blocks to out
+void piece_blocks(const piece_t *p, block_t out[4]) {
+	const shape_t *s = &SHAPES[p->type][p->rotation];
+	for (uint8_t i = 0; i < 4; i++) {
+		out[i].x = p->x + s->blocks[i].x;
+		out[i].y = p->y + s->blocks[i].y;
+	}
+}
+
+/* true if any block of p is off the sides/bottom of the board or already occupied.
+ * Blocks above the board (negative y) are only checked against the walls.
+ */
+bool piece_collides(const bitboard_t *bb, const piece_t *p) {
+	const shape_t *s = &SHAPES[p->type][p->rotation];
+	if (p->x + s->min_x < 0 || p->x + s->max_x >= BOARD_WIDTH) return true;
+	if (p->y + s->max_y >= BOARD_HEIGHT) return true;
+
+	for (int8_t r = 0; r <= s->max_y; r++) {
+		int8_t y = p->y + r;
+		if (y < 0) continue;
+		// The wall check above means no set bit is shifted out either way
+		row_t mask = (p->x >= 0) ? (row_t)(s->rows[r] << p->x) : (row_t)(s->rows[r] >> -p->x);
+		if (bb->rows[y] & mask) return true;
+	}
+	return false;
+}
+
+static inline uint32_t rotl32(uint32_t x, int k) {
+	return (x << k) | (x >> (32 - k));
+}
+
+// Fills the generator's state from a 64-bit seed with splitmix64, which never
+// produces the all-zero state xoshiro can't leave
+void rng_seed(rng_t *rng, uint64_t seed) {
+	for (uint8_t i = 0; i < 4; i += 2) {
+		uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		z ^= z >> 31;
+		rng->s[i] = (uint32_t) z;
+		rng->s[i + 1] = (uint32_t) (z >> 32);
+	}
+}
+
+uint32_t rng_next(rng_t *rng) {
+	uint32_t *s = rng->s;
+	uint32_t result = rotl32(s[1] * 5, 7) * 9;
+	uint32_t t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl32(s[3], 11);
+	return result;
+}
+
+// Uniform in [0, n): draws that would make `% n` favor low values are rejected
+uint32_t rng_below(rng_t *rng, uint32_t n) {
+	uint32_t limit = -n % n; // 2^32 mod n
+	uint32_t r;
+	do {
+		r = rng_next(rng);
+	} while (r < limit);
+	return r % n;
+}
+
+// Deals the next piece from the bag, shuffling a fresh one (Fisher-Yates) once
+// it's empty. Every run of 7 pieces therefore has one of each.
+static uint8_t next_bag_piece(game_t *g) {
+	if (g->bag_left == 0) {
+		for (uint8_t i = 0; i < PIECE_COUNT; i++) {
+			g->bag[i] = i;
+		}
+		for (uint8_t i = PIECE_COUNT - 1; i > 0; i--) {
+			uint8_t j = rng_below(&g->rng, i + 1);
+			uint8_t tmp = g->bag[i];
+			g->bag[i] = g->bag[j];
+			g->bag[j] = tmp;
+		}
+		g->bag_left = PIECE_COUNT;
+	}
+	return g->bag[--g->bag_left];
+}
+
+// The type of the i-th piece due after the active one (0 = next)
+piece_type_t game_preview(const game_t *g, uint8_t i) {
+	return g->preview[(g->preview_head + i) % PREVIEW_COUNT];
+}
+
+// Takes the next piece off the preview queue and makes it the active one,
+// ending the game if it spawns on top of any existing "settled" blocks
+static void create_new_active_piece(game_t *g) {
+	uint8_t i = g->preview[g->preview_head];
+	g->preview[g->preview_head] = next_bag_piece(g);
+	g->preview_head = (g->preview_head + 1) % PREVIEW_COUNT;
+	g->active_piece = piece_spawn(i);
+
+	if (piece_collides(&g->bitboard, &g->active_piece)) {
+		g->over = true;
+		g->events |= GAME_EVENT_OVER;
+		return;
+	}
+
+	// A fresh piece starts falling once any line clear delay is over
+	uint32_t start_ms = game_clearing(g) ? g->clear_until_ms : g->time_ms;
+	g->next_drop_ms = start_ms + gravity_ms(g);
+	g->locking = false;
+	g->lock_resets = 0;
+	refresh_lock(g, false);
+}
+
+// Sets the board to all black and creates a fresh active piece.
+// Games started with the same seed get the same pieces in the same order.
+void game_init(game_t *g, uint64_t seed) {
+	memset(g, 0, sizeof(*g));
+	g->seed = seed;
+	rng_seed(&g->rng, seed);
+	rng_seed(&g->garbage_rng, seed ^ GARBAGE_SEED_SALT);
+	for (uint8_t i = 0; i < PREVIEW_COUNT; i++) {
+		g->preview[i] = next_bag_piece(g);
+	}
+	g->drop_speed = 1000.0; // start by moving piece down every second
+	g->dirty_rows = ~0ULL;
+	game_refresh_columns(g);
+	g->next_drop_ms = g->drop_speed;
+
+	for (uint8_t row = 0; row < BOARD_HEIGHT; row++) {
+		for (uint8_t col = 0; col < BOARD_WIDTH; col++) {
+			g->colors[row][col] = TB_BLACK;
+		}
+	}
+
+	create_new_active_piece(g);
+}
+
+/* Moves the active piece in the direction specified
+ * returns true if the piece is still in play after the move
+ * returns false if the piece "settled" on the board after the move
+ */
+bool game_move(game_t *g, direc_t d) {
+	if (g->over) return false;
+
+	piece_t moved = g->active_piece;
+	moved.x += (d == LEFT) ? -1 : (d == RIGHT) ? 1 : 0;
+	moved.y += (d == DOWN) ? 1 : 0;
+
+	// Check if the new position is valid
+	if (piece_collides(&g->bitboard, &moved)) {
+		if (d != DOWN) return true; // This is a "valid" move, but the piece doesn't change positions
+
+		settle_active_piece(g);
+		return false; // Piece hit the bottom of the board or another "settled" piece
+	}
+
+	// All guard clauses passed: move to new position
+	g->active_piece = moved;
+	g->events |= GAME_EVENT_MOVED;
+	return true;
+}
+
+/* Rotates the active piece clockwise if there is room for it, trying each
+ * SRS kick in turn so it can be nudged off walls and other pieces
+ * returns true if the piece changed orientation
+ */
+bool game_rotate(game_t *g) {
+	if (g->over) return false;
+	if (!piece_rotate(&g->bitboard, &g->active_piece)) return false;
+
+	g->events |= GAME_EVENT_MOVED;
+	return true;
+}
+
+/* Turns p clockwise on bb, taking the first SRS kick that fits
+ * returns false (leaving p alone) if none of them do
+ */
+bool piece_rotate(const bitboard_t *bb, piece_t *p) {
+	if (p->type == PIECE_O) return false; // O-Block has no rotations. Skip.
+
+	const block_t *kicks = (p->type == PIECE_I) ? KICKS_I[p->rotation] : KICKS_JLSTZ[p->rotation];
+	piece_t turned = { .type = p->type, .rotation = (p->rotation + 1) % 4 };
+	for (uint8_t i = 0; i < KICK_TESTS; i++) {
+		turned.x = p->x + kicks[i].x;
+		turned.y = p->y + kicks[i].y;
+		// Rotations that end up above the board are fine
+		if (piece_collides(bb, &turned)) continue;
+
+		*p = turned;
+		return true;
+	}
+	return false;
+}
+
+/* What row y holding `row` adds to a board's hash. Whole rows are keyed
+ * rather than single cells (as in Zobrist hashing proper), because a line
+ * clear moves every row above it: rekeying those is then one mix per row.
+ */
+static inline uint64_t row_key(int8_t y, row_t row) {
+	uint64_t k = (uint64_t) row + (uint64_t) (y + 1) * 0x9E3779B97F4A7C15ULL;
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDULL;
+	k ^= k >> 33;
+	k *= 0xC4CEB9FE1A85EC53ULL;
+	return k ^ (k >> 33);
+}
+
+// Identifies a board for lookups (see bot.c): XOR of row_key() over every row
+uint64_t bitboard_hash(const bitboard_t *bb) {
+	uint64_t h = 0;
+	for (int8_t y = 0; y < BOARD_HEIGHT; y++) {
+		h ^= row_key(y, bb->rows[y]);
+	}
+	return h;
+}
+
+// Both of the below; `hash` is NULL for bitboard_place(), and the checks fold away
+static inline int8_t place(bitboard_t *bb, const piece_t *p, uint64_t *hash) {
+	const shape_t *s = &SHAPES[p->type][p->rotation];
+	if (p->y + s->min_y < 0) return -1;
+
+	int8_t lines = 0;
+	for (int8_t r = s->min_y; r <= s->max_y; r++) {
+		int8_t y = p->y + r;
+		row_t before = bb->rows[y];
+		bb->rows[y] |= (p->x >= 0) ? (row_t)(s->rows[r] << p->x) : (row_t)(s->rows[r] >> -p->x);
+		if (hash) *hash ^= row_key(y, before) ^ row_key(y, bb->rows[y]);
+		if (bb->rows[y] != FULL_ROW) continue;
+
+		// Every row from 0 to y takes the one above it (and 0 comes in empty)
+		if (hash) {
+			for (int8_t z = y; z > 0; z--) {
+				*hash ^= row_key(z, bb->rows[z]) ^ row_key(z, bb->rows[z - 1]);
+			}
+			*hash ^= row_key(0, bb->rows[0]) ^ row_key(0, 0);
+		}
+		// Rows are visited top to bottom, so the ones still to check never shift
+		memmove(&bb->rows[1], &bb->rows[0], y * sizeof(row_t));
+		bb->rows[0] = 0;
+		lines++;
+	}
+	return lines;
+}
+
+/* Writes p into bb and removes any lines it completes, the way settling the
+ * active piece does but for the occupancy bits only (for searches that try
+ * placements out on copies of the board)
+ * returns the number of lines cleared, or -1 if p is (partly) above the board
+ */
+int8_t bitboard_place(bitboard_t *bb, const piece_t *p) {
+	return place(bb, p, NULL);
+}
+
+// bitboard_place() that also updates `*hash`, the board's bitboard_hash()
+int8_t bitboard_place_hashed(bitboard_t *bb, const piece_t *p, uint64_t *hash) {
+	return place(bb, p, hash);
+}
+
+/* Works column_top out again from the bitboard. The engine keeps it up to
+ * date itself; this is for boards written some other way (tests, benches).
+ */
+void game_refresh_columns(game_t *g) {
+	row_t seen = 0;
+	for (uint8_t x = 0; x < BOARD_WIDTH; x++) {
+		g->column_top[x] = BOARD_HEIGHT;
+	}
+	for (int8_t y = 0; y < BOARD_HEIGHT && seen != FULL_ROW; y++) {
+		row_t fresh = g->bitboard.rows[y] & (row_t) ~seen; // columns that start on this row
+		seen |= fresh;
+		for (; fresh; fresh &= fresh - 1) {
+			g->column_top[__builtin_ctzll(fresh)] = y;
+		}
+	}
+}
+
+/* How many rows p can fall before it lands. Over the stack that's the
+ * smallest gap between the bottom of one of its columns and the top of that
+ * column on the board, with no collision tests. A piece tucked under an
+ * overhang has filled cells above it, so it falls back to stepping down.
+ */
+int8_t game_drop_distance(const game_t *g, const piece_t *p) {
+	const shape_t *s = &SHAPES[p->type][p->rotation];
+	int8_t distance = BOARD_HEIGHT;
+	for (int8_t c = s->min_x; c <= s->max_x; c++) {
+		int8_t x = p->x + c, bottom = p->y + s->bottom[c];
+		if (s->bottom[c] < 0) continue;
+		if (bottom >= g->column_top[x]) {
+			piece_t down = *p;
+			while (!piece_collides(&g->bitboard, &(piece_t) { down.type, down.rotation, down.x, down.y + 1 }))
+				down.y++;
+			return down.y - p->y;
+		}
+		if (g->column_top[x] - 1 - bottom < distance) distance = g->column_top[x] - 1 - bottom;
+	}
+	return distance;
+}
+
+// Drops the active piece straight to where it lands and settles it there
+void game_hard_drop(game_t *g) {
+	if (g->over) return;
+	int8_t distance = game_drop_distance(g, &g->active_piece);
+	if (distance > 0) {
+		g->active_piece.y += distance;
+		g->events |= GAME_EVENT_MOVED;
+	}
+	game_move(g, DOWN); // can't go any further, so it settles
+}
+
+// One gravity step: returns false if the piece settled instead of falling
+bool game_step(game_t *g) {
+	return game_move(g, DOWN);
+}
+
+// true if the active piece is resting on the floor or on settled blocks
+static bool piece_grounded(const game_t *g) {
+	piece_t below = g->active_piece;
+	below.y++;
+	return piece_collides(&g->bitboard, &below);
+}
+
+/* Starts, restarts (if `reset` and there are resets left) or cancels the lock
+ * delay depending on whether the active piece is now resting on something.
+ * Like gravity, the delay only runs once any line clear delay is over.
+ */
+static void refresh_lock(game_t *g, bool reset) {
+	uint32_t from_ms = game_clearing(g) ? g->clear_until_ms : g->time_ms;
+	if (piece_grounded(g)) {
+		if (!g->locking) {
+			g->locking = true;
+			g->lock_at_ms = from_ms + LOCK_DELAY_MS;
+		}
+		else if (reset && g->lock_resets < MAX_LOCK_RESETS) {
+			g->lock_resets++;
+			g->lock_at_ms = from_ms + LOCK_DELAY_MS;
+		}
+	}
+	else if (g->locking) {
+		// Slid off a ledge: back to falling
+		g->locking = false;
+		g->next_drop_ms = from_ms + gravity_ms(g);
+	}
+}
+
+// true while the game is waiting out the delay after a line clear
+bool game_clearing(const game_t *g) {
+	return g->time_ms < g->clear_until_ms;
+}
+
+// Time between gravity steps, shortened while soft drop is held
+static double gravity_ms(const game_t *g) {
+	return (g->held & HELD_SOFT_DROP) ? g->drop_speed / SOFT_DROP_FACTOR : g->drop_speed;
+}
+
+static uint8_t held_bit(direc_t d) {
+	return d == LEFT ? HELD_LEFT : HELD_RIGHT;
+}
+
+// Whether a held left/right is auto shifting (see game_update())
+static bool shift_held(const game_t *g) {
+	return g->held & (HELD_LEFT | HELD_RIGHT);
+}
+
+// A held key shifts once right away, then repeats once DAS_MS has passed
+static void press_shift(game_t *g, direc_t d) {
+	g->held |= held_bit(d);
+	g->shifting = d;
+	g->shift_at_ms = g->time_ms + DAS_MS;
+	game_move(g, d);
+}
+
+// Letting go of the repeating direction with the other one still down
+// hands the repeat over to it, starting from its own delay
+static void release_shift(game_t *g, direc_t d) {
+	g->held &= ~held_bit(d);
+	if (g->shifting != d || !shift_held(g)) return;
+	g->shifting = (d == LEFT) ? RIGHT : LEFT;
+	g->shift_at_ms = g->time_ms + DAS_MS;
+}
+
+// One auto repeat. Like any shift that moves the piece, it restarts the lock delay.
+static void repeat_shift(game_t *g) {
+	int8_t x = g->active_piece.x;
+	game_move(g, g->shifting);
+	if (g->active_piece.x != x) refresh_lock(g, true);
+}
+
+/* Runs gravity, lock delay and the auto repeat of held keys up to `now_ms`
+ * of game time, in the order they fell due, so a slow caller still gets
+ * every step it missed (several rows a call once drop_speed is shorter than
+ * the call interval). Repeats are timed by the engine rather than by when
+ * the terminal's key repeat happens to arrive, so they replay exactly.
+ */
+void game_update(game_t *g, uint32_t now_ms) {
+	while (!g->over) {
+		double due_ms = g->locking ? g->lock_at_ms : g->next_drop_ms;
+		bool shift = shift_held(g) && g->shift_at_ms < due_ms;
+		if (shift) due_ms = g->shift_at_ms;
+		if (due_ms > now_ms) break;
+		g->time_ms = (uint32_t) due_ms;
+
+		if (shift) {
+			g->shift_at_ms += ARR_MS;
+			repeat_shift(g);
+		}
+		else if (g->locking) {
+			g->locking = false;
+			game_move(g, DOWN); // still grounded, so this settles it
+		}
+		else if (game_move(g, DOWN)) {
+			g->next_drop_ms += gravity_ms(g);
+			refresh_lock(g, false);
+		}
+	}
+	if (now_ms > g->time_ms) g->time_ms = now_ms;
+}
+
+// The next game time at which game_update() has something to do
+uint32_t game_next_deadline(const game_t *g) {
+	uint32_t due_ms = game_clearing(g) ? g->clear_until_ms
+	                  : g->locking    ? g->lock_at_ms
+	                                  : (uint32_t) ceil(g->next_drop_ms);
+	if (shift_held(g) && g->shift_at_ms < due_ms) due_ms = g->shift_at_ms;
+	return due_ms;
+}
+
+/* Applies one input at the current game time (see game_update())
+ */
+void game_apply_input(game_t *g, input_t in) {
+	if (g->over) return;
+
+	piece_t before = g->active_piece;
+	switch (in) {
+		case INPUT_LEFT:
+			game_move(g, LEFT);
+			break;
+		case INPUT_RIGHT:
+			game_move(g, RIGHT);
+			break;
+		case INPUT_ROTATE:
+			game_rotate(g);
+			break;
+		case INPUT_SOFT_DROP:
+			if (game_clearing(g)) return; // the next piece isn't in play yet
+			// Soft dropping a landed piece settles it right away
+			if (game_move(g, DOWN)) g->next_drop_ms = g->time_ms + gravity_ms(g);
+			break;
+		case INPUT_PRESS_LEFT:
+		case INPUT_PRESS_RIGHT:
+			press_shift(g, in == INPUT_PRESS_LEFT ? LEFT : RIGHT);
+			break;
+		case INPUT_RELEASE_LEFT:
+		case INPUT_RELEASE_RIGHT:
+			release_shift(g, in == INPUT_RELEASE_LEFT ? LEFT : RIGHT);
+			return;
+		case INPUT_PRESS_SOFT_DROP:
+			g->held |= HELD_SOFT_DROP;
+			if (game_clearing(g)) return;
+			if (game_move(g, DOWN)) g->next_drop_ms = g->time_ms + gravity_ms(g);
+			break;
+		case INPUT_RELEASE_SOFT_DROP:
+			// Gravity is back to normal after the (sped up) step already due
+			g->held &= ~HELD_SOFT_DROP;
+			return;
+		case INPUT_COUNT:
+			return;
+		case INPUT_HARD_DROP:
+			if (game_clearing(g)) return;
+			game_hard_drop(g);
+			return;
+	}
+
+	// Only a piece that actually moved gets its lock delay restarted
+	if (!g->over && memcmp(&before, &g->active_piece, sizeof(before)) != 0)
+		refresh_lock(g, true);
+}
+
+/* "Settles" the active piece by writing its current position
+ * to the board and creating a new active piece,
+ * clearing lines if necessary
+ */
+static void settle_active_piece(game_t *g) {
+	block_t blocks[4];
+	piece_blocks(&g->active_piece, blocks);
+	uintattr_t color = PIECE_COLORS[g->active_piece.type];
+
+	for (uint8_t i = 0; i < 4; i++) {
+		if (blocks[i].y < 0) {
+			// Piece settled (at least partly) above the board
+			g->over = true;
+			g->events |= GAME_EVENT_OVER;
+			return;
+		}
+		block_t b = blocks[i];
+		g->bitboard.rows[b.y] |= ROW_BIT(b.x);
+		g->colors[b.y][b.x] = color;
+		g->dirty_rows |= 1ULL << b.y;
+		if (b.y < g->column_top[b.x]) g->column_top[b.x] = b.y;
+	}
+	g->pieces_placed++;
+	g->events |= GAME_EVENT_SETTLED;
+
+	// Find full rows, top to bottom. Only rows the piece touched can have filled up.
+	line_clear_t *clear = &g->last_clear;
+	clear->count = 0;
+	for (int8_t row = 0; row < BOARD_HEIGHT; row++) {
+		bool touched = false;
+		for (uint8_t i = 0; i < 4; i++) {
+			if (blocks[i].y == row) touched = true;
+		}
+		if (!touched || g->bitboard.rows[row] != FULL_ROW) continue;
+
+		clear->rows[clear->count] = row;
+		memcpy(clear->colors[clear->count], g->colors[row], sizeof(g->colors[row]));
+		clear->count++;
+	}
+
+	// Remove each line by sliding everything above it down one row.
+	// Going top to bottom means the rows still to be cleared never shift.
+	for (uint8_t i = 0; i < clear->count; i++) {
+		int8_t row = clear->rows[i];
+		memmove(&g->bitboard.rows[1], &g->bitboard.rows[0], row * sizeof(row_t));
+		memmove(&g->colors[1], &g->colors[0], row * sizeof(g->colors[0]));
+		g->bitboard.rows[0] = 0;
+		for (uint8_t col = 0; col < BOARD_WIDTH; col++) {
+			g->colors[0][col] = TB_BLACK;
+		}
+		g->dirty_rows |= (2ULL << row) - 1; // every row from the top down to this one moved
+	}
+	if (clear->count > 0) {
+		game_refresh_columns(g); // the rows that came down bring their holes with them
+		g->lines_cleared += clear->count;
+		g->events |= GAME_EVENT_LINES;
+		g->clear_until_ms = g->time_ms + LINE_CLEAR_DELAY_MS;
+
+		// Send garbage, after cancelling what's on its way here
+		uint8_t sent = GARBAGE_SENT[clear->count], cancelled = sent < g->garbage_in ? sent : g->garbage_in;
+		g->garbage_in -= cancelled;
+		g->garbage_out += sent - cancelled;
+	}
+	else if (g->garbage_in) {
+		raise_garbage(g);
+		if (g->over) return;
+	}
+
+	create_new_active_piece(g);
+}
+
+/* Queues `rows` of garbage for `g` (sent by its opponent's line clears).
+ * They rise once the next piece settles without clearing a line.
+ */
+void game_add_garbage(game_t *g, uint8_t rows) {
+	unsigned total = g->garbage_in + rows;
+	g->garbage_in = total < BOARD_HEIGHT ? total : BOARD_HEIGHT; // any more would only top out the same
+}
+
+/* Brings all the waiting garbage up from the bottom: the board shifts up a
+ * row for each, and the new rows are full but for one hole, in the same
+ * column for the whole batch. Anything pushed off the top ends the game.
+ */
+static void raise_garbage(game_t *g) {
+	uint8_t n = g->garbage_in;
+	g->garbage_in = 0;
+	for (uint8_t row = 0; row < n; row++) {
+		if (g->bitboard.rows[row]) {
+			g->over = true;
+			g->events |= GAME_EVENT_OVER;
+			return;
+		}
+	}
+
+	memmove(&g->bitboard.rows[0], &g->bitboard.rows[n], (BOARD_HEIGHT - n) * sizeof(row_t));
+	memmove(&g->colors[0], &g->colors[n], (BOARD_HEIGHT - n) * sizeof(g->colors[0]));
+	uint8_t hole = rng_below(&g->garbage_rng, BOARD_WIDTH);
+	for (uint8_t row = BOARD_HEIGHT - n; row < BOARD_HEIGHT; row++) {
+		g->bitboard.rows[row] = FULL_ROW & (row_t) ~ROW_BIT(hole);
+		for (uint8_t col = 0; col < BOARD_WIDTH; col++) {
+			g->colors[row][col] = col == hole ? TB_BLACK : GARBAGE_COLOR;
+		}
+	}
+	game_refresh_columns(g);
+	g->dirty_rows = ~0ULL;
+	g->events |= GAME_EVENT_GARBAGE;
+}
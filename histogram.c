@@ -0,0 +1,80 @@
+/*********************************************************************
+ * File: histogram.c                                                 *
+ * Description: HDR-style latency histograms: fixed memory, constant *
+ *              time to record, about 3% error at any magnitude      *
+ *********************************************************************/
+
+#include "include/histogram.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+// Milliseconds on a clock that only ever moves forward, which timings are taken on
+double monotonic_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Which of h->counts a value is counted in
+uint32_t histogram_bucket(uint64_t us) {
+	if (us >= HISTOGRAM_MAX_US) return HISTOGRAM_BUCKETS - 1;
+	if (us < 2 * HISTOGRAM_SUB_BUCKETS) return (uint32_t) us;
+	int msb = 63 - __builtin_clzll(us);
+	int shift = msb - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (uint32_t) (us >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+// The middle of what a bucket holds, which is what percentiles report
+static uint64_t bucket_value(uint32_t b) {
+	if (b < 2 * HISTOGRAM_SUB_BUCKETS) return b;
+	int shift = b / HISTOGRAM_SUB_BUCKETS - 1;
+	uint64_t lowest = (uint64_t) (b % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+	return lowest + ((UINT64_C(1) << shift) >> 1);
+}
+
+void histogram_reset(histogram_t *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+// Negative values (a clock stepping back) count as 0
+void histogram_record(histogram_t *h, double us) {
+	uint64_t v = us > 0 ? (uint64_t) us : 0;
+	h->counts[histogram_bucket(v)]++;
+	if (h->total == 0 || v < h->min_us) h->min_us = v;
+	if (v > h->max_us) h->max_us = v;
+	h->total++;
+	h->sum_us += us > 0 ? us : 0;
+}
+
+// The value `percent` (0-100) of everything recorded is at or below, 0 if empty
+uint64_t histogram_percentile(const histogram_t *h, double percent) {
+	if (h->total == 0) return 0;
+	if (percent >= 100) return h->max_us;
+	uint64_t rank = (uint64_t) ceil(percent / 100.0 * h->total), seen = 0;
+	if (rank == 0) rank = 1;
+	for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		seen += h->counts[b];
+		if (seen >= rank) {
+			uint64_t v = bucket_value(b);
+			// The exact extremes beat a bucket's middle
+			return v < h->min_us ? h->min_us : (v > h->max_us ? h->max_us : v);
+		}
+	}
+	return h->max_us;
+}
+
+double histogram_mean(const histogram_t *h) {
+	return h->total ? h->sum_us / h->total : 0;
+}
+
+/* One line per histogram, as space-separated key=value pairs (times in us),
+ * so dumps are easy to grep, diff and load into a spreadsheet
+ */
+void histogram_print(const histogram_t *h, const char *name, FILE *out) {
+	fprintf(out, "%s count=%llu min=%llu p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu mean=%.1f\n",
+	        name, (unsigned long long) h->total, (unsigned long long) h->min_us,
+	        (unsigned long long) histogram_percentile(h, 50), (unsigned long long) histogram_percentile(h, 90),
+	        (unsigned long long) histogram_percentile(h, 99), (unsigned long long) histogram_percentile(h, 99.9),
+	        (unsigned long long) h->max_us, histogram_mean(h));
+}
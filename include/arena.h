@@ -0,0 +1,43 @@
+/*********************************************************************
+ * File: arena.h                                                     *
+ * Description: bump allocator for short-lived data that is all     *
+ *              thrown away at once, like a search's nodes           *
+ *********************************************************************/
+
+#ifndef ARENA_HEADER_INCLUDED
+#define ARENA_HEADER_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 16 // every allocation starts on this boundary
+#define ARENA_MIN_BLOCK (64 * 1024) // the smallest block an arena mallocs
+
+typedef struct arena_block {
+	struct arena_block *prev;
+	size_t size, used;
+	_Alignas(ARENA_ALIGN) unsigned char data[];
+} arena_block_t;
+
+/* Allocations are bumped off the newest block and never freed on their
+ * own; arena_reset() takes them all back. An arena that ran out of room is
+ * folded into a single block at the next reset, so once it has seen its
+ * biggest workload every allocation comes out of one contiguous block and
+ * it never calls malloc() again. Not thread safe: one owner per arena.
+ */
+typedef struct {
+	arena_block_t *block; // newest, the one allocations come from
+	size_t used; // bytes handed out since the last reset, over every block
+	size_t capacity; // bytes in every block
+	size_t peak; // the most `used` has ever been
+	uint64_t resets;
+	uint64_t mallocs; // blocks allocated, which stops going up once `capacity` is enough
+} arena_t;
+
+void arena_init(arena_t *a);
+void *arena_alloc(arena_t *a, size_t size);
+void arena_reset(arena_t *a);
+void arena_destroy(arena_t *a);
+
+#endif
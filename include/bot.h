@@ -0,0 +1,80 @@
+/*********************************************************************
+ * File: bot.h                                                       *
+ * Description: a computer player. Searches every reachable          *
+ *              placement of the active and upcoming pieces and      *
+ *              plays toward the best one                            *
+ *********************************************************************/
+
+#ifndef BOT_HEADER_INCLUDED
+#define BOT_HEADER_INCLUDED
+
+#include "engine.h"
+#include "pool.h"
+#include "arena.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Generous: a piece has ~40 distinct resting places on an open 10-wide board,
+// and about 4 more for every extra column
+#define BOT_MAX_PLACEMENTS (BOARD_WIDTH <= 16 ? 256 : 16 * BOARD_WIDTH)
+#define BOT_MAX_DEPTH (PREVIEW_COUNT + 1) // the active piece plus the whole preview
+#define BOT_DEFAULT_DEPTH (BOARD_WIDTH <= 16 ? 3 : 2) // each level multiplies the boards scored by ~4x the width
+
+/* Candidate boards scored together by bot_evaluate_batch(). Rows are stored
+ * structure-of-arrays, row y of every candidate side by side, so one SIMD
+ * register holds the same row of 8 (SSE2, NEON) or 16 (AVX2) boards.
+ */
+#define BOT_BATCH 16
+typedef struct {
+	uint8_t n;
+	row_t rows[BOARD_HEIGHT][BOT_BATCH];
+	int16_t lines[BOT_BATCH];
+} bot_batch_t;
+
+/* The transposition table: what searching a board with a given run of pieces
+ * came to, so a board that different placements lead to is only searched
+ * once. Shared by every search thread without locks. Each word is written
+ * on its own, and `check` is the key XORed with the other two, so an entry
+ * a reader catches half written just doesn't match. Entries are overwritten
+ * whatever they held, and kept from one search to the next.
+ */
+#define BOT_TT_BITS 16 // 2^16 entries of 32 bytes
+typedef struct {
+	_Alignas(32) _Atomic uint64_t check;
+	_Atomic uint64_t score; // the double's bits
+	_Atomic uint64_t move; // best placement of the first piece, see pack_piece()
+} bot_tt_entry_t;
+
+/* What each thread taking part in a search keeps to itself: [0] for the
+ * thread calling bot_choose(), then one per pool worker. Each is a cache
+ * line of its own, since the counters go up all through a search.
+ */
+typedef struct {
+	_Alignas(64) arena_t arena; // the search's tasks, all reset once it's done
+	uint64_t tt_probes, tt_hits;
+	uint64_t nodes; // boards a piece was placed on, since the last bot_choose() took them
+} bot_thread_t;
+
+typedef struct {
+	uint8_t depth; // pieces searched: the active one, then depth-1 from the preview
+	pool_t *pool; // where the search tree is spread out, NULL to search on the caller
+	bool planned;
+	uint32_t planned_for; // game_t.pieces_placed when `target` was picked
+	piece_t target; // where the active piece should end up
+
+	bot_thread_t *threads;
+	unsigned n_threads;
+	size_t arena_peak; // the most bytes one search has taken, over every arena
+	bot_tt_entry_t *tt; // 1 << BOT_TT_BITS entries
+} bot_t;
+
+bool bot_init(bot_t *bot, uint8_t depth, pool_t *pool);
+void bot_destroy(bot_t *bot);
+uint16_t bot_placements(const bitboard_t *bb, piece_t start, piece_t out[BOT_MAX_PLACEMENTS]);
+double bot_evaluate(const bitboard_t *bb, int lines);
+void bot_batch_add(bot_batch_t *batch, const bitboard_t *bb, int lines);
+void bot_evaluate_batch(const bot_batch_t *batch, double scores[BOT_BATCH]);
+bool bot_choose(bot_t *bot, const game_t *g, piece_t *best);
+int bot_next_input(bot_t *bot, const game_t *g);
+
+#endif
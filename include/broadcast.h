@@ -0,0 +1,73 @@
+/*********************************************************************
+ * File: broadcast.h                                                 *
+ * Description: one game watched by any number of spectators. Each   *
+ *              frame is drawn once and shared by every viewer       *
+ *********************************************************************/
+
+#ifndef BROADCAST_HEADER_INCLUDED
+#define BROADCAST_HEADER_INCLUDED
+
+#include "engine.h"
+#include "render.h"
+#include "server.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VIEWER_QUEUE_SIZE 64 // frames a viewer can have waiting, about a second's worth (a power of 2)
+#define VIEWER_BEHIND_MAX (64 * 1024) // bytes a viewer can have waiting before it skips ahead
+#define KEYFRAME_MIN_TICKS 15 // keyframes are at least this many ticks apart, however many viewers are waiting
+#define BROADCAST_COLS FRAME_COLS // the board and its frame...
+#define BROADCAST_ROWS (FRAME_ROWS + 1) // ...and a status line under it
+
+/* One frame of terminal output, written once and queued to every viewer
+ * by reference. Freed when the last queue lets go of it. Frames are only
+ * touched on the reactor thread, so the count needs no atomics.
+ */
+typedef struct {
+	uint32_t refs;
+	size_t len;
+	char data[];
+} broadcast_frame_t;
+
+/* A spectator's socket and the frames it hasn't been sent yet, oldest first.
+ * A viewer that isn't `synced` gets nothing until the next keyframe, since
+ * the changes in every other frame only make sense on top of the one before.
+ */
+typedef struct {
+	int fd;
+	bool synced;
+	bool closing; // disconnect once its queue is written (or the client went away)
+	bool want_writable; // waiting on EPOLLOUT
+	parse_state_t parse; // the telnet filter, across reads
+	broadcast_frame_t *queue[VIEWER_QUEUE_SIZE];
+	uint32_t head, tail; // count up forever; slots are taken modulo VIEWER_QUEUE_SIZE
+	uint32_t must_send; // frames before this one are never skipped (hello and bye)
+	size_t head_sent; // bytes of queue[head] already written
+	size_t pending; // bytes still to be written
+} viewer_t;
+
+/* The spectator side of the server: its own listener and epoll set (which
+ * the server's reactor watches as one fd), a screen the watched game is
+ * drawn on, and everyone watching.
+ */
+typedef struct {
+	int listen_fd;
+	int epoll_fd;
+	struct tb_ctx *tb;
+	renderer_t renderer;
+	bool drew_game; // the screen shows a game...
+	bool drew_waiting; // ...or says nobody is playing
+	bool drew_over; // the game over text is on screen
+	uint32_t since_keyframe; // frames
+	broadcast_frame_t *hello, *bye; // what every viewer gets first and last
+	viewer_t **viewers;
+	size_t n_viewers, viewers_cap;
+} broadcast_t;
+
+bool broadcast_init(broadcast_t *b, int listen_fd, bool lean);
+void broadcast_poll(broadcast_t *b);
+void broadcast_tick(broadcast_t *b, const game_t *g);
+void broadcast_destroy(broadcast_t *b);
+
+#endif
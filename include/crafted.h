@@ -0,0 +1,22 @@
+/*********************************************************************
+ * File: crafted.h                                                   *
+ * Description: boards, pieces and games made up to order from a     *
+ *              seed, for the benchmarks and tests                   *
+ *********************************************************************/
+
+#ifndef CRAFTED_HEADER_INCLUDED
+#define CRAFTED_HEADER_INCLUDED
+
+#include "engine.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Everything is drawn from the caller's rng, so the same seed crafts the same things
+row_t craft_row(rng_t *rng);
+void craft_board(rng_t *rng, bitboard_t *bb);
+bool craft_well(rng_t *rng, bitboard_t *bb, piece_t *tetris);
+piece_t craft_piece(rng_t *rng);
+piece_t craft_drop(rng_t *rng, const bitboard_t *bb, piece_t *from);
+void craft_game(game_t *g, uint64_t seed, const bitboard_t *bb);
+
+#endif
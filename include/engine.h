@@ -0,0 +1,219 @@
+/*********************************************************************
+ * File: engine.h                                                    *
+ * Description: headless game engine. Board, pieces and the rules    *
+ *              that move them, with no terminal I/O                 *
+ *********************************************************************/
+
+#ifndef ENGINE_HEADER_INCLUDED
+#define ENGINE_HEADER_INCLUDED
+
+// Only termbox's color type and constants are used here. The engine never
+// touches the terminal, so it is safe to include without TB_IMPL.
+#ifndef __TERMBOX_H
+	#include "termbox.h"
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The board size is fixed at build time, so every loop bound and mask in the
+ * engine is a constant. Other sizes are a compiler flag away, e.g.
+ * -DBOARD_WIDTH=40 -DBOARD_HEIGHT=30 (see `make big`).
+ */
+#ifndef BOARD_WIDTH
+	#define BOARD_WIDTH 10 // 4 to 64 (a whole row has to fit in a row_t)
+#endif
+#ifndef BOARD_HEIGHT
+	#define BOARD_HEIGHT 20 // 4 to 64 (see game_t.dirty_rows)
+#endif
+
+/* Occupancy is kept as one bitmask per row (bit x set = column x is filled), so
+ * collision checks are ANDs against a row and a full line is just FULL_ROW.
+ * Rows are the narrowest type the width fits in: 16 bits for the standard
+ * board (what the bot's SIMD evaluator works on), up to 64 for big ones.
+ */
+#if BOARD_WIDTH <= 16
+	typedef uint16_t row_t;
+	#define ROW_BITS 16
+	#define ROW_POPCOUNT(r) __builtin_popcount(r)
+#elif BOARD_WIDTH <= 32
+	typedef uint32_t row_t;
+	#define ROW_BITS 32
+	#define ROW_POPCOUNT(r) __builtin_popcount(r)
+#else
+	typedef uint64_t row_t;
+	#define ROW_BITS 64
+	#define ROW_POPCOUNT(r) __builtin_popcountll(r)
+#endif
+#define ROW_BIT(x) ((row_t)((row_t)1 << (x))) // column x alone
+#define FULL_ROW ((row_t)(BOARD_WIDTH == ROW_BITS ? (row_t)~(row_t)0 : ROW_BIT(BOARD_WIDTH % ROW_BITS) - 1))
+
+typedef struct {
+	row_t rows[BOARD_HEIGHT]; // top (y = 0) to bottom
+} bitboard_t;
+
+// Game board locations need to be signed to account for, e.g., rotating
+// a piece right as it spawns, which puts it above the board (negative y-value)
+typedef struct {
+	int8_t x;
+	int8_t y;
+} block_t;
+
+// The seven tetrominoes. Indexes PIECE_COLORS and the shape/kick tables in engine.c.
+typedef enum {
+	PIECE_I,
+	PIECE_L,
+	PIECE_J,
+	PIECE_O,
+	PIECE_S,
+	PIECE_Z,
+	PIECE_T,
+	PIECE_COUNT
+} piece_type_t;
+
+// A game piece (a tetromino) is made of 4 blocks, laid out by its type and
+// rotation (0-3, SRS numbering) inside a bounding box whose top-left is at x,y
+typedef struct {
+	uint8_t type; // a piece_type_t
+	uint8_t rotation;
+	int8_t x;
+	int8_t y;
+} piece_t;
+
+extern const uintattr_t PIECE_COLORS[PIECE_COUNT];
+
+// Pseudo-random number generator (xoshiro128**). Each game owns one, so a game
+// is fully determined by its seed and games on different threads never share state.
+typedef struct {
+	uint32_t s[4];
+} rng_t;
+
+#define PREVIEW_COUNT 5 // upcoming pieces a front end can show, see game_preview()
+
+typedef enum {
+	LEFT,
+	RIGHT,
+	DOWN // pieces can never move up
+} direc_t;
+
+// Everything a player (or a bot) can ask the engine to do
+typedef enum {
+	INPUT_LEFT,
+	INPUT_RIGHT,
+	INPUT_SOFT_DROP,
+	INPUT_ROTATE,
+	INPUT_HARD_DROP,
+	// Held keys, from front ends that can tell when a key goes up: the engine
+	// repeats the shift itself (see DAS_MS) and speeds up gravity until release
+	INPUT_PRESS_LEFT,
+	INPUT_PRESS_RIGHT,
+	INPUT_PRESS_SOFT_DROP,
+	INPUT_RELEASE_LEFT,
+	INPUT_RELEASE_RIGHT,
+	INPUT_RELEASE_SOFT_DROP,
+	INPUT_COUNT
+} input_t;
+
+// Engine timings, all in ms of game time
+#define LOCK_DELAY_MS 500 // how long a landed piece can still be moved before it settles
+#define MAX_LOCK_RESETS 15 // moves/rotations that restart the lock delay, so pieces can't stall forever
+#define LINE_CLEAR_DELAY_MS 750 // gravity (and drops) wait this long after a clear so it can be animated
+#define DAS_MS 133 // delayed auto shift: a held left/right shifts once, then starts repeating after this...
+#define ARR_MS 33 // ...with this between repeats (auto repeat rate)
+#define SOFT_DROP_FACTOR 20 // a held soft drop makes gravity this many times faster
+
+/* Versus (see game_add_garbage()): lines cleared at once send this many rows of
+ * garbage to the opponent, 0/1/2/4 for 1-4 lines, less whatever they cancel of
+ * the garbage waiting to come up on the sender's own board
+ */
+#define GARBAGE_FOR_LINES {0, 0, 1, 2, 4}
+#define GARBAGE_COLOR TB_WHITE
+
+// Bits of game_t.held
+#define HELD_LEFT (1 << 0)
+#define HELD_RIGHT (1 << 1)
+#define HELD_SOFT_DROP (1 << 2)
+
+// Flags OR'd into game_t.events by engine calls so front ends know what to redraw.
+// They accumulate until the caller clears them.
+#define GAME_EVENT_MOVED   (1 << 0) // the active piece moved or rotated
+#define GAME_EVENT_SETTLED (1 << 1) // a piece was written to the board and a new one spawned
+#define GAME_EVENT_LINES   (1 << 2) // at least one line was cleared (see game_t.last_clear)
+#define GAME_EVENT_OVER    (1 << 3) // the game just ended
+#define GAME_EVENT_GARBAGE (1 << 4) // garbage rose from the bottom of the board
+
+// The rows removed by the most recent line clear, as they looked before removal.
+// Kept around so front ends can animate them after the board has moved on.
+typedef struct {
+	uint8_t count;
+	int8_t rows[4]; // y-values (top to bottom) before the clear
+	uintattr_t colors[4][BOARD_WIDTH];
+} line_clear_t;
+
+// One independent game. Nothing in here is global, so any number of these
+// can be simulated side by side. It holds no pointers either, so copying one
+// (plain assignment) clones or snapshots the whole game, see snapshot.h.
+typedef struct {
+	bitboard_t bitboard; // which cells are filled (the active piece is NOT part of the board)
+	int8_t column_top[BOARD_WIDTH]; // row of each column's highest filled cell, BOARD_HEIGHT if it's empty
+	uintattr_t colors[BOARD_HEIGHT][BOARD_WIDTH]; // color of each cell, TB_BLACK where empty
+	piece_t active_piece;
+	uint64_t seed; // what game_init() was given, enough to deal the same pieces again
+	rng_t rng;
+	uint8_t bag[PIECE_COUNT]; // 7-bag randomizer: a shuffled set of every piece...
+	uint8_t bag_left; // ...dealt from the back until it runs out
+	uint8_t preview[PREVIEW_COUNT]; // ring buffer of the next pieces, oldest at preview_head
+	uint8_t preview_head;
+	double drop_speed; // (in ms) time between gravity steps
+	bool over;
+
+	// Timers, against the game clock passed to game_update()
+	uint32_t time_ms; // the game time everything was last brought up to
+	double next_drop_ms; // when gravity next pulls the piece down
+	bool locking; // the piece has landed and is waiting out its lock delay
+	uint32_t lock_at_ms;
+	uint8_t lock_resets;
+	uint32_t clear_until_ms; // end of the delay after the most recent line clear
+	uint8_t held; // HELD_* keys pressed and not yet released
+	uint8_t shifting; // the held direction that repeats (the one pressed last), a direc_t
+	uint32_t shift_at_ms; // when it next repeats
+
+	// Versus: garbage waiting to rise (once a piece settles without clearing
+	// anything), and garbage sent that the caller is yet to hand on
+	uint8_t garbage_in;
+	uint8_t garbage_out;
+	rng_t garbage_rng; // where the holes go, drawn apart from the pieces
+
+	uint32_t lines_cleared;
+	uint32_t pieces_placed;
+	uint8_t events;
+	uint64_t dirty_rows; // bit y set = row y of the board changed; cleared by whoever redraws it
+	line_clear_t last_clear;
+} game_t;
+
+piece_t piece_spawn(piece_type_t type);
+void piece_blocks(const piece_t *p, block_t out[4]);
+bool piece_collides(const bitboard_t *bb, const piece_t *p);
+bool piece_rotate(const bitboard_t *bb, piece_t *p);
+int8_t bitboard_place(bitboard_t *bb, const piece_t *p);
+int8_t bitboard_place_hashed(bitboard_t *bb, const piece_t *p, uint64_t *hash);
+uint64_t bitboard_hash(const bitboard_t *bb);
+
+void rng_seed(rng_t *rng, uint64_t seed);
+uint32_t rng_next(rng_t *rng);
+uint32_t rng_below(rng_t *rng, uint32_t n);
+
+void game_init(game_t *g, uint64_t seed);
+piece_type_t game_preview(const game_t *g, uint8_t i);
+void game_update(game_t *g, uint32_t now_ms);
+uint32_t game_next_deadline(const game_t *g);
+bool game_clearing(const game_t *g);
+void game_apply_input(game_t *g, input_t in);
+bool game_step(game_t *g);
+bool game_move(game_t *g, direc_t d);
+bool game_rotate(game_t *g);
+void game_hard_drop(game_t *g);
+int8_t game_drop_distance(const game_t *g, const piece_t *p);
+void game_refresh_columns(game_t *g);
+void game_add_garbage(game_t *g, uint8_t rows);
+
+#endif
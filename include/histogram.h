@@ -0,0 +1,40 @@
+/*********************************************************************
+ * File: histogram.h                                                 *
+ * Description: HDR-style latency histograms: fixed memory, constant *
+ *              time to record, about 3% error at any magnitude      *
+ *********************************************************************/
+
+#ifndef HISTOGRAM_HEADER_INCLUDED
+#define HISTOGRAM_HEADER_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Values are whole microseconds. Below 2 * HISTOGRAM_SUB_BUCKETS every value
+ * has its own bucket; above that, each power of two is split into
+ * HISTOGRAM_SUB_BUCKETS equal parts, so a bucket is never wider than 1/32 of
+ * the values in it. Anything past HISTOGRAM_MAX_US lands in the last bucket.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 26 // up to 2^26 us, a little over a minute
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define HISTOGRAM_MAX_US ((UINT64_C(1) << HISTOGRAM_MAX_BITS) - 1)
+
+typedef struct {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total; // values recorded
+	uint64_t min_us, max_us; // exact, unlike the buckets
+	double sum_us;
+} histogram_t;
+
+void histogram_reset(histogram_t *h);
+void histogram_record(histogram_t *h, double us);
+uint32_t histogram_bucket(uint64_t us);
+uint64_t histogram_percentile(const histogram_t *h, double percent);
+double histogram_mean(const histogram_t *h);
+void histogram_print(const histogram_t *h, const char *name, FILE *out);
+double monotonic_ms();
+
+#endif
@@ -0,0 +1,41 @@
+/*********************************************************************
+ * File: input_queue.h                                               *
+ * Description: lock-free single-producer/single-consumer ring that  *
+ *              hands timestamped termbox events to the game thread  *
+ *********************************************************************/
+
+#ifndef INPUT_QUEUE_HEADER_INCLUDED
+#define INPUT_QUEUE_HEADER_INCLUDED
+
+// Only termbox's event struct is used here, so no TB_IMPL is needed
+#ifndef __TERMBOX_H
+	#include "termbox.h"
+#endif
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define INPUT_QUEUE_SIZE 256 // events that can wait at once, must be a power of two
+
+typedef struct {
+	struct tb_event event;
+	double at_ms; // monotonic clock (ms) when it was read from the terminal
+} queued_input_t;
+
+/* One thread pushes, one other thread pops, and neither ever waits on the
+ * other. head and tail only ever count up (slots are indexed modulo the size)
+ * and each is written by one side only, on its own cache line.
+ */
+typedef struct {
+	_Alignas(64) _Atomic size_t head; // next slot to pop, written by the consumer
+	_Alignas(64) _Atomic size_t tail; // next slot to push, written by the producer
+	_Alignas(64) queued_input_t slots[INPUT_QUEUE_SIZE];
+	int wake_fd; // eventfd that becomes readable after a push, for the consumer to poll()
+} input_queue_t;
+
+bool input_queue_init(input_queue_t *q);
+bool input_queue_push(input_queue_t *q, const struct tb_event *event, double at_ms);
+bool input_queue_pop(input_queue_t *q, queued_input_t *out);
+void input_queue_destroy(input_queue_t *q);
+
+#endif
@@ -0,0 +1,33 @@
+/*********************************************************************
+ * File: keyboard.h                                                  *
+ * Description: the kitty keyboard protocol, for terminals that can  *
+ *              report when a key is held down and let go            *
+ *********************************************************************/
+
+#ifndef KEYBOARD_HEADER_INCLUDED
+#define KEYBOARD_HEADER_INCLUDED
+
+// Only termbox's event struct is used here, so no TB_IMPL is needed
+#ifndef __TERMBOX_H
+	#include "termbox.h"
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Flags pushed onto the terminal's keyboard mode stack: disambiguate escape
+ * codes (1) and report event types (2), which is what sends key releases.
+ * Terminals without the protocol ignore the request and carry on as before.
+ */
+#define KEYBOARD_FLAGS 3
+#define KEYBOARD_REPORTS_EVENTS 2
+
+// OR'd into tb_event.mod, above termbox's own TB_MOD_* bits
+#define KEY_MOD_REPEAT 0x40 // the terminal's own repeat of a key being held down
+#define KEY_MOD_RELEASE 0x80 // the key went up
+
+void keyboard_enable(void);
+void keyboard_disable(void);
+bool keyboard_reports_releases(void);
+int keyboard_extract(struct tb_event *event, size_t *consumed);
+
+#endif
@@ -0,0 +1,62 @@
+/*********************************************************************
+ * File: metrics.h                                                   *
+ * Description: counters each thread keeps on its own cache line,    *
+ *              summed only when scraped as Prometheus text over HTTP*
+ *********************************************************************/
+
+#ifndef METRICS_HEADER_INCLUDED
+#define METRICS_HEADER_INCLUDED
+
+#include "histogram.h"
+#ifndef PTHREAD_HEADER_INCLUDED
+	#include <pthread.h>
+	#define PTHREAD_HEADER_INCLUDED
+#endif
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define METRICS_MAX_THREADS 64 // threads after this many share the last slot
+#define METRICS_RATE_MS 1000 // the per-second rates are over this long
+#define METRICS_CLIENT_TIMEOUT_MS 1000 // a scraper slower than this to ask or to read is dropped
+#define METRICS_BODY_MAX (16 * 1024)
+
+// Sums over every thread. METRIC_SESSIONS goes up and down, the rest only go up.
+typedef enum {
+	METRIC_SESSIONS, // --serve players connected
+	METRIC_TICKS, // --serve ticks, each updating and drawing every session
+	METRIC_SESSION_TICKS,
+	METRIC_PRESENTS, // tb_present() calls that sent anything, to the local screen or a session
+	METRIC_PRESENT_BYTES,
+	METRIC_LOCK_WAITS, // metrics_lock() calls that found the lock taken
+	METRIC_LOCK_WAIT_NS, // and how long they waited for it
+	METRIC_BOT_SEARCHES,
+	METRIC_BOT_NODES, // boards the bot placed a piece on while searching
+	METRIC_ARENA_MALLOCS, // blocks arena_alloc() had to malloc()
+	METRIC_COUNTERS
+} metric_t;
+
+// Maxima over every thread
+typedef enum {
+	METRIC_ARENA_PEAK, // the most bytes one arena has held
+	METRIC_PEAKS
+} metric_peak_t;
+
+/* One thread's counters. Only that thread writes them, with relaxed atomics
+ * so a scrape can read them at any time. The atomics cost next to nothing,
+ * since the cache line is never shared until someone scrapes.
+ */
+typedef struct {
+	_Alignas(64) _Atomic uint64_t counters[METRIC_COUNTERS];
+	_Atomic uint64_t peaks[METRIC_PEAKS];
+	_Atomic uint64_t latency[HISTOGRAM_BUCKETS]; // input latency, as a histogram_t's counts
+	_Atomic uint64_t latency_sum_us, latency_max_us;
+} metrics_slot_t;
+
+void metrics_add(metric_t m, int64_t n);
+void metrics_peak(metric_peak_t m, uint64_t value);
+void metrics_latency(double us);
+void metrics_lock(pthread_mutex_t *lock);
+bool metrics_serve(const char *port);
+
+#endif
@@ -0,0 +1,55 @@
+/*********************************************************************
+ * File: pool.h                                                      *
+ * Description: work-stealing thread pool for splitting searches     *
+ *              across cores                                         *
+ *********************************************************************/
+
+#ifndef POOL_HEADER_INCLUDED
+#define POOL_HEADER_INCLUDED
+
+#ifndef PTHREAD_HEADER_INCLUDED
+	#include <pthread.h>
+	#define PTHREAD_HEADER_INCLUDED
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*pool_task_fn)(void *arg);
+
+typedef struct {
+	pool_task_fn fn;
+	void *arg;
+} pool_task_t;
+
+// One worker's deque. The owner pushes and pops at the bottom (newest first,
+// which keeps a task's children on the core that made them); thieves take
+// from the top, where the oldest and usually biggest tasks are.
+typedef struct {
+	pthread_mutex_t lock;
+	pool_task_t *tasks; // ring buffer of `cap` slots, grown as needed
+	size_t cap;
+	size_t top; // index of the oldest task
+	size_t count;
+} pool_deque_t;
+
+typedef struct {
+	unsigned n_workers;
+	pthread_t *threads;
+	pool_deque_t *deques; // one per worker
+	unsigned next_deque; // where tasks submitted from outside the pool go next
+
+	pthread_mutex_t lock; // guards the counters below and both conditions
+	pthread_cond_t work_ready;
+	pthread_cond_t all_done;
+	size_t queued; // tasks sitting in some deque
+	size_t outstanding; // tasks submitted but not yet finished
+	bool shutting_down;
+} pool_t;
+
+bool pool_init(pool_t *pool, unsigned n_workers);
+void pool_submit(pool_t *pool, pool_task_fn fn, void *arg);
+int pool_worker_index(const pool_t *pool);
+void pool_wait(pool_t *pool);
+void pool_destroy(pool_t *pool);
+
+#endif
@@ -0,0 +1,78 @@
+/*********************************************************************
+ * File: render.h                                                    *
+ * Description: draws a game_t into termbox's back buffer, touching  *
+ *              only the cells that changed since the last frame     *
+ *********************************************************************/
+
+#ifndef RENDER_HEADER_INCLUDED
+#define RENDER_HEADER_INCLUDED
+
+#ifndef __TERMBOX_H
+	#include "termbox.h"
+#endif
+#include "engine.h"
+
+// Cleared lines flash white, then their color, then white again before disappearing
+#define FLASH_PHASES 3
+#define FLASH_DELAY_MS (LINE_CLEAR_DELAY_MS / FLASH_PHASES) // length of each flash phase
+
+// The board and its frame at scale 1: each cell is 2 columns by 1 row
+#define FRAME_COLS (2 * (BOARD_WIDTH + 2))
+#define FRAME_ROWS (BOARD_HEIGHT + 2)
+#define LAYOUT_MAX_SCALE 3 // blocks get no bigger than 6x3 characters
+#define STRIP_CELLS (FRAME_COLS * LAYOUT_MAX_SCALE) // the widest run of blocks drawn at once: a row of the frame
+
+// OR'd into a color passed to draw_block(): an outline of a block, for the
+// ghost piece (where the active piece would land). No termbox attribute uses it.
+#define GHOST_BLOCK 0x8000
+
+// The next pieces panel: a "NEXT" label over PREVIEW_COUNT slots of 4x2 cells,
+// a cell apart, PANEL_GAP columns right of the frame
+#define PANEL_CELLS_WIDE 4
+#define PANEL_CELLS_TALL 2
+#define PANEL_GAP 2
+
+/* Where everything goes on a screen of a given size. Worked out once per
+ * size by layout_compute() and kept, so drawing is only ever offsets.
+ * The board is centered (with the panel, if it fits) at the biggest scale
+ * that fits; scale 0 means the screen is too small for the board at all.
+ */
+typedef struct {
+	int width, height; // the screen this is for...
+	int left; // ...or the part of it from this column on (see renderer_resize_at())
+	int scale;
+	int cell_cols, cell_rows; // one board cell on screen
+	int board_x, board_y; // top left corner of the frame
+	bool panel; // the next pieces fit beside the board
+	int panel_x, panel_y;
+	bool side; // the side_cols asked for fit right of the board and panel
+	int side_x, side_y;
+} layout_t;
+
+// Remembers what is already on screen so a frame only redraws what moved.
+// It draws into whichever termbox context the calling thread has selected
+// (see tb_ctx_select()), so a renderer belongs to one screen, and through
+// its layout (see renderer_resize()).
+typedef struct {
+	layout_t layout;
+	uintattr_t shown[BOARD_HEIGHT][BOARD_WIDTH]; // color currently drawn in each board cell
+	int8_t shown_preview[PREVIEW_COUNT]; // piece drawn in each panel slot, -1 for none
+	block_t piece_blocks[4]; // where the active piece was drawn last frame
+	block_t ghost_blocks[4]; // and its ghost, where it would land
+	bool piece_drawn;
+	bool flash_drawn; // last frame was a line clear flash
+	bool full_redraw; // next frame repaints everything, frame included
+	struct tb_cell strip[STRIP_CELLS]; // one screen row of blocks, built and then set in one go
+} renderer_t;
+
+bool layout_compute(layout_t *l, int width, int height, int side_cols);
+void draw_block(const layout_t *l, int x, int y, uintattr_t color);
+void draw_board_text(const layout_t *l, int row, uintattr_t fg, uintattr_t bg, const char *text);
+void draw_game_over_text(const layout_t *l);
+int8_t flash_phase(const game_t *g);
+bool renderer_resize(renderer_t *r, int width, int height, int side_cols);
+bool renderer_resize_at(renderer_t *r, int left, int width, int height, int side_cols);
+void renderer_invalidate(renderer_t *r);
+void renderer_draw(renderer_t *r, game_t *g);
+
+#endif
@@ -0,0 +1,71 @@
+/*********************************************************************
+ * File: replay.h                                                    *
+ * Description: records games as a seed plus their inputs, and plays *
+ *              them back through the headless engine                *
+ *********************************************************************/
+
+#ifndef REPLAY_HEADER_INCLUDED
+#define REPLAY_HEADER_INCLUDED
+
+#include "engine.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Replay file format (version 2). A file is any number of games back to back,
+ * each one appended as it's played:
+ *
+ *   header:  "TTRP"  version:u8  BOARD_WIDTH:u8  BOARD_HEIGHT:u8  seed:u64 (little endian)
+ *   events:  delta_ms:varint  input:u8       (repeated)
+ *   end:     delta_ms:varint  REPLAY_END
+ *
+ * delta_ms is the game time since the previous event (or the start of the game)
+ * as an unsigned LEB128 varint, so most events take 2 bytes. The engine is
+ * deterministic, so the seed plus the game time of every input is the whole game.
+ * That includes held keys: only presses and releases are recorded, and the
+ * engine repeats them on playback just as it did in play. Version 2 added
+ * those inputs, so version 1 files (which can't have any) still play.
+ */
+#define REPLAY_MAGIC "TTRP"
+#define REPLAY_VERSION 2
+#define REPLAY_OLDEST_VERSION 1 // the oldest version replay_play_game() still reads
+#define REPLAY_END 0xff // in place of an input_t: the game ended (or was quit) here
+
+#define REPLAY_BUFFER_SIZE 4096
+
+// Appends games to a replay file. Events collect in memory and are only
+// written out when the buffer fills up or a game ends.
+typedef struct {
+	int fd;
+	bool in_game; // between replay_begin_game() and replay_end_game()
+	bool failed; // a write failed; nothing more gets recorded
+	uint32_t last_ms;
+	size_t len;
+	uint8_t buf[REPLAY_BUFFER_SIZE];
+} replay_writer_t;
+
+// A whole replay file read into memory
+typedef struct {
+	uint8_t *data;
+	size_t len;
+	size_t pos;
+} replay_reader_t;
+
+typedef enum {
+	REPLAY_OK,
+	REPLAY_EOF, // no more games in the file
+	REPLAY_BAD // truncated, corrupt, or recorded by an incompatible version
+} replay_status_t;
+
+bool replay_writer_open(replay_writer_t *w, const char *path);
+void replay_begin_game(replay_writer_t *w, uint64_t seed);
+void replay_record(replay_writer_t *w, uint32_t ms, input_t in);
+void replay_end_game(replay_writer_t *w, uint32_t ms);
+bool replay_flush(replay_writer_t *w);
+void replay_writer_close(replay_writer_t *w);
+
+bool replay_reader_open(replay_reader_t *r, const char *path);
+replay_status_t replay_play_game(replay_reader_t *r, game_t *g);
+void replay_reader_close(replay_reader_t *r);
+
+#endif
@@ -0,0 +1,77 @@
+/*********************************************************************
+ * File: server.h                                                    *
+ * Description: hosts many games over TCP from one process. An epoll *
+ *              reactor owns the sockets; a worker pool runs games   *
+ *********************************************************************/
+
+#ifndef SERVER_HEADER_INCLUDED
+#define SERVER_HEADER_INCLUDED
+
+#include "engine.h"
+#include "render.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Telnet bytes (RFC 854/857/858)
+#define TELNET_SE   240
+#define TELNET_SB   250
+#define TELNET_WILL 251
+#define TELNET_DONT 254
+#define TELNET_IAC  255
+#define TELNET_OPT_ECHO 1
+#define TELNET_OPT_SGA  3
+
+#define SERVER_TICK_HZ 60 // every session is updated and redrawn this often
+#define SESSIONS_PER_TASK 64 // sessions a worker ticks in one go
+#define SESSION_INPUT_SIZE 64 // bytes read from a client per tick, more waits for the next one
+#define SESSION_OUTPUT_MAX (64 * 1024) // a client this far behind isn't drawn until it catches up
+#define SESSION_COLS FRAME_COLS // the screen a session draws: the board and its frame
+#define SESSION_ROWS FRAME_ROWS
+
+typedef enum {
+	SESSION_PLAY,
+	SESSION_PAUSE,
+	SESSION_OVER
+} session_state_t;
+
+// Where the telnet filter is in a command. Everything else is passed on to
+// the session's termbox context, which turns it into key events.
+typedef enum {
+	PARSE_DATA,
+	PARSE_IAC, // telnet command
+	PARSE_OPTION, // telnet WILL/WONT/DO/DONT, then an option byte
+	PARSE_SB, // telnet subnegotiation, up to IAC SE
+	PARSE_SB_IAC
+} parse_state_t;
+
+// One connected player. Everything a game needs lives in here, so a session
+// costs a few tens of KB (mostly its termbox cell buffers) and no threads.
+typedef struct {
+	int fd;
+	uint64_t id; // sessions are numbered in the order they connect
+	session_state_t state;
+	bool closing; // disconnect once its output is written (or the client went away)
+	game_t game;
+	renderer_t renderer;
+	struct tb_ctx *tb; // the client's screen; its output buffer holds what isn't sent yet
+	uint32_t clock_ms; // game time: only advances while playing
+
+	parse_state_t parse;
+	bool esc_held; // input ended on an ESC, kept back in case the rest of a sequence follows
+	uint8_t esc_ticks; // ticks the held ESC has been waiting
+	uint8_t in[SESSION_INPUT_SIZE];
+	uint8_t in_len;
+	double in_ms; // when the oldest byte in `in` was read, for the latency to its frame
+
+	bool want_writable; // the reactor is waiting on EPOLLOUT for this one
+} session_t;
+
+// Sent to every client on connect: character-at-a-time mode with no local echo
+extern const char TELNET_GREETING[6];
+
+bool telnet_filter(parse_state_t *parse, uint8_t c);
+int open_listener(const char *port);
+int run_server(const char *port, const char *spectate_port, unsigned n_workers, uint64_t seed, bool lean);
+
+#endif
@@ -0,0 +1,30 @@
+/*********************************************************************
+ * File: simulate.h                                                  *
+ * Description: plays batches of headless bot games over every core  *
+ *              and writes one CSV row per game                      *
+ *********************************************************************/
+
+#ifndef SIMULATE_HEADER_INCLUDED
+#define SIMULATE_HEADER_INCLUDED
+
+#include "engine.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SIMULATE_MAX_PIECES 10000 // a game still going after this many pieces stops there (over=0)
+#define SIMULATE_INPUT_MS 60 // game time between the bot's inputs, as in --autoplay
+#define SIMULATE_BUFFER_SIZE (64 * 1024) // CSV each thread builds up before writing it out
+#define SIMULATE_DEFAULT_DEPTH 1 // --simulate is about many games, not good ones
+
+// What a whole batch came to
+typedef struct {
+	uint64_t games, over; // games played, and how many of them topped out
+	uint64_t pieces, lines;
+	double wall_ms;
+	bool write_failed;
+} simulate_totals_t;
+
+bool simulate_games(uint64_t n_games, uint64_t seed, unsigned n_threads, uint8_t depth, int out_fd,
+                    simulate_totals_t *totals);
+
+#endif
@@ -0,0 +1,52 @@
+/*********************************************************************
+ * File: snapshot.h                                                  *
+ * Description: a ring of whole-game snapshots for undo, kept in a   *
+ *              memory-mapped file so a killed game can resume       *
+ *********************************************************************/
+
+#ifndef SNAPSHOT_HEADER_INCLUDED
+#define SNAPSHOT_HEADER_INCLUDED
+
+#include "engine.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SNAPSHOT_EVERY_MS 50 // game time between snapshots (every settled piece gets one too)
+#define SNAPSHOT_SLOTS 1024 // about 50 s of play to rewind through, at 640 bytes a game
+
+#define SNAPSHOT_MAGIC "TTSN"
+#define SNAPSHOT_VERSION 1
+
+/* The file, byte for byte. A game_t holds no pointers, so a snapshot is a
+ * plain copy of one. `taken` only moves on once the slot it covers is fully
+ * written, so a process killed part way through a copy leaves the ring ending
+ * at the previous snapshot, intact. The slot after the newest may be torn
+ * that way, which is why at most SNAPSHOT_SLOTS - 1 of them are ever read.
+ * The header pins the build: another board size or game_t layout is a
+ * different file, not a game to resume.
+ */
+typedef struct {
+	char magic[4];
+	uint8_t version;
+	uint8_t board_width, board_height;
+	uint8_t unused;
+	uint32_t game_size; // sizeof(game_t)
+	_Atomic uint64_t taken; // snapshots of the current game; the newest is slots[(taken - 1) % SNAPSHOT_SLOTS]
+	game_t slots[SNAPSHOT_SLOTS];
+} snapshot_file_t;
+
+typedef struct {
+	snapshot_file_t *file; // mapped over --save FILE, or anonymous memory without one
+	int fd; // -1 when not backed by a file
+} snapshot_ring_t;
+
+bool snapshot_open(snapshot_ring_t *r, const char *path);
+void snapshot_close(snapshot_ring_t *r);
+void snapshot_reset(snapshot_ring_t *r);
+void snapshot_take(snapshot_ring_t *r, const game_t *g);
+bool snapshot_due(const snapshot_ring_t *r, const game_t *g);
+bool snapshot_latest(const snapshot_ring_t *r, game_t *out);
+bool snapshot_rewind(snapshot_ring_t *r, const game_t *g, game_t *out);
+
+#endif
@@ -246,6 +246,11 @@ extern "C" {
 #define TB_OUTPUT_TRUECOLOR 5
 #endif
 
+/* Present modes (tb_set_present_mode) */
+#define TB_PRESENT_CURRENT  0
+#define TB_PRESENT_NORMAL   1
+#define TB_PRESENT_LEAN     2
+
 /* Common function return values unless otherwise noted.
  *
  * Library behavior is undefined after receiving TB_ERR_MEM. Callers may
@@ -404,6 +409,33 @@ int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg);
 /* Synchronizes the internal back buffer with the terminal by writing to tty. */
 int tb_present(void);
 
+/* Right after tb_present(), appends the whole screen again for a terminal
+ * that has seen nothing yet: a clear, every attribute sent afresh, every cell.
+ * It ends with the attributes tb_present() left, so output after it carries
+ * on from tb_present() for every terminal. A stream of frames can then be
+ * joined at any of these.
+ */
+int tb_present_full(void);
+
+/* Sets how tb_present() encodes what changed. If mode is TB_PRESENT_CURRENT,
+ * returns the current present mode.
+ *
+ * 1. TB_PRESENT_NORMAL => every changed cell in screen order, with a full
+ *    SGR reset on each attribute change and an absolute move on each jump.
+ *
+ * 2. TB_PRESENT_LEAN   => the fewest bytes it can manage, for slow links:
+ *    changed cells are grouped into runs of equal attributes and sent in
+ *    screen order or sorted by attribute, whichever is shorter; attribute
+ *    changes only send the colors that changed; jumps use the shortest of
+ *    an absolute, column or relative move, or reprint a short gap instead.
+ *
+ * The default present mode is TB_PRESENT_NORMAL.
+ */
+int tb_set_present_mode(int mode);
+
+/* How many bytes the last tb_present() sent (or queued), cursor included. */
+int tb_present_bytes(void);
+
 /* Sets the position of the cursor. Upper-left character is (0, 0). */
 int tb_set_cursor(int cx, int cy);
 int tb_hide_cursor(void);
@@ -424,6 +456,12 @@ int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     uintattr_t bg);
 int tb_extend_cell(int x, int y, uint32_t ch);
 
+/* Copies n cells into the back buffer, from x,y rightwards: one bounds check
+ * for the whole run, clipped to the screen, and no UTF-8 to decode. Only
+ * ch, fg and bg are copied, so each cell holds a single code point.
+ */
+int tb_set_cells(int x, int y, const struct tb_cell *cells, int n);
+
 /* Sets the input mode. Termbox has two input modes:
  *
  * 1. TB_INPUT_ESC
@@ -537,6 +575,17 @@ int tb_poll_event(struct tb_event *event);
  * tb_poll_event() / tb_peek_event() if activity is detected. */
 int tb_get_fds(int *ttyfd, int *resizefd);
 
+/* By default, tb_peek_event() / tb_poll_event() resize the cell buffers
+ * themselves when the terminal changes size, on whichever thread called them.
+ * After tb_defer_resize(1) they only report the new size in the
+ * TB_EVENT_RESIZE event, and nothing changes until tb_resize(w, h) is called,
+ * so a program that reads events on one thread and draws on another can
+ * leave every buffer to the drawing one. tb_resize() resizes the buffers and
+ * clears the screen, like a resize event normally would.
+ */
+int tb_defer_resize(int defer);
+int tb_resize(int w, int h);
+
 /* Print and printf functions. Specify param out_w to determine width of printed
  * string.
  */
@@ -561,8 +610,13 @@ int tb_sendf(const char *fmt, ...);
  * TB_FUNC_EXTRACT_POST:
  *   If specified, invoke this function AFTER termbox tries (and fails) to
  *   extract any escape sequences from the input buffer.
+ *
+ * Either function reads the unparsed input through tb_input_pending(), and on
+ * TB_OK sets *consumed to the bytes it used up. tb_input_pending() returns
+ * NULL, with *nbuf = 0, before termbox is initialized.
  */
 int tb_set_func(int fn_type, int (*fn)(struct tb_event *, size_t *));
+const char *tb_input_pending(size_t *nbuf);
 
 /* Utility functions. */
 int tb_utf8_char_length(char c);
@@ -575,6 +629,37 @@ int tb_has_truecolor(void);
 int tb_has_egc(void);
 const char *tb_version(void);
 
+/* Reentrant contexts. Every function above works on the calling thread's
+ * current context, which is the one tb_init() sets up until tb_ctx_select()
+ * picks another. Contexts are independent (cell buffers, input, output, modes)
+ * so different threads can each drive their own without locking.
+ *
+ * A context from tb_ctx_new() has no terminal behind it: it is w x h cells,
+ * speaks xterm, and installs no signal handlers. Its output collects in a
+ * buffer (see tb_ctx_output()/tb_ctx_consume()) and its input is whatever is
+ * handed to tb_ctx_feed(), which suits sockets and other non-tty streams.
+ *
+ * tb_ctx_select() makes ctx current on this thread (NULL for the tb_init()
+ * one) and returns what was current before, in the same form. The tb_ctx_*
+ * wrappers run one call against ctx and leave the selection as they found it.
+ * The constructor returns NULL if it runs out of memory.
+ */
+struct tb_ctx;
+struct tb_ctx *tb_ctx_new(int w, int h);
+void tb_ctx_free(struct tb_ctx *ctx);
+struct tb_ctx *tb_ctx_select(struct tb_ctx *ctx);
+int tb_ctx_feed(struct tb_ctx *ctx, const char *buf, size_t nbuf);
+const char *tb_ctx_output(struct tb_ctx *ctx, size_t *nbuf);
+int tb_ctx_consume(struct tb_ctx *ctx, size_t nbuf);
+int tb_ctx_clear(struct tb_ctx *ctx);
+int tb_ctx_present(struct tb_ctx *ctx);
+int tb_ctx_print(struct tb_ctx *ctx, int x, int y, uintattr_t fg, uintattr_t bg,
+    const char *str);
+int tb_ctx_send(struct tb_ctx *ctx, const char *buf, size_t nbuf);
+int tb_ctx_peek_event(struct tb_ctx *ctx, struct tb_event *event,
+    int timeout_ms);
+int tb_ctx_set_present_mode(struct tb_ctx *ctx, int mode);
+
 #ifdef __cplusplus
 }
 #endif
@@ -635,6 +720,15 @@ struct cap_trie_t {
     uint8_t mod;
 };
 
+// Changed cells on one row, in one attribute: w columns starting at x
+struct tb_run_t {
+    int x;
+    int y;
+    int w;
+    uintattr_t fg;
+    uintattr_t bg;
+};
+
 struct tb_global_t {
     int ttyfd;
     int rfd;
@@ -653,6 +747,12 @@ struct tb_global_t {
     uintattr_t last_bg;
     int input_mode;
     int output_mode;
+    int present_mode;
+    int defer_resize;
+    size_t present_bytes;
+    struct tb_run_t *runs; // TB_PRESENT_LEAN's changed runs: screen order, then by attribute
+    size_t nruns;
+    size_t cap_runs;
     char *terminfo;
     size_t nterminfo;
     const char *caps[TB_CAP__COUNT];
@@ -670,7 +770,21 @@ struct tb_global_t {
     char errbuf[1024];
 };
 
-static struct tb_global_t global = {0};
+struct tb_ctx {
+    struct tb_global_t state;
+};
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define TB_THREAD_LOCAL _Thread_local
+#else
+#define TB_THREAD_LOCAL __thread
+#endif
+
+// The tb_init() context, and whichever one this thread has selected. All of
+// the code below reaches the current context through `global`.
+static struct tb_global_t tb_default_ctx = {0};
+static TB_THREAD_LOCAL struct tb_global_t *tb_cur = &tb_default_ctx;
+#define global (*tb_cur)
 
 /* BEGIN codegen c */
 /* Produced by ./codegen.sh on Sun, 19 Sep 2021 01:02:03 +0000 */
@@ -1388,10 +1502,21 @@ static int extract_esc_cap(struct tb_event *event);
 static int extract_esc_mouse(struct tb_event *event);
 static int resize_cellbufs(void);
 static void handle_resize(int sig);
+static int present_normal(void);
+static int present_lean(void);
+static int present_changes(void);
+static int collect_runs(void);
+static int send_runs(struct tb_run_t *runs, size_t nruns);
+static int run_cmp(const void *a, const void *b);
 static int send_attr(uintattr_t fg, uintattr_t bg);
 static int send_sgr(uintattr_t fg, uintattr_t bg, uintattr_t fg_is_default,
     uintattr_t bg_is_default);
+static int send_sgr_color(uintattr_t c, int is_bg);
+static int send_sgr_delta(uintattr_t cfg, uintattr_t cbg,
+    uintattr_t fg_is_default, uintattr_t bg_is_default, int fg_changed,
+    int bg_changed);
 static int send_cursor_if(int x, int y);
+static int send_cursor_lean(int x, int y);
 static int send_char(int x, int y, uint32_t ch);
 static int send_cluster(int x, int y, uint32_t *ch, size_t nch);
 static int convert_num(uint32_t num, char *buf);
@@ -1493,12 +1618,36 @@ int tb_present(void) {
     if_not_init_return();
 
     int rv;
+    size_t start_len = global.out.len;
 
     // TODO Assert global.back.(width,height) == global.front.(width,height)
 
+    if_err_return(rv, present_changes());
+    global.present_bytes = global.out.len - start_len;
+    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+
+    return TB_OK;
+}
+
+// Everything in the back buffer that differs from the front, then the cursor
+static int present_changes(void) {
+    int rv;
+
     global.last_x = -1;
     global.last_y = -1;
 
+    if (global.present_mode == TB_PRESENT_LEAN) {
+        if_err_return(rv, present_lean());
+    } else {
+        if_err_return(rv, present_normal());
+    }
+
+    return send_cursor_if(global.cursor_x, global.cursor_y);
+}
+
+// Every changed cell in screen order
+static int present_normal(void) {
+    int rv;
     int x, y, i;
     for (y = 0; y < global.front.height; y++) {
         for (x = 0; x < global.front.width;) {
@@ -1550,12 +1699,181 @@ int tb_present(void) {
         }
     }
 
-    if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+    return TB_OK;
+}
+
+/* Sends the changed runs twice over, in screen order and then sorted by
+ * attribute, and keeps whichever came out shorter. Sorting saves attribute
+ * changes when a few colors are scattered about (a piece over a board) but
+ * costs cursor moves when each row is a rainbow, so neither always wins.
+ */
+static int present_lean(void) {
+    int rv;
+    if_err_return(rv, collect_runs());
+    if (global.nruns == 0) {
+        return TB_OK;
+    }
+
+    struct tb_run_t *by_pos = global.runs;
+    struct tb_run_t *by_attr = global.runs + global.nruns;
+    memcpy(by_attr, by_pos, sizeof(*by_pos) * global.nruns);
+    qsort(by_attr, global.nruns, sizeof(*by_attr), run_cmp);
+
+    size_t start_len = global.out.len;
+    uintattr_t start_fg = global.last_fg, start_bg = global.last_bg;
+    if_err_return(rv, send_runs(by_pos, global.nruns));
+    size_t pos_len = global.out.len - start_len;
+
+    // Rewind and try the other order
+    global.out.len = start_len;
+    global.last_fg = start_fg;
+    global.last_bg = start_bg;
+    global.last_x = -1;
+    global.last_y = -1;
+    if_err_return(rv, send_runs(by_attr, global.nruns));
+    if (global.out.len - start_len <= pos_len) {
+        return TB_OK;
+    }
+
+    global.out.len = start_len;
+    global.last_fg = start_fg;
+    global.last_bg = start_bg;
+    global.last_x = -1;
+    global.last_y = -1;
+    return send_runs(by_pos, global.nruns);
+}
 
+/* Catches the front buffer up with the back one, like present_normal() but
+ * without sending anything: what changed is noted in global.runs instead.
+ */
+static int collect_runs(void) {
+    int rv;
+    int x, y, i;
+    global.nruns = 0;
+    for (y = 0; y < global.front.height; y++) {
+        for (x = 0; x < global.front.width;) {
+            struct tb_cell *back, *front;
+            if_err_return(rv, cellbuf_get(&global.back, x, y, &back));
+            if_err_return(rv, cellbuf_get(&global.front, x, y, &front));
+
+            int w;
+            {
+#ifdef TB_OPT_EGC
+                if (back->nech > 0)
+                    w = wcswidth((wchar_t *)back->ech, back->nech);
+                else
+#endif
+                    w = wcwidth((wchar_t)back->ch);
+            }
+            if (w < 1) {
+                w = 1;
+            }
+
+            if (cell_cmp(back, front) != 0) {
+                cell_copy(front, back);
+
+                // A wide cell cut off by the edge goes out as spaces
+                int cols = w;
+                if (w > 1 && x >= global.front.width - (w - 1)) {
+                    cols = global.front.width - x;
+                } else {
+                    for (i = 1; i < w; i++) {
+                        struct tb_cell *front_wide;
+                        if_err_return(rv,
+                            cellbuf_get(&global.front, x + i, y, &front_wide));
+                        if_err_return(rv,
+                            cell_set(front_wide, 0, 1, back->fg, back->bg));
+                    }
+                }
+
+                struct tb_run_t *run =
+                    global.nruns > 0 ? &global.runs[global.nruns - 1] : NULL;
+                if (run && run->y == y && run->x + run->w == x &&
+                    run->fg == back->fg && run->bg == back->bg)
+                {
+                    run->w += cols;
+                } else {
+                    if (global.nruns == global.cap_runs) {
+                        // Twice over, for the sorted copy
+                        size_t cap = global.cap_runs ? global.cap_runs * 2 : 64;
+                        struct tb_run_t *runs = tb_realloc(global.runs,
+                            2 * cap * sizeof(struct tb_run_t));
+                        if (!runs) {
+                            return TB_ERR_MEM;
+                        }
+                        global.runs = runs;
+                        global.cap_runs = cap;
+                    }
+                    global.runs[global.nruns++] = (struct tb_run_t){
+                        x, y, cols, back->fg, back->bg};
+                }
+            }
+            x += w;
+        }
+    }
+    return TB_OK;
+}
+
+// Sends runs in the order given, from what the front buffer now holds
+static int send_runs(struct tb_run_t *runs, size_t nruns) {
+    int rv;
+    size_t r;
+    int x, i;
+    for (r = 0; r < nruns; r++) {
+        struct tb_run_t *run = &runs[r];
+        if_err_return(rv, send_attr(run->fg, run->bg));
+        for (x = run->x; x < run->x + run->w;) {
+            struct tb_cell *cell;
+            if_err_return(rv, cellbuf_get(&global.front, x, run->y, &cell));
+
+            int w;
+            {
+#ifdef TB_OPT_EGC
+                if (cell->nech > 0)
+                    w = wcswidth((wchar_t *)cell->ech, cell->nech);
+                else
+#endif
+                    w = wcwidth((wchar_t)cell->ch);
+            }
+            if (w < 1) {
+                w = 1;
+            }
+
+            if (w > 1 && x >= global.front.width - (w - 1)) {
+                for (i = x; i < global.front.width; i++) {
+                    if_err_return(rv, send_char(i, run->y, ' '));
+                }
+                break;
+            }
+            {
+#ifdef TB_OPT_EGC
+                if (cell->nech > 0)
+                    if_err_return(rv,
+                        send_cluster(x, run->y, cell->ech, cell->nech));
+                else
+#endif
+                    if_err_return(rv, send_char(x, run->y, cell->ch));
+            }
+            // The terminal moved past all of a wide cell, so no jump is needed
+            global.last_x = x + w - 1;
+            x += w;
+        }
+    }
     return TB_OK;
 }
 
+// By attribute, then screen order, so a single attribute still reads top down
+static int run_cmp(const void *a, const void *b) {
+    const struct tb_run_t *ra = a, *rb = b;
+    if (ra->fg != rb->fg)
+        return ra->fg < rb->fg ? -1 : 1;
+    if (ra->bg != rb->bg)
+        return ra->bg < rb->bg ? -1 : 1;
+    if (ra->y != rb->y)
+        return ra->y < rb->y ? -1 : 1;
+    return (ra->x > rb->x) - (ra->x < rb->x);
+}
+
 int tb_set_cursor(int cx, int cy) {
     if_not_init_return();
     int rv;
@@ -1600,6 +1918,28 @@ int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     return TB_OK;
 }
 
+int tb_set_cells(int x, int y, const struct tb_cell *cells, int n) {
+    if_not_init_return();
+    if (y < 0 || y >= global.back.height) {
+        return TB_ERR_OUT_OF_BOUNDS;
+    }
+    if (x < 0) {
+        cells -= x;
+        n += x;
+        x = 0;
+    }
+    if (n > global.back.width - x) {
+        n = global.back.width - x;
+    }
+    struct tb_cell *dst = &global.back.cells[(y * global.back.width) + x];
+    for (int i = 0; i < n; i++) {
+        int rv;
+        uint32_t ch = cells[i].ch;
+        if_err_return(rv, cell_set(&dst[i], &ch, 1, cells[i].fg, cells[i].bg));
+    }
+    return TB_OK;
+}
+
 int tb_extend_cell(int x, int y, uint32_t ch) {
     if_not_init_return();
 #ifdef TB_OPT_EGC
@@ -1673,6 +2013,63 @@ int tb_set_output_mode(int mode) {
     return TB_ERR;
 }
 
+int tb_set_present_mode(int mode) {
+    if_not_init_return();
+    switch (mode) {
+        case TB_PRESENT_CURRENT:
+            return global.present_mode;
+        case TB_PRESENT_NORMAL:
+        case TB_PRESENT_LEAN:
+            global.present_mode = mode;
+            return TB_OK;
+    }
+    return TB_ERR;
+}
+
+int tb_present_bytes(void) {
+    if_not_init_return();
+    return (int)global.present_bytes;
+}
+
+int tb_present_full(void) {
+    if_not_init_return();
+
+    int rv;
+    size_t start_len = global.out.len;
+    uintattr_t fg = global.last_fg, bg = global.last_bg;
+    uintattr_t unknown_fg = ~global.fg, unknown_bg = ~global.bg;
+
+    global.last_fg = unknown_fg;
+    global.last_bg = unknown_bg;
+    if_err_return(rv, cellbuf_clear(&global.front));
+    if_err_return(rv, send_clear());
+    if_err_return(rv, present_changes());
+    if (fg != unknown_fg || bg != unknown_bg) {
+        if_err_return(rv, send_attr(fg, bg));
+    }
+
+    global.present_bytes = global.out.len - start_len;
+    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+
+    return TB_OK;
+}
+
+int tb_defer_resize(int defer) {
+    if_not_init_return();
+    global.defer_resize = defer;
+    return TB_OK;
+}
+
+int tb_resize(int w, int h) {
+    if_not_init_return();
+    if (w < 1 || h < 1) {
+        return TB_ERR;
+    }
+    global.width = w;
+    global.height = h;
+    return resize_cellbufs();
+}
+
 int tb_peek_event(struct tb_event *event, int timeout_ms) {
     if_not_init_return();
     return wait_event(event, timeout_ms);
@@ -1772,6 +2169,17 @@ int tb_set_func(int fn_type, int (*fn)(struct tb_event *, size_t *)) {
     return TB_ERR;
 }
 
+const char *tb_input_pending(size_t *nbuf) {
+    if (!nbuf)
+        return NULL;
+    if (!global.initialized) {
+        *nbuf = 0;
+        return NULL;
+    }
+    *nbuf = global.in.len;
+    return global.in.buf;
+}
+
 struct tb_cell *tb_cell_buffer(void) {
     if (!global.initialized)
         return NULL;
@@ -1901,6 +2309,106 @@ const char *tb_version(void) {
     return TB_VERSION_STR;
 }
 
+struct tb_ctx *tb_ctx_new(int w, int h) {
+    int rv, i;
+    struct tb_ctx *ctx = tb_malloc(sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    // tb_reset() keeps ttyfd_open from what was there, so start from nothing
+    memset(ctx, 0, sizeof(*ctx));
+    struct tb_ctx *prev = tb_ctx_select(ctx);
+
+    // tb_init_rwfd() minus everything that touches the process: no tty
+    // attributes, terminfo lookup, resize handler or size query
+    tb_reset();
+    global.width = w;
+    global.height = h;
+    for (i = 0; i < TB_CAP__COUNT; i++) {
+        global.caps[i] = xterm_caps[i];
+    }
+    do {
+        if_err_break(rv, init_cap_trie());
+        if_err_break(rv, send_init_escape_codes());
+        if_err_break(rv, send_clear());
+        if_err_break(rv, init_cellbuf());
+        global.initialized = 1;
+    } while (0);
+
+    if (rv != TB_OK) {
+        tb_deinit();
+        tb_free(ctx);
+        ctx = NULL;
+    }
+    tb_ctx_select(prev);
+    return ctx;
+}
+
+void tb_ctx_free(struct tb_ctx *ctx) {
+    if (!ctx) {
+        return;
+    }
+    struct tb_ctx *prev = tb_ctx_select(ctx);
+    tb_deinit();
+    tb_ctx_select(prev == ctx ? NULL : prev);
+    tb_free(ctx);
+}
+
+struct tb_ctx *tb_ctx_select(struct tb_ctx *ctx) {
+    struct tb_ctx *prev =
+        tb_cur == &tb_default_ctx ? NULL : (struct tb_ctx *)tb_cur;
+    tb_cur = ctx ? &ctx->state : &tb_default_ctx;
+    return prev;
+}
+
+int tb_ctx_feed(struct tb_ctx *ctx, const char *buf, size_t nbuf) {
+    return bytebuf_nputs(&ctx->state.in, buf, nbuf);
+}
+
+const char *tb_ctx_output(struct tb_ctx *ctx, size_t *nbuf) {
+    *nbuf = ctx->state.out.len;
+    return ctx->state.out.buf;
+}
+
+int tb_ctx_consume(struct tb_ctx *ctx, size_t nbuf) {
+    return bytebuf_shift(&ctx->state.out, nbuf);
+}
+
+// Runs one call with ctx selected, then puts the old selection back
+#define tb_ctx_call(ctx, call)                                                 \
+    do {                                                                       \
+        struct tb_ctx *prev_ = tb_ctx_select(ctx);                             \
+        int rv_ = (call);                                                      \
+        tb_ctx_select(prev_);                                                  \
+        return rv_;                                                            \
+    } while (0)
+
+int tb_ctx_clear(struct tb_ctx *ctx) {
+    tb_ctx_call(ctx, tb_clear());
+}
+
+int tb_ctx_present(struct tb_ctx *ctx) {
+    tb_ctx_call(ctx, tb_present());
+}
+
+int tb_ctx_print(struct tb_ctx *ctx, int x, int y, uintattr_t fg, uintattr_t bg,
+    const char *str) {
+    tb_ctx_call(ctx, tb_print(x, y, fg, bg, str));
+}
+
+int tb_ctx_send(struct tb_ctx *ctx, const char *buf, size_t nbuf) {
+    tb_ctx_call(ctx, tb_send(buf, nbuf));
+}
+
+int tb_ctx_peek_event(struct tb_ctx *ctx, struct tb_event *event,
+    int timeout_ms) {
+    tb_ctx_call(ctx, tb_peek_event(event, timeout_ms));
+}
+
+int tb_ctx_set_present_mode(struct tb_ctx *ctx, int mode) {
+    tb_ctx_call(ctx, tb_set_present_mode(mode));
+}
+
 static int tb_reset(void) {
     int ttyfd_open = global.ttyfd_open;
     memset(&global, 0, sizeof(global));
@@ -1922,6 +2430,7 @@ static int tb_reset(void) {
     global.last_bg = ~global.bg;
     global.input_mode = TB_INPUT_ESC;
     global.output_mode = TB_OUTPUT_NORMAL;
+    global.present_mode = TB_PRESENT_NORMAL;
     return TB_OK;
 }
 
@@ -2219,9 +2728,11 @@ static int tb_deinit(void) {
         }
     }
 
-    sigaction(SIGWINCH, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
-    if (global.resize_pipefd[0] >= 0)
+    if (global.resize_pipefd[0] >= 0) {
+        // Only set up by tb_init(), so other contexts leave its handler be
+        sigaction(SIGWINCH, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
         close(global.resize_pipefd[0]);
+    }
     if (global.resize_pipefd[1] >= 0)
         close(global.resize_pipefd[1]);
 
@@ -2229,6 +2740,8 @@ static int tb_deinit(void) {
     cellbuf_free(&global.front);
     bytebuf_free(&global.in);
     bytebuf_free(&global.out);
+    if (global.runs)
+        tb_free(global.runs);
 
     if (global.terminfo)
         tb_free(global.terminfo);
@@ -2461,6 +2974,10 @@ static int wait_event(struct tb_event *event, int timeout) {
 
     memset(event, 0, sizeof(*event));
     if_ok_return(rv, extract_event(event));
+    if (global.rfd < 0) {
+        // Nothing to read for a tb_ctx_new() context besides what was fed
+        return TB_ERR_NO_EVENT;
+    }
 
     fd_set fds;
     struct timeval tv;
@@ -2503,10 +3020,22 @@ static int wait_event(struct tb_event *event, int timeout) {
         if (resize_has_events) {
             int ignore = 0;
             read(global.resize_pipefd[0], &ignore, sizeof(ignore));
+            event->type = TB_EVENT_RESIZE;
+            if (global.defer_resize) {
+                // Only asks: the buffers (and the screen) are tb_resize()'s
+                struct winsize sz;
+                memset(&sz, 0, sizeof(sz));
+                if (ioctl(global.ttyfd, TIOCGWINSZ, &sz) != 0) {
+                    global.last_errno = errno;
+                    return TB_ERR_RESIZE_IOCTL;
+                }
+                event->w = sz.ws_col;
+                event->h = sz.ws_row;
+                return TB_OK;
+            }
             // TODO Harden against errors encountered mid-resize
             if_err_return(rv, update_term_size());
             if_err_return(rv, resize_cellbufs());
-            event->type = TB_EVENT_RESIZE;
             event->w = global.width;
             event->h = global.height;
             return TB_OK;
@@ -2822,7 +3351,9 @@ static int resize_cellbufs(void) {
 
 static void handle_resize(int sig) {
     int errno_copy = errno;
-    write(global.resize_pipefd[1], &sig, sizeof(sig));
+    // Only the tb_init() context has a terminal to resize, whichever thread
+    // (and selected context) the signal lands on
+    write(tb_default_ctx.resize_pipefd[1], &sig, sizeof(sig));
     errno = errno_copy;
 }
 
@@ -2833,8 +3364,6 @@ static int send_attr(uintattr_t fg, uintattr_t bg) {
         return TB_OK;
     }
 
-    if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]));
-
     uintattr_t cfg, cbg;
     switch (global.output_mode) {
         default:
@@ -2911,6 +3440,22 @@ static int send_attr(uintattr_t fg, uintattr_t bg) {
             bg |= attr_default;
     }
 
+    uintattr_t attr_styles =
+        attr_bold | attr_blink | attr_italic | attr_underline | attr_reverse;
+    if (global.present_mode == TB_PRESENT_LEAN &&
+        !((fg | bg | global.last_fg | global.last_bg) & attr_styles))
+    {
+        // Plain colors before and after: no reset, just the ones that changed
+        if_err_return(rv, send_sgr_delta(cfg, cbg, fg & attr_default,
+                              bg & attr_default, fg != global.last_fg,
+                              bg != global.last_bg));
+        global.last_fg = fg;
+        global.last_bg = bg;
+        return TB_OK;
+    }
+
+    if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]));
+
     if (fg & attr_bold)
         if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_BOLD]));
 
@@ -2940,71 +3485,98 @@ static int send_attr(uintattr_t fg, uintattr_t bg) {
 static int send_sgr(uintattr_t cfg, uintattr_t cbg, uintattr_t fg_is_default,
     uintattr_t bg_is_default) {
     int rv;
-    char nbuf[32];
 
     if (fg_is_default && bg_is_default) {
         return TB_OK;
     }
 
+    send_literal(rv, "\x1b[");
+    if (!fg_is_default) {
+        if_err_return(rv, send_sgr_color(cfg, 0));
+        if (!bg_is_default) {
+            send_literal(rv, ";");
+        }
+    }
+    if (!bg_is_default) {
+        if_err_return(rv, send_sgr_color(cbg, 1));
+    }
+    send_literal(rv, "m");
+    return TB_OK;
+}
+
+/* Changes only the colors that changed, with no reset first, so a color going
+ * back to the default is sent as such (39/49) rather than left out.
+ */
+static int send_sgr_delta(uintattr_t cfg, uintattr_t cbg,
+    uintattr_t fg_is_default, uintattr_t bg_is_default, int fg_changed,
+    int bg_changed) {
+    int rv;
+
+    if (!fg_changed && !bg_changed) {
+        return TB_OK;
+    }
+
+    send_literal(rv, "\x1b[");
+    if (fg_changed) {
+        if (fg_is_default) {
+            send_literal(rv, "39");
+        } else {
+            if_err_return(rv, send_sgr_color(cfg, 0));
+        }
+        if (bg_changed) {
+            send_literal(rv, ";");
+        }
+    }
+    if (bg_changed) {
+        if (bg_is_default) {
+            send_literal(rv, "49");
+        } else {
+            if_err_return(rv, send_sgr_color(cbg, 1));
+        }
+    }
+    send_literal(rv, "m");
+    return TB_OK;
+}
+
+// One color's parameters in an SGR sequence, as the output mode spells them
+static int send_sgr_color(uintattr_t c, int is_bg) {
+    int rv;
+    char nbuf[32];
+
     switch (global.output_mode) {
         default:
         case TB_OUTPUT_NORMAL:
-            send_literal(rv, "\x1b[");
-            if (!fg_is_default) {
-                send_literal(rv, "3");
-                send_num(rv, nbuf, cfg - 1);
-                if (!bg_is_default) {
-                    send_literal(rv, ";");
-                }
-            }
-            if (!bg_is_default) {
+            if (is_bg) {
                 send_literal(rv, "4");
-                send_num(rv, nbuf, cbg - 1);
+            } else {
+                send_literal(rv, "3");
             }
-            send_literal(rv, "m");
+            send_num(rv, nbuf, c - 1);
             break;
 
         case TB_OUTPUT_256:
         case TB_OUTPUT_216:
         case TB_OUTPUT_GRAYSCALE:
-            send_literal(rv, "\x1b[");
-            if (!fg_is_default) {
-                send_literal(rv, "38;5;");
-                send_num(rv, nbuf, cfg);
-                if (!bg_is_default) {
-                    send_literal(rv, ";");
-                }
-            }
-            if (!bg_is_default) {
+            if (is_bg) {
                 send_literal(rv, "48;5;");
-                send_num(rv, nbuf, cbg);
+            } else {
+                send_literal(rv, "38;5;");
             }
-            send_literal(rv, "m");
+            send_num(rv, nbuf, c);
             break;
 
 #ifdef TB_OPT_TRUECOLOR
         case TB_OUTPUT_TRUECOLOR:
-            send_literal(rv, "\x1b[");
-            if (!fg_is_default) {
-                send_literal(rv, "38;2;");
-                send_num(rv, nbuf, (cfg >> 16) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, (cfg >> 8) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, cfg & 0xff);
-                if (!bg_is_default) {
-                    send_literal(rv, ";");
-                }
-            }
-            if (!bg_is_default) {
+            if (is_bg) {
                 send_literal(rv, "48;2;");
-                send_num(rv, nbuf, (cbg >> 16) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, (cbg >> 8) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, cbg & 0xff);
+            } else {
+                send_literal(rv, "38;2;");
             }
-            send_literal(rv, "m");
+            send_num(rv, nbuf, (c >> 16) & 0xff);
+            send_literal(rv, ";");
+            send_num(rv, nbuf, (c >> 8) & 0xff);
+            send_literal(rv, ";");
+            send_num(rv, nbuf, c & 0xff);
             break;
 #endif
     }
@@ -3025,6 +3597,64 @@ static int send_cursor_if(int x, int y) {
     return TB_OK;
 }
 
+/* TB_PRESENT_LEAN's jump from just past the last cell sent to x,y. On the
+ * same row, a short gap of plain cells already in the current attributes is
+ * cheaper to print again than to jump over; otherwise it's whichever of a
+ * relative, column or absolute move is shortest. A cursor past the last
+ * column is in limbo (pending wrap), which only an absolute move gets out of.
+ */
+static int send_cursor_lean(int x, int y) {
+    int rv, i;
+    char nbuf[32];
+    int from = global.last_x + 1;
+    if (global.last_y != y || global.last_x < 0 || from >= global.width) {
+        return send_cursor_if(x, y);
+    }
+
+    if (x > from && x - from <= 3) {
+        char gap[3];
+        for (i = from; i < x; i++) {
+            struct tb_cell *cell;
+            if_err_return(rv, cellbuf_get(&global.front, i, y, &cell));
+            if (cell->ch < 0x20 || cell->ch >= 0x7f ||
+                cell->fg != global.last_fg || cell->bg != global.last_bg)
+                break;
+#ifdef TB_OPT_EGC
+            if (cell->nech > 0)
+                break;
+#endif
+            gap[i - from] = (char)cell->ch;
+        }
+        if (i == x) {
+            return bytebuf_nputs(&global.out, gap, (size_t)(x - from));
+        }
+    }
+
+    int n = x > from ? x - from : from - x;
+    int rel_len = n == 1 ? 3 : 3 + convert_num((uint32_t)n, nbuf);
+    int col_len = 3 + convert_num((uint32_t)x + 1, nbuf);
+    int abs_len = 4 + convert_num((uint32_t)y + 1, nbuf) +
+                  convert_num((uint32_t)x + 1, nbuf);
+    if (rel_len <= col_len && rel_len <= abs_len) {
+        send_literal(rv, "\x1b[");
+        if (n > 1) {
+            send_num(rv, nbuf, (uint32_t)n);
+        }
+        if (x > from) {
+            send_literal(rv, "C");
+        } else {
+            send_literal(rv, "D");
+        }
+    } else if (col_len <= abs_len) {
+        send_literal(rv, "\x1b[");
+        send_num(rv, nbuf, (uint32_t)x + 1);
+        send_literal(rv, "G");
+    } else {
+        return send_cursor_if(x, y);
+    }
+    return TB_OK;
+}
+
 static int send_char(int x, int y, uint32_t ch) {
     return send_cluster(x, y, &ch, 1);
 }
@@ -3034,7 +3664,11 @@ static int send_cluster(int x, int y, uint32_t *ch, size_t nch) {
     char abuf[8];
 
     if (global.last_x != x - 1 || global.last_y != y) {
-        if_err_return(rv, send_cursor_if(x, y));
+        if (global.present_mode == TB_PRESENT_LEAN) {
+            if_err_return(rv, send_cursor_lean(x, y));
+        } else {
+            if_err_return(rv, send_cursor_if(x, y));
+        }
     }
     global.last_x = x;
     global.last_y = y;
@@ -3243,7 +3877,8 @@ static int bytebuf_shift(struct bytebuf_t *b, size_t n) {
 }
 
 static int bytebuf_flush(struct bytebuf_t *b, int fd) {
-    if (b->len <= 0) {
+    if (b->len <= 0 || fd < 0) {
+        // No fd (a tb_ctx_new() context): it stays put for tb_ctx_output()
         return TB_OK;
     }
     ssize_t write_rv = write(fd, b->buf, b->len);
@@ -1,103 +1,158 @@
-/*********************************************************************
- * File: tetris.h                                                    *
- * Description: provides core structs, functions, and globals        *
- * Author: Zachary E Graber (zachgraber27@gmail.com)                 *
- * GitHub: @zacharygraber (https://github.com/zacharygraber)         *
- * Created: 2/20/2023                                                *
- *********************************************************************/
-
-#define TB_IMPL
-
-#include "termbox.h"
-#include <stdlib.h>
-#include <unistd.h>
-#include <stdio.h>
-#include <time.h>
-#include <signal.h>
-#include <math.h>
-#include <stdbool.h>
-
-#ifndef PTHREAD_HEADER_INCLUDED
-	#include <pthread.h>
-	#define PTHREAD_HEADER_INCLUDED
-#endif
-
-// widths here are doubled to get character-width (2 characters per board cell)
-#define BOARD_WIDTH 10 // MAX OF 255 
-#define BOARD_HEIGHT 20 // MAX OF 255
-#define MIN_WIDTH (BOARD_WIDTH + 2)*2
-#define MIN_HEIGHT (BOARD_HEIGHT + 2)
-
-// A game piece (a tetromino) is made of 4 blocks
-// Game board locations need to be signed to account for, e.g., rotating
-// a piece right as it spawns, which puts it above the board (negative y-value)
-typedef struct {
-	int8_t x; 
-	int8_t y; 
-} block_t;
-
-typedef struct {
-	block_t blocks[4];
-	uintattr_t color;
-} piece_t;
-
-typedef enum {
-	LEFT,
-	RIGHT,
-	DOWN // pieces can never move up
-} direc_t;
-
-typedef enum {
-	PLAY,
-	PAUSE,
-	GAME_OVER,
-	QUIT
-} game_state_t;
-
-// Globals (needed for functions below, but defined elsewhere)
-extern double drop_speed;
-extern volatile uintattr_t board[BOARD_WIDTH][BOARD_HEIGHT]; // board is 2D grid of colors (the active piece is NOT part of the board)
-extern volatile piece_t active_piece;
-extern pthread_mutex_t board_mutex, active_piece_mutex;
-extern pthread_t event_handler_pt;
-extern game_state_t GAME_STATE;
-
-// Helper functions to clean up main game loop's code
-void *event_handler_pthread_routine(void *args);
-void render();
-void draw_block(int x, int y, uintattr_t color);
-void show_321_countdown();
-void create_new_active_piece();
-bool move_active_piece(direc_t d);
-void rotate_active_piece();
-void hard_drop_active_piece();
-void settle_active_piece();
-void sigint_handler(int sig);
-
-void initialize();
-
-void pause_game() {
-	GAME_STATE = PAUSE;
-	return;
-}
-
-void resume_game() {
-	if (GAME_STATE == PLAY) return;
-
-	show_321_countdown();
-	render();
-	GAME_STATE = PLAY;
-	return;
-}
-
-void game_over() {
-	GAME_STATE = GAME_OVER;
-	tb_print(10, 8, TB_WHITE, TB_RED, "GAME");
-    tb_print(10, 9, TB_WHITE, TB_RED, "OVER");
-    tb_print(11, 11, TB_WHITE, TB_RED, ":(");
-    tb_present();
-	return;
-}
-
-void setup_new_game();
+/*********************************************************************
+ * File: tetris.h                                                    *
+ * Description: provides core structs, functions, and globals        *
+ * Author: Zachary E Graber (zachgraber27@gmail.com)                 *
+ * GitHub: @zacharygraber (https://github.com/zacharygraber)         *
+ * Created: 2/20/2023                                                *
+ *********************************************************************/
+
+#define TB_IMPL
+
+#include "termbox.h"
+#include "engine.h"
+#include "render.h"
+#include "replay.h"
+#include "bot.h"
+#include "server.h"
+#include "input_queue.h"
+#include "histogram.h"
+#include "snapshot.h"
+#include "simulate.h"
+#include "keyboard.h"
+#include "versus.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <math.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+
+#ifndef PTHREAD_HEADER_INCLUDED
+	#include <pthread.h>
+	#define PTHREAD_HEADER_INCLUDED
+#endif
+
+// The smallest terminal the board fits in: its frame at scale 1, see layout_compute()
+#define MIN_WIDTH FRAME_COLS
+#define MIN_HEIGHT FRAME_ROWS
+
+// The main loop wakes up once per frame, and at most one frame is presented per interval
+#define FRAME_HZ 60 // default, see --fps
+
+#define BOT_MOVE_MS 60 // game time between the bot's inputs in --autoplay
+
+#define MAX_PENDING_INPUTS 64 // keys timed between two presents, any more go untimed
+
+// Columns the 'i' stats overlay takes, right of the board (and next pieces) if there's room
+#define STATS_OVERLAY_WIDTH 37
+
+// How often the event handler pthread stops waiting for input to see if it should exit
+#define INPUT_POLL_MS 100
+
+typedef enum {
+	PLAY,
+	PAUSE,
+	GAME_OVER,
+	QUIT
+} game_state_t;
+
+// Globals (needed for functions below, but defined elsewhere)
+extern game_t game; // the one game this front end plays
+extern renderer_t renderer;
+extern bool clock_paused;
+extern pthread_t event_handler_pt;
+extern input_queue_t input_queue;
+extern atomic_bool input_stopping;
+extern bool single_threaded;
+extern bool fixed_seed;
+extern uint64_t game_seed;
+extern bool recording;
+extern replay_writer_t recorder;
+extern bool autoplay;
+extern bot_t bot;
+extern pool_t bot_pool;
+extern uint32_t next_bot_move_ms;
+extern long frame_ns;
+extern bool frame_dirty;
+extern double game_epoch_ms;
+extern snapshot_ring_t snapshots;
+extern game_state_t GAME_STATE;
+
+// Helper functions to clean up main game loop's code
+void *event_handler_pthread_routine(void *args);
+void handle_event(struct tb_event *event, double at_ms);
+int key_input(const struct tb_event *event);
+void run_event_loop();
+int play_replay(const char *path);
+int simulate(uint64_t n_games);
+int play_versus(const char *where);
+const char *versus_event(const struct tb_event *event);
+void layout_versus();
+void draw_versus(double now_ms);
+void arm_tick_timer(int timerfd);
+void render();
+void present_frame();
+void show_321_countdown();
+bool layout_screen();
+void resize_screen(int w, int h);
+void draw_too_small();
+void draw_game_over();
+void wait_for_frame(int timerfd, struct timespec *next_frame);
+void handle_queued_input();
+uint64_t clock_seed();
+unsigned thread_count();
+uint32_t game_clock_ms();
+void pause_clock();
+void resume_clock();
+void player_input(input_t in, double at_ms);
+bool apply_input(input_t in);
+void game_tick();
+void autoplay_tick();
+void handle_game_events();
+void toggle_stats_overlay();
+void draw_stats_overlay();
+void dump_stats(const char *why);
+void check_stats_dump();
+void sigusr1_handler(int sig);
+void sigint_handler(int sig);
+
+void initialize();
+
+void pause_game() {
+	GAME_STATE = PAUSE;
+	pause_clock();
+	return;
+}
+
+void resume_game() {
+	if (GAME_STATE == PLAY || !renderer.layout.scale) return;
+
+	show_321_countdown();
+	render();
+	resume_clock();
+	GAME_STATE = PLAY;
+	return;
+}
+
+void game_over() {
+	GAME_STATE = GAME_OVER;
+	draw_game_over();
+	return;
+}
+
+void draw_game_over() {
+	draw_game_over_text(&renderer.layout);
+	frame_dirty = true;
+}
+
+void setup_new_game();
+void restore_game(const game_t *g);
+bool resume_saved_game();
+void undo_piece();
 void quit(int status, const char *exit_msg);
\ No newline at end of file
@@ -0,0 +1,88 @@
+/*********************************************************************
+ * File: versus.h                                                    *
+ * Description: two players head to head over UDP. Only inputs are   *
+ *              sent; both sides run both games, rolling back to fix *
+ *              what they guessed of the other player's              *
+ *********************************************************************/
+
+#ifndef VERSUS_HEADER_INCLUDED
+#define VERSUS_HEADER_INCLUDED
+
+#include "engine.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VERSUS_FRAME_MS 16 // game time per lockstep frame: inputs are applied at frame starts
+#define VERSUS_MAX_ROLLBACK 32 // frames a side can run ahead of what it has heard (or had acked)
+#define VERSUS_RING 64 // frames of input kept per player (a power of 2 above VERSUS_MAX_ROLLBACK)
+#define VERSUS_HELLO_MS 250 // a side that hasn't heard from the other yet says hello this often
+#define VERSUS_TIMEOUT_MS 5000 // silence after which the other side is gone
+#define VERSUS_LINGER_MS 1000 // after the match ends, inputs keep going out until acked, or this long, so both sides see it end
+
+/* Packets, little endian, all starting with VERSUS_MAGIC and a type:
+ *
+ *   HELLO   joiner -> host, repeated until START comes back
+ *   START   host -> joiner: seed:u64, the same for both games
+ *   INPUTS  ack:u32  first:u32  count:u8  then count inputs:u16
+ *
+ * An input is one frame of one player's key presses, a bit per input_t.
+ * INPUTS carries every frame of the sender's from `first` on, which starts
+ * at what the other side acked (the count of the sender's frames it has),
+ * so a lost packet is made up for by the next one. ack is the count of the
+ * other side's frames the sender has.
+ */
+#define VERSUS_MAGIC 0x56 // 'V'
+#define VERSUS_HELLO 1
+#define VERSUS_START 2
+#define VERSUS_INPUTS 3
+#define VERSUS_PACKET_MAX (11 + 2 * VERSUS_MAX_ROLLBACK)
+
+_Static_assert(INPUT_COUNT <= 16, "an input_t has to fit a bit of a frame's inputs");
+_Static_assert((VERSUS_RING & (VERSUS_RING - 1)) == 0 && VERSUS_RING > VERSUS_MAX_ROLLBACK, "see VERSUS_RING");
+
+/* One match. Player 0 hosts, player 1 joined. Games are only ever advanced a
+ * whole frame at a time, both in the same order with the same inputs, so
+ * both sides agree on every frame both players' inputs are known for. Past
+ * that, the other player is guessed to press nothing new (keys it holds stay
+ * held), and the guess is thrown away as soon as its real inputs arrive.
+ */
+typedef struct {
+	int fd;
+	bool host;
+	uint8_t me; // this side's player
+	bool started; // the host heard hello (or the joiner got START)
+	bool over; // one of the games ended, in frames both sides agree on
+	uint64_t seed;
+	double start_ms; // monotonic time of frame 0, moved on by frames spent waiting
+	double heard_ms; // when the other side was last heard from
+	double sent_ms; // when this side last sent anything
+	double over_ms;
+
+	uint32_t frame; // frames of our own input so far (the next one is being collected)
+	uint32_t heard; // frames of the other player's input received, in order
+	uint32_t acked; // frames of ours the other side says it has
+	uint16_t collecting; // our inputs for the frame being collected (number `frame`), as bits
+	uint16_t inputs[2][VERSUS_RING]; // each player's frame f at [f % VERSUS_RING]
+
+	game_t confirmed[2]; // both games after `confirmed_frame` frames, all with real inputs
+	uint32_t confirmed_frame;
+	game_t games[2]; // both games after `frame` frames, guessing past `confirmed_frame`
+
+	// For the status line
+	uint32_t rollback; // frames re-run with the latest guess
+	uint32_t max_rollback;
+	uint32_t stalls; // frames spent waiting for the other side
+	uint32_t packet_bytes; // size of the last INPUTS sent
+} versus_t;
+
+bool versus_open(versus_t *v, const char *where, uint64_t seed, double now_ms);
+void versus_close(versus_t *v);
+void versus_step(game_t g[2], const uint16_t in[2], uint32_t frame);
+void versus_input(versus_t *v, input_t in);
+bool versus_receive(versus_t *v, double now_ms);
+bool versus_advance(versus_t *v, double now_ms);
+double versus_next_ms(const versus_t *v);
+bool versus_gone(const versus_t *v, double now_ms);
+bool versus_done(const versus_t *v, double now_ms);
+
+#endif
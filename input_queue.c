@@ -0,0 +1,60 @@
+/*********************************************************************
+ * File: input_queue.c                                               *
+ * Description: lock-free single-producer/single-consumer ring that  *
+ *              hands timestamped termbox events to the game thread  *
+ *********************************************************************/
+
+#include "include/input_queue.h"
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+bool input_queue_init(input_queue_t *q) {
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	q->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return q->wake_fd >= 0;
+}
+
+/* Producer side. Returns false (dropping the event) if the consumer has
+ * fallen INPUT_QUEUE_SIZE events behind.
+ */
+bool input_queue_push(input_queue_t *q, const struct tb_event *event, double at_ms) {
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (tail - head == INPUT_QUEUE_SIZE) return false;
+
+	queued_input_t *slot = &q->slots[tail & (INPUT_QUEUE_SIZE - 1)];
+	slot->event = *event;
+	slot->at_ms = at_ms;
+	// Publishes the slot: the consumer won't look at it before seeing this
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	uint64_t one = 1;
+	write(q->wake_fd, &one, sizeof(one)); // can only fail if the counter is saturated, still readable then
+	return true;
+}
+
+/* Consumer side. Returns false once the queue is empty. The wake fd is reset
+ * before looking, so an event pushed during a drain wakes the next poll().
+ */
+bool input_queue_pop(input_queue_t *q, queued_input_t *out) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head == tail) {
+		uint64_t count;
+		if (read(q->wake_fd, &count, sizeof(count)) < 0) return false; // nothing pushed since
+		tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+		if (head == tail) return false;
+	}
+
+	*out = q->slots[head & (INPUT_QUEUE_SIZE - 1)];
+	// Hands the slot back to the producer
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return true;
+}
+
+void input_queue_destroy(input_queue_t *q) {
+	if (q->wake_fd >= 0) close(q->wake_fd);
+	q->wake_fd = -1;
+}
@@ -0,0 +1,130 @@
+/*********************************************************************
+ * File: keyboard.c                                                  *
+ * Description: the kitty keyboard protocol, for terminals that can  *
+ *              report when a key is held down and let go            *
+ *********************************************************************/
+
+#include "include/keyboard.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define CODE_MAX 0x10ffff // the last Unicode code point
+#define PRIVATE_USE_FIRST 57344 // kitty's codes for keys with no code point (keypad, media, ...)
+#define PRIVATE_USE_LAST 63743
+
+// Event types, the number after the ':' in a key's modifiers
+#define EVENT_REPEAT 2
+#define EVENT_RELEASE 3
+
+// Set from the terminal's answer to the query keyboard_enable() sends,
+// on whichever thread reads input
+static atomic_bool reports_releases = false;
+
+/* Asks the terminal for key events (see KEYBOARD_FLAGS), and what it
+ * actually gave, which comes back as input. Call it right after tb_init().
+ */
+void keyboard_enable(void) {
+	tb_set_func(TB_FUNC_EXTRACT_PRE, keyboard_extract);
+	tb_sendf("\x1b[>%du\x1b[?u", KEYBOARD_FLAGS);
+}
+
+// Puts the terminal's keyboard mode back. Call it just before tb_shutdown().
+void keyboard_disable(void) {
+	tb_send("\x1b[<u", 4);
+	tb_set_func(TB_FUNC_EXTRACT_PRE, NULL);
+}
+
+// Whether key releases arrive (as KEY_MOD_RELEASE events)
+bool keyboard_reports_releases(void) {
+	return atomic_load_explicit(&reports_releases, memory_order_relaxed);
+}
+
+/* Reads the digits at buf[*i] into *v, leaving it alone if there are none.
+ * Returns false if the input ran out before something else came along.
+ */
+static bool digits(const char *buf, size_t len, size_t *i, uint32_t *v) {
+	if (*i < len && buf[*i] >= '0' && buf[*i] <= '9') *v = 0;
+	for (; *i < len && buf[*i] >= '0' && buf[*i] <= '9'; (*i)++) {
+		if (*v <= CODE_MAX) *v = *v * 10 + (buf[*i] - '0');
+	}
+	return *i < len;
+}
+
+// A key that kitty sends as CSI code u
+static void code_key(struct tb_event *event, uint32_t code) {
+	switch (code) {
+		case TB_KEY_ESC:
+		case TB_KEY_ENTER:
+		case TB_KEY_TAB:
+		case TB_KEY_BACKSPACE2:
+			event->key = code;
+			return;
+	}
+	if ((event->mod & TB_MOD_CTRL) && code >= 'a' && code <= 'z') event->key = TB_KEY_CTRL_A + (code - 'a');
+	else if (code >= ' ' && code <= CODE_MAX && (code < PRIVATE_USE_FIRST || code > PRIVATE_USE_LAST)) event->ch = code;
+}
+
+// A key that kitty sends as CSI 1 letter or CSI number ~, as legacy terminals do
+static void legacy_key(struct tb_event *event, uint32_t code, char final) {
+	switch (final) {
+		case 'A': event->key = TB_KEY_ARROW_UP; return;
+		case 'B': event->key = TB_KEY_ARROW_DOWN; return;
+		case 'C': event->key = TB_KEY_ARROW_RIGHT; return;
+		case 'D': event->key = TB_KEY_ARROW_LEFT; return;
+		case 'H': event->key = TB_KEY_HOME; return;
+		case 'F': event->key = TB_KEY_END; return;
+	}
+	switch (code) {
+		case 2: event->key = TB_KEY_INSERT; return;
+		case 3: event->key = TB_KEY_DELETE; return;
+		case 5: event->key = TB_KEY_PGUP; return;
+		case 6: event->key = TB_KEY_PGDN; return;
+	}
+}
+
+/* TB_FUNC_EXTRACT_PRE: takes the sequences termbox doesn't know, which are
+ *   CSI code [; modifiers [: event type]] u
+ *   CSI 1 ; modifiers : event type letter    (and CSI number ; ... ~)
+ *   CSI ? flags u                             (the answer to keyboard_enable())
+ * and leaves everything else to termbox. Keys it doesn't use still become an
+ * event, one with no key, so they can't turn into stray escapes.
+ */
+int keyboard_extract(struct tb_event *event, size_t *consumed) {
+	size_t len;
+	const char *buf = tb_input_pending(&len);
+	if (len < 2 || buf[0] != '\x1b' || buf[1] != '[') return TB_ERR;
+
+	size_t i = 2;
+	bool answer = (i < len && buf[i] == '?');
+	if (answer) i++;
+	uint32_t code = 1, mods = 1, type = 1;
+	bool typed = false;
+	if (!digits(buf, len, &i, &code)) return TB_ERR_NEED_MORE;
+	if (buf[i] == ';') {
+		i++;
+		if (!digits(buf, len, &i, &mods)) return TB_ERR_NEED_MORE;
+		if (buf[i] == ':') {
+			i++;
+			typed = true;
+			if (!digits(buf, len, &i, &type)) return TB_ERR_NEED_MORE;
+		}
+	}
+	char final = buf[i];
+	if (final != 'u' && !typed) return TB_ERR;
+	*consumed = i + 1;
+
+	if (answer) {
+		atomic_store_explicit(&reports_releases, (code & KEYBOARD_REPORTS_EVENTS) != 0, memory_order_relaxed);
+		return TB_OK;
+	}
+	event->type = TB_EVENT_KEY;
+	if (mods) mods--; // sent plus one
+	if (mods & 1) event->mod |= TB_MOD_SHIFT;
+	if (mods & 2) event->mod |= TB_MOD_ALT;
+	if (mods & 4) event->mod |= TB_MOD_CTRL;
+	if (type == EVENT_REPEAT) event->mod |= KEY_MOD_REPEAT;
+	if (type == EVENT_RELEASE) event->mod |= KEY_MOD_RELEASE;
+	if (final == 'u') code_key(event, code);
+	else legacy_key(event, code, final);
+	return TB_OK;
+}
@@ -0,0 +1,291 @@
+/*********************************************************************
+ * File: metrics.c                                                   *
+ * Description: counters each thread keeps on its own cache line,    *
+ *              summed only when scraped as Prometheus text over HTTP*
+ *********************************************************************/
+
+#define _GNU_SOURCE // accept4()
+#include "include/metrics.h"
+#include "include/server.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static metrics_slot_t slots[METRICS_MAX_THREADS];
+static _Atomic unsigned n_slots = 0;
+static _Thread_local metrics_slot_t *my_slot = NULL;
+
+// What a scrape shows for each counter: its name, type and help, and what it's multiplied by
+static const struct {
+	const char *name, *type, *help;
+	double scale;
+} COUNTERS[METRIC_COUNTERS] = {
+	[METRIC_SESSIONS] = { "tetris_sessions", "gauge", "Players connected to --serve", 1 },
+	[METRIC_TICKS] = { "tetris_ticks_total", "counter", "Server ticks, each updating and drawing every session", 1 },
+	[METRIC_SESSION_TICKS] = { "tetris_session_ticks_total", "counter", "Sessions updated and drawn", 1 },
+	[METRIC_PRESENTS] = { "tetris_presents_total", "counter", "Frames sent to the terminal or a session", 1 },
+	[METRIC_PRESENT_BYTES] = { "tetris_present_bytes_total", "counter", "Bytes those frames took", 1 },
+	[METRIC_LOCK_WAITS] = { "tetris_lock_waits_total", "counter", "Times a thread found a lock taken", 1 },
+	[METRIC_LOCK_WAIT_NS] = { "tetris_lock_wait_seconds_total", "counter", "Time spent waiting for those locks", 1e-9 },
+	[METRIC_BOT_SEARCHES] = { "tetris_bot_searches_total", "counter", "Pieces the bot searched for", 1 },
+	[METRIC_BOT_NODES] = { "tetris_bot_nodes_total", "counter", "Boards the bot placed a piece on while searching", 1 },
+	[METRIC_ARENA_MALLOCS] = { "tetris_arena_mallocs_total", "counter", "Blocks the search arenas had to malloc()", 1 },
+};
+
+static const struct {
+	const char *name, *help;
+} PEAKS[METRIC_PEAKS] = {
+	[METRIC_ARENA_PEAK] = { "tetris_arena_peak_bytes", "The most one search arena has held" },
+};
+
+// Counters also shown as a rate over the last METRICS_RATE_MS
+static const struct {
+	metric_t m;
+	const char *name, *help;
+} RATES[] = {
+	{ METRIC_TICKS, "tetris_ticks_per_second", "Server ticks over the last second" },
+	{ METRIC_SESSION_TICKS, "tetris_session_ticks_per_second", "Sessions drawn over the last second" },
+	{ METRIC_PRESENTS, "tetris_presents_per_second", "Frames presented over the last second" },
+	{ METRIC_BOT_NODES, "tetris_bot_nodes_per_second", "Boards searched over the last second" },
+};
+
+static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// The calling thread's slot, handed out the first time it counts something
+static metrics_slot_t *slot() {
+	if (!my_slot) {
+		unsigned i = atomic_fetch_add_explicit(&n_slots, 1, memory_order_relaxed);
+		my_slot = &slots[i < METRICS_MAX_THREADS ? i : METRICS_MAX_THREADS - 1];
+	}
+	return my_slot;
+}
+
+// THREAD SAFE
+void metrics_add(metric_t m, int64_t n) {
+	atomic_fetch_add_explicit(&slot()->counters[m], (uint64_t) n, memory_order_relaxed);
+}
+
+static void raise_to(_Atomic uint64_t *max, uint64_t value) {
+	uint64_t current = atomic_load_explicit(max, memory_order_relaxed);
+	while (value > current && !atomic_compare_exchange_weak_explicit(max, &current, value,
+	                                                                 memory_order_relaxed, memory_order_relaxed))
+		continue;
+}
+
+// THREAD SAFE
+void metrics_peak(metric_peak_t m, uint64_t value) {
+	raise_to(&slot()->peaks[m], value);
+}
+
+// A key's time to the screen, in microseconds (negative counts as 0, as in histogram_record())
+// THREAD SAFE
+void metrics_latency(double us) {
+	uint64_t v = us > 0 ? (uint64_t) us : 0;
+	metrics_slot_t *s = slot();
+	atomic_fetch_add_explicit(&s->latency[histogram_bucket(v)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->latency_sum_us, v, memory_order_relaxed);
+	raise_to(&s->latency_max_us, v);
+}
+
+/* pthread_mutex_lock(), counting how long it waited if the lock was taken.
+ * Only a lock that's taken pays for the clock.
+ */
+// THREAD SAFE
+void metrics_lock(pthread_mutex_t *lock) {
+	if (pthread_mutex_trylock(lock) == 0) return;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(lock);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	metrics_add(METRIC_LOCK_WAITS, 1);
+	metrics_add(METRIC_LOCK_WAIT_NS, (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+}
+
+// Scraping ////////////
+
+// Everything the threads have counted so far, summed
+typedef struct {
+	uint64_t counters[METRIC_COUNTERS];
+	uint64_t peaks[METRIC_PEAKS];
+	histogram_t latency;
+} metrics_totals_t;
+
+static void sum_slots(metrics_totals_t *t) {
+	memset(t, 0, sizeof(*t));
+	unsigned n = atomic_load_explicit(&n_slots, memory_order_relaxed);
+	if (n > METRICS_MAX_THREADS) n = METRICS_MAX_THREADS;
+	for (unsigned i = 0; i < n; i++) {
+		metrics_slot_t *s = &slots[i];
+		for (int m = 0; m < METRIC_COUNTERS; m++) {
+			t->counters[m] += atomic_load_explicit(&s->counters[m], memory_order_relaxed);
+		}
+		for (int m = 0; m < METRIC_PEAKS; m++) {
+			uint64_t peak = atomic_load_explicit(&s->peaks[m], memory_order_relaxed);
+			if (peak > t->peaks[m]) t->peaks[m] = peak;
+		}
+		for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+			uint64_t count = atomic_load_explicit(&s->latency[b], memory_order_relaxed);
+			t->latency.counts[b] += count;
+			t->latency.total += count;
+		}
+		t->latency.sum_us += atomic_load_explicit(&s->latency_sum_us, memory_order_relaxed);
+		uint64_t max = atomic_load_explicit(&s->latency_max_us, memory_order_relaxed);
+		if (max > t->latency.max_us) t->latency.max_us = max;
+	}
+}
+
+// Appends to a fixed buffer, dropping whatever doesn't fit
+static void append(char *body, size_t *len, const char *fmt, ...) {
+	if (*len >= METRICS_BODY_MAX) return;
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(body + *len, METRICS_BODY_MAX - *len, fmt, args);
+	va_end(args);
+	if (n > 0) *len = (*len + n < METRICS_BODY_MAX) ? *len + n : METRICS_BODY_MAX;
+}
+
+static void append_metric(char *body, size_t *len, const char *name, const char *type, const char *help, double value) {
+	append(body, len, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+/* The Prometheus text format (version 0.0.4). `rates` are per second, and
+ * `bytes_per_present` is over the same last METRICS_RATE_MS.
+ */
+static size_t format_metrics(char *body, const metrics_totals_t *t, const double rates[], double bytes_per_present) {
+	size_t len = 0;
+	for (int m = 0; m < METRIC_COUNTERS; m++) {
+		double value = (m == METRIC_SESSIONS) ? (double) (int64_t) t->counters[m] : t->counters[m] * COUNTERS[m].scale;
+		append_metric(body, &len, COUNTERS[m].name, COUNTERS[m].type, COUNTERS[m].help, value);
+	}
+	for (size_t i = 0; i < sizeof(RATES) / sizeof(RATES[0]); i++) {
+		append_metric(body, &len, RATES[i].name, "gauge", RATES[i].help, rates[i]);
+	}
+	append_metric(body, &len, "tetris_present_bytes_per_frame", "gauge", "Bytes per frame presented over the last second",
+	              bytes_per_present);
+	for (int m = 0; m < METRIC_PEAKS; m++) {
+		append_metric(body, &len, PEAKS[m].name, "gauge", PEAKS[m].help, (double) t->peaks[m]);
+	}
+
+	const char *name = "tetris_input_latency_seconds";
+	append(body, &len, "# HELP %s From a key arriving to the frame that shows it\n# TYPE %s summary\n", name, name);
+	for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+		append(body, &len, "%s{quantile=\"%g\"} %.6f\n", name, QUANTILES[i],
+		       histogram_percentile(&t->latency, QUANTILES[i] * 100) / 1e6);
+	}
+	append(body, &len, "%s_sum %.6f\n%s_count %llu\n", name, t->latency.sum_us / 1e6, name,
+	       (unsigned long long) t->latency.total);
+	return len;
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Answers one scraper: whatever it asks for, it gets the metrics. The
+ * request is read up to its blank line (or as much as comes in time).
+ */
+static void answer(int listen_fd, const char *body, size_t body_len) {
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) return;
+	struct timeval timeout = { .tv_sec = METRICS_CLIENT_TIMEOUT_MS / 1000, .tv_usec = METRICS_CLIENT_TIMEOUT_MS % 1000 * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	char request[1024];
+	size_t got = 0;
+	while (got < sizeof(request) - 1) {
+		ssize_t n = recv(fd, request + got, sizeof(request) - 1 - got, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		got += n;
+		request[got] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+	}
+
+	char header[128];
+	int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+	                          "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+	if (send_all(fd, header, header_len)) send_all(fd, body, body_len);
+	close(fd);
+}
+
+/* The scrape thread: answers one scraper at a time, and works out the rates
+ * every METRICS_RATE_MS. It only ever reads the counters.
+ */
+static void *serve_scrapes(void *arg) {
+	int listen_fd = *(int *) arg;
+	free(arg);
+	static metrics_totals_t now, then;
+	static char body[METRICS_BODY_MAX];
+	double rates[sizeof(RATES) / sizeof(RATES[0])] = {0};
+	double bytes_per_present = 0;
+
+	sum_slots(&then);
+	double then_ms = monotonic_ms();
+	while (true) {
+		double wait_ms = then_ms + METRICS_RATE_MS - monotonic_ms();
+		struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+		int ready = poll(&pfd, 1, wait_ms > 0 ? (int) wait_ms + 1 : 0);
+
+		double now_ms = monotonic_ms();
+		if (now_ms >= then_ms + METRICS_RATE_MS) {
+			sum_slots(&now);
+			double s = (now_ms - then_ms) / 1000;
+			for (size_t i = 0; i < sizeof(RATES) / sizeof(RATES[0]); i++) {
+				rates[i] = (now.counters[RATES[i].m] - then.counters[RATES[i].m]) / s;
+			}
+			uint64_t presents = now.counters[METRIC_PRESENTS] - then.counters[METRIC_PRESENTS];
+			bytes_per_present = presents ? (double) (now.counters[METRIC_PRESENT_BYTES] - then.counters[METRIC_PRESENT_BYTES]) / presents : 0;
+			then = now;
+			then_ms = now_ms;
+		}
+		if (ready > 0) {
+			sum_slots(&now);
+			answer(listen_fd, body, format_metrics(body, &now, rates, bytes_per_present));
+		}
+	}
+	return NULL;
+}
+
+/* --metrics: serves the counters on TCP `port` from a thread of its own,
+ * for as long as the program runs
+ * returns false if it couldn't listen
+ */
+bool metrics_serve(const char *port) {
+	int *listen_fd = malloc(sizeof(int));
+	if (!listen_fd) return false;
+	*listen_fd = open_listener(port);
+	if (*listen_fd < 0) {
+		free(listen_fd);
+		return false;
+	}
+
+	// Signals are for the threads that handle them, so the scrape thread blocks them all
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_t thread;
+	bool started = pthread_create(&thread, NULL, serve_scrapes, listen_fd) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!started) {
+		close(*listen_fd);
+		free(listen_fd);
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
@@ -0,0 +1,209 @@
+/*********************************************************************
+ * File: pool.c                                                      *
+ * Description: work-stealing thread pool for splitting searches     *
+ *              across cores                                         *
+ *********************************************************************/
+
+#include "include/pool.h"
+#include "include/metrics.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_DEQUE_CAP 64
+
+// Which deque belongs to the calling thread (-1 outside the pool)
+static __thread int worker_index = -1;
+static __thread pool_t *worker_pool = NULL;
+
+static bool deque_push(pool_deque_t *d, pool_task_t task) {
+	metrics_lock(&d->lock);
+	if (d->count == d->cap) {
+		size_t cap = d->cap ? d->cap * 2 : INITIAL_DEQUE_CAP;
+		pool_task_t *grown = malloc(cap * sizeof(pool_task_t));
+		if (!grown) {
+			pthread_mutex_unlock(&d->lock);
+			return false;
+		}
+		// Unwrap the ring so the oldest task is at 0 again
+		for (size_t i = 0; i < d->count; i++) {
+			grown[i] = d->tasks[(d->top + i) % d->cap];
+		}
+		free(d->tasks);
+		d->tasks = grown;
+		d->cap = cap;
+		d->top = 0;
+	}
+	d->tasks[(d->top + d->count) % d->cap] = task;
+	d->count++;
+	pthread_mutex_unlock(&d->lock);
+	return true;
+}
+
+// Newest task, for the owner
+static bool deque_pop_bottom(pool_deque_t *d, pool_task_t *task) {
+	metrics_lock(&d->lock);
+	bool got = d->count > 0;
+	if (got) {
+		d->count--;
+		*task = d->tasks[(d->top + d->count) % d->cap];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return got;
+}
+
+// Oldest task, for a thief
+static bool deque_steal_top(pool_deque_t *d, pool_task_t *task) {
+	metrics_lock(&d->lock);
+	bool got = d->count > 0;
+	if (got) {
+		*task = d->tasks[d->top];
+		d->top = (d->top + 1) % d->cap;
+		d->count--;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return got;
+}
+
+// Takes a task from worker `self`'s own deque, or steals one from the others
+static bool find_task(pool_t *pool, unsigned self, pool_task_t *task) {
+	if (deque_pop_bottom(&pool->deques[self], task)) return true;
+	for (unsigned i = 1; i < pool->n_workers; i++) {
+		if (deque_steal_top(&pool->deques[(self + i) % pool->n_workers], task)) return true;
+	}
+	return false;
+}
+
+// Thread start arguments, so each worker knows its pool and deque
+typedef struct {
+	pool_t *pool;
+	unsigned index;
+} worker_start_t;
+
+static void *worker_routine(void *args) {
+	worker_start_t start = *(worker_start_t *) args;
+	free(args);
+	pool_t *pool = worker_pool = start.pool;
+	unsigned self = start.index;
+	worker_index = (int) self;
+
+	while (true) {
+		metrics_lock(&pool->lock);
+		while (pool->queued == 0 && !pool->shutting_down)
+			pthread_cond_wait(&pool->work_ready, &pool->lock);
+		if (pool->shutting_down) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		pool->queued--; // claim one of the queued tasks, so no other worker waits on it
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_task_t task;
+		while (!find_task(pool, self, &task))
+			continue;
+
+		task.fn(task.arg);
+
+		metrics_lock(&pool->lock);
+		if (--pool->outstanding == 0) pthread_cond_broadcast(&pool->all_done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/* Starts `n_workers` threads (at least one)
+ * returns false if the pool couldn't be set up
+ */
+bool pool_init(pool_t *pool, unsigned n_workers) {
+	memset(pool, 0, sizeof(*pool));
+	if (n_workers == 0) n_workers = 1;
+	pool->deques = calloc(n_workers, sizeof(pool_deque_t));
+	pool->threads = calloc(n_workers, sizeof(pthread_t));
+	if (!pool->deques || !pool->threads) goto fail;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_ready, NULL);
+	pthread_cond_init(&pool->all_done, NULL);
+	for (unsigned i = 0; i < n_workers; i++) {
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	}
+
+	for (unsigned i = 0; i < n_workers; i++) {
+		worker_start_t *start = malloc(sizeof(worker_start_t));
+		if (!start) break;
+		*start = (worker_start_t) { .pool = pool, .index = i };
+		if (pthread_create(&pool->threads[i], NULL, worker_routine, start)) {
+			free(start);
+			break;
+		}
+		pool->n_workers++;
+	}
+	if (pool->n_workers > 0) return true;
+
+fail:
+	free(pool->deques);
+	free(pool->threads);
+	return false;
+}
+
+/* Queues fn(arg). From inside a task the new task goes on that worker's own
+ * deque; from outside the pool they are dealt out round robin.
+ */
+// THREAD SAFE
+void pool_submit(pool_t *pool, pool_task_fn fn, void *arg) {
+	pool_task_t task = { .fn = fn, .arg = arg };
+
+	// Counted before it's visible, so pool_wait() can never see a parent
+	// finish before the child it submitted has been accounted for
+	metrics_lock(&pool->lock);
+	unsigned target = (worker_pool == pool) ? (unsigned) worker_index : pool->next_deque++ % pool->n_workers;
+	pool->outstanding++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!deque_push(&pool->deques[target], task)) {
+		fn(arg); // out of memory: just run it here
+		metrics_lock(&pool->lock);
+		if (--pool->outstanding == 0) pthread_cond_broadcast(&pool->all_done);
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+	metrics_lock(&pool->lock);
+	pool->queued++;
+	pthread_cond_signal(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// The calling thread's worker number in `pool` (0 to n_workers-1), or -1 if it isn't one of its workers
+// THREAD SAFE
+int pool_worker_index(const pool_t *pool) {
+	return (worker_pool == pool) ? worker_index : -1;
+}
+
+// Blocks until every task submitted so far, and every task those submitted, has run.
+// Must not be called from inside a task.
+void pool_wait(pool_t *pool) {
+	metrics_lock(&pool->lock);
+	while (pool->outstanding > 0)
+		pthread_cond_wait(&pool->all_done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Stops the workers (after they finish the task they're on) and frees the pool
+void pool_destroy(pool_t *pool) {
+	metrics_lock(&pool->lock);
+	pool->shutting_down = true;
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+	for (unsigned i = 0; i < pool->n_workers; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	for (unsigned i = 0; i < pool->n_workers; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_ready);
+	pthread_cond_destroy(&pool->all_done);
+	free(pool->deques);
+	free(pool->threads);
+	memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,350 @@
+/*********************************************************************
+ * File: render.c                                                    *
+ * Description: draws a game_t into termbox's back buffer, touching  *
+ *              only the cells that changed since the last frame     *
+ *********************************************************************/
+
+#include "include/render.h"
+#include <string.h>
+
+static void draw_flash(renderer_t *r, const game_t *g, int8_t phase);
+static void draw_preview(const layout_t *l, uint8_t slot, piece_type_t type);
+
+/* Works out where everything goes on a width x height screen, with side_cols
+ * columns kept free right of the board (and panel) if they fit. What fits
+ * wins over scale: the biggest scale with room for the panel and the side
+ * columns, failing that the panel alone, and only then the board alone.
+ * Returns whether the board fits.
+ */
+bool layout_compute(layout_t *l, int width, int height, int side_cols) {
+	memset(l, 0, sizeof(*l));
+	l->width = width;
+	l->height = height;
+
+	for (int pass = (side_cols > 0 ? 0 : 1); pass < 3 && !l->scale; pass++) {
+		l->panel = pass < 2;
+		l->side = pass < 1;
+		for (int s = LAYOUT_MAX_SCALE; s >= 1 && !l->scale; s--) {
+			int cols = FRAME_COLS * s;
+			if (l->panel) cols += PANEL_GAP + PANEL_CELLS_WIDE * 2 * s;
+			if (l->side) cols += PANEL_GAP + side_cols;
+			if (cols <= width && FRAME_ROWS * s <= height) l->scale = s;
+		}
+	}
+	if (!l->scale) {
+		l->panel = l->side = false;
+		return false;
+	}
+
+	l->cell_cols = 2 * l->scale;
+	l->cell_rows = l->scale;
+	int frame_cols = FRAME_COLS * l->scale, frame_rows = FRAME_ROWS * l->scale;
+	int content_cols = frame_cols;
+	if (l->panel) content_cols += PANEL_GAP + PANEL_CELLS_WIDE * l->cell_cols;
+	if (l->side) content_cols += PANEL_GAP + side_cols;
+
+	l->board_x = (width - content_cols) / 2;
+	l->board_y = (height - frame_rows) / 2;
+	l->panel_x = l->board_x + frame_cols + PANEL_GAP;
+	l->panel_y = l->board_y + l->cell_rows; // level with the top row of the board
+	l->side_x = l->panel_x + (l->panel ? PANEL_CELLS_WIDE * l->cell_cols + PANEL_GAP : 0);
+	l->side_y = l->panel_y;
+	return true;
+}
+
+// What blocks are made of, as code points so drawing never decodes UTF-8
+#define BLOCK_CHAR 0x2588 // █
+#define GHOST_CHAR 0x2591 // ░
+#define LEAN_BLOCK_CHAR ' '
+#define LEAN_GHOST_CHAR ':'
+
+/* The cell every column of a block of `color` is made of. On a screen
+ * that's short of bytes (TB_PRESENT_LEAN) it's a space on a `color`
+ * background: 1 byte a column instead of 3, and color changes that only
+ * touch the background. A ghost is the color on black either way, ASCII
+ * when short of bytes.
+ */
+static struct tb_cell block_cell(uintattr_t color, bool lean) {
+	if (color & GHOST_BLOCK)
+		return (struct tb_cell) { .ch = lean ? LEAN_GHOST_CHAR : GHOST_CHAR, .fg = color & ~GHOST_BLOCK, .bg = TB_BLACK };
+	if (lean) return (struct tb_cell) { .ch = LEAN_BLOCK_CHAR, .fg = TB_DEFAULT, .bg = color };
+	return (struct tb_cell) { .ch = BLOCK_CHAR, .fg = color, .bg = TB_BLACK };
+}
+
+// Whether the screen being drawn presents with TB_PRESENT_LEAN
+static bool lean_screen() {
+	return tb_set_present_mode(TB_PRESENT_CURRENT) == TB_PRESENT_LEAN;
+}
+
+// Sets `n` cells of `strip` on each of the cell_rows screen rows from x,y down
+static void put_strip(const layout_t *l, int x, int y, const struct tb_cell *strip, int n) {
+	for (int i = 0; i < l->cell_rows; i++)
+		tb_set_cells(x, y + i, strip, n);
+}
+
+// One block of `color` with its top left corner at screen position x,y
+static void put_block(const layout_t *l, int x, int y, uintattr_t color) {
+	struct tb_cell strip[2 * LAYOUT_MAX_SCALE];
+	struct tb_cell cell = block_cell(color, lean_screen());
+	for (int i = 0; i < l->cell_cols; i++)
+		strip[i] = cell;
+	put_strip(l, x, y, strip, l->cell_cols);
+}
+
+/* draws a square(ish) block of `color` at x,y in GAME GRID COORDINATES,
+ * where -1 and BOARD_WIDTH/BOARD_HEIGHT are the frame
+ */
+void draw_block(const layout_t *l, int x, int y, uintattr_t color) {
+	if (!l->scale) return;
+	put_block(l, l->board_x + (x + 1) * l->cell_cols, l->board_y + (y + 1) * l->cell_rows, color);
+}
+
+// Prints `text` centered across the board, on the middle line of board row `row`
+void draw_board_text(const layout_t *l, int row, uintattr_t fg, uintattr_t bg, const char *text) {
+	if (!l->scale) return;
+	int x = l->board_x + (FRAME_COLS * l->scale - (int) strlen(text)) / 2;
+	int y = l->board_y + (row + 1) * l->cell_rows + (l->cell_rows - 1) / 2;
+	tb_print(x, y, fg, bg, text);
+}
+
+// The text over a topped out board
+void draw_game_over_text(const layout_t *l) {
+	draw_board_text(l, 7, TB_WHITE, TB_RED, "GAME");
+	draw_board_text(l, 8, TB_WHITE, TB_RED, "OVER");
+	draw_board_text(l, 10, TB_WHITE, TB_RED, ":(");
+}
+
+// Draws a board cell unless it already shows that color
+static void put_cell(renderer_t *r, int8_t x, int8_t y, uintattr_t color) {
+	if (r->shown[y][x] == color) return;
+	r->shown[y][x] = color;
+	draw_block(&r->layout, x, y, color);
+}
+
+/* Draws board row `y` in `colors`. Each run of cells that don't show their
+ * color yet is built in r->strip and set in one go, a screen row at a time;
+ * cells already right are left alone, even if something was drawn over them.
+ */
+static void put_row(renderer_t *r, int8_t y, const uintattr_t colors[BOARD_WIDTH]) {
+	const layout_t *l = &r->layout;
+	bool lean = lean_screen();
+	for (int8_t x = 0; x < BOARD_WIDTH; x++) {
+		if (r->shown[y][x] == colors[x]) continue;
+		int8_t first = x;
+		int n = 0;
+		for (; x < BOARD_WIDTH && r->shown[y][x] != colors[x]; x++) {
+			struct tb_cell cell = block_cell(colors[x], lean);
+			for (int i = 0; i < l->cell_cols; i++)
+				r->strip[n++] = cell;
+			r->shown[y][x] = colors[x];
+		}
+		put_strip(l, l->board_x + (first + 1) * l->cell_cols, l->board_y + (y + 1) * l->cell_rows, r->strip, n);
+	}
+}
+
+// The frame around the board, from one pre-built row of white blocks
+static void put_frame(renderer_t *r) {
+	const layout_t *l = &r->layout;
+	int n = (BOARD_WIDTH + 2) * l->cell_cols;
+	struct tb_cell cell = block_cell(TB_WHITE, lean_screen());
+	for (int i = 0; i < n; i++)
+		r->strip[i] = cell;
+	put_strip(l, l->board_x, l->board_y, r->strip, n); // top
+	put_strip(l, l->board_x, l->board_y + (BOARD_HEIGHT + 1) * l->cell_rows, r->strip, n); // bottom
+	for (int y = 0; y < BOARD_HEIGHT; y++) {
+		int screen_y = l->board_y + (y + 1) * l->cell_rows;
+		put_strip(l, l->board_x, screen_y, r->strip, l->cell_cols); // left
+		put_strip(l, l->board_x + (BOARD_WIDTH + 1) * l->cell_cols, screen_y, r->strip, l->cell_cols); // right
+	}
+}
+
+/* Which step of the line clear flash is showing right now (0 to FLASH_PHASES - 1),
+ * or -1 if no lines are flashing. The flash lasts exactly as long as the
+ * engine's line clear delay.
+ */
+int8_t flash_phase(const game_t *g) {
+	if (!game_clearing(g)) return -1;
+
+	uint32_t elapsed_ms = g->time_ms - (g->clear_until_ms - LINE_CLEAR_DELAY_MS);
+	return (int8_t) (elapsed_ms / FLASH_DELAY_MS);
+}
+
+/* Lays the renderer out for a width x height screen (see layout_compute()).
+ * Only a layout that moved something repaints everything on the next frame;
+ * if everything stays put, what's already drawn is still right. Returns
+ * whether the board fits.
+ */
+bool renderer_resize(renderer_t *r, int width, int height, int side_cols) {
+	return renderer_resize_at(r, 0, width, height, side_cols);
+}
+
+/* The same for the width x height area starting at column `left`, so several
+ * renderers can share a screen side by side. A full redraw then only clears
+ * that area.
+ */
+bool renderer_resize_at(renderer_t *r, int left, int width, int height, int side_cols) {
+	layout_t l;
+	bool fits = layout_compute(&l, width, height, side_cols);
+	l.left = left;
+	l.board_x += left;
+	l.panel_x += left;
+	l.side_x += left;
+	layout_t old = r->layout;
+	old.width = l.width;
+	old.height = l.height;
+	if (memcmp(&old, &l, sizeof(l)) != 0) r->full_redraw = true;
+	r->layout = l;
+	return fits;
+}
+
+// Forget what's on screen, e.g. after something else drew over the board
+void renderer_invalidate(renderer_t *r) {
+	r->full_redraw = true;
+}
+
+/* Brings the back buffer up to date with `g`. Only the rows the engine marked
+ * dirty and the cells the active piece (or its ghost) left or entered get
+ * redrawn, so moving the piece costs O(piece) instead of O(board). The ghost
+ * costs one game_drop_distance() a frame. The caller presents.
+ */
+void renderer_draw(renderer_t *r, game_t *g) {
+	const layout_t *l = &r->layout;
+	if (!l->scale) return; // nowhere to draw; full_redraw stays set for when there is
+
+	if (r->full_redraw) {
+		if (l->left == 0 && l->width == tb_width()) {
+			tb_clear();
+		} else {
+			for (int y = 0; y < l->height; y++)
+				for (int x = l->left; x < l->left + l->width; x++)
+					tb_set_cell(x, y, ' ', TB_DEFAULT, TB_DEFAULT);
+		}
+		put_frame(r);
+		if (l->panel) tb_print(l->panel_x, l->panel_y, TB_WHITE, TB_DEFAULT, "NEXT");
+		// tb_clear() left the board blank, which nothing we'd draw matches,
+		// so every cell below gets drawn again
+		memset(r->shown, 0xff, sizeof(r->shown));
+		memset(r->shown_preview, 0xff, sizeof(r->shown_preview));
+		r->piece_drawn = false;
+		r->full_redraw = false;
+		g->dirty_rows = ~0ULL;
+	}
+
+	// The next pieces only change when one is dealt
+	if (l->panel) {
+		for (uint8_t i = 0; i < PREVIEW_COUNT; i++) {
+			piece_type_t next = game_preview(g, i);
+			if (r->shown_preview[i] == (int8_t) next) continue;
+			r->shown_preview[i] = (int8_t) next;
+			draw_preview(l, i, next);
+		}
+	}
+
+	// While cleared lines are flashing, show those instead of the board and piece
+	int8_t phase = flash_phase(g);
+	if (phase >= 0) {
+		draw_flash(r, g, phase);
+		return;
+	}
+	if (r->flash_drawn) {
+		r->flash_drawn = false;
+		g->dirty_rows = ~0ULL;
+	}
+
+	// Where the active piece and its ghost cover each row. Blocks above the
+	// board (negative y) aren't drawn, and the piece is drawn over its ghost.
+	block_t blocks[4], ghost[4];
+	piece_t landed = g->active_piece;
+	landed.y += game_drop_distance(g, &landed);
+	piece_blocks(&g->active_piece, blocks);
+	piece_blocks(&landed, ghost);
+	uintattr_t piece_color = PIECE_COLORS[g->active_piece.type];
+	row_t piece_rows[BOARD_HEIGHT] = {0}, ghost_rows[BOARD_HEIGHT] = {0};
+	for (uint8_t i = 0; i < 4; i++) {
+		if (blocks[i].y >= 0) piece_rows[blocks[i].y] |= ROW_BIT(blocks[i].x);
+		if (ghost[i].y >= 0) ghost_rows[ghost[i].y] |= ROW_BIT(ghost[i].x);
+	}
+
+	// Rows that changed on the board
+	for (int8_t row = 0; row < BOARD_HEIGHT; row++) {
+		if (!(g->dirty_rows & (1ULL << row))) continue;
+		uintattr_t colors[BOARD_WIDTH];
+		for (int8_t col = 0; col < BOARD_WIDTH; col++) {
+			colors[col] = g->colors[row][col];
+			if (piece_rows[row] & ROW_BIT(col)) colors[col] = piece_color;
+			else if (ghost_rows[row] & ROW_BIT(col)) colors[col] = piece_color | GHOST_BLOCK;
+		}
+		put_row(r, row, colors);
+	}
+	g->dirty_rows = 0;
+
+	// Uncover where the piece and ghost were, then draw where they are
+	if (r->piece_drawn) {
+		for (uint8_t i = 0; i < 8; i++) {
+			block_t b = i < 4 ? r->piece_blocks[i] : r->ghost_blocks[i - 4];
+			if (b.y >= 0 && !((piece_rows[b.y] | ghost_rows[b.y]) & ROW_BIT(b.x)))
+				put_cell(r, b.x, b.y, g->colors[b.y][b.x]);
+		}
+	}
+	for (uint8_t i = 0; i < 4; i++) {
+		block_t b = ghost[i];
+		if (b.y >= 0 && !(piece_rows[b.y] & ROW_BIT(b.x))) put_cell(r, b.x, b.y, piece_color | GHOST_BLOCK);
+	}
+	for (uint8_t i = 0; i < 4; i++) {
+		block_t b = blocks[i];
+		if (b.y >= 0) put_cell(r, b.x, b.y, piece_color);
+	}
+	memcpy(r->piece_blocks, blocks, sizeof(r->piece_blocks));
+	memcpy(r->ghost_blocks, ghost, sizeof(r->ghost_blocks));
+	r->piece_drawn = true;
+}
+
+// Panel slot `slot`: a black box with `type` in it, as it will spawn
+static void draw_preview(const layout_t *l, uint8_t slot, piece_type_t type) {
+	int x = l->panel_x, y = l->panel_y + 1 + slot * (PANEL_CELLS_TALL + 1) * l->cell_rows;
+	for (int row = 0; row < PANEL_CELLS_TALL; row++)
+		for (int col = 0; col < PANEL_CELLS_WIDE; col++)
+			put_block(l, x + col * l->cell_cols, y + row * l->cell_rows, TB_BLACK);
+
+	block_t blocks[4];
+	piece_t p = piece_spawn(type);
+	piece_blocks(&p, blocks);
+	int8_t min_x = blocks[0].x, min_y = blocks[0].y;
+	for (uint8_t i = 1; i < 4; i++) {
+		if (blocks[i].x < min_x) min_x = blocks[i].x;
+		if (blocks[i].y < min_y) min_y = blocks[i].y;
+	}
+	for (uint8_t i = 0; i < 4; i++) {
+		put_block(l, x + (blocks[i].x - min_x) * l->cell_cols, y + (blocks[i].y - min_y) * l->cell_rows,
+		          PIECE_COLORS[type]);
+	}
+}
+
+/* Draws one step of the flash over the rows removed by the last line clear.
+ * The engine has already moved the board on, so the board as it was just
+ * before the clear is rebuilt from the saved rows: every row that survived
+ * sits lower now by the number of cleared rows below it.
+ * Even phases color the lines all white, odd ones show their board color.
+ */
+static void draw_flash(renderer_t *r, const game_t *g, int8_t phase) {
+	const line_clear_t *clear = &g->last_clear;
+
+	// Redraw the board as it looked with the full lines still in it
+	for (int8_t row = 0; row < BOARD_HEIGHT; row++) {
+		uint8_t cleared_below = 0;
+		for (uint8_t i = 0; i < clear->count; i++) {
+			if (clear->rows[i] > row) cleared_below++;
+		}
+		put_row(r, row, g->colors[row + cleared_below]);
+	}
+
+	for (uint8_t i = 0; i < clear->count; i++) {
+		uintattr_t colors[BOARD_WIDTH];
+		for (int8_t col = 0; col < BOARD_WIDTH; col++) {
+			colors[col] = (phase % 2 == 0) ? TB_WHITE : clear->colors[i][col];
+		}
+		put_row(r, clear->rows[i], colors);
+	}
+	r->piece_drawn = false;
+	r->flash_drawn = true;
+}
@@ -0,0 +1,170 @@
+/*********************************************************************
+ * File: replay.c                                                    *
+ * Description: records games as a seed plus their inputs, and plays *
+ *              them back through the headless engine                *
+ *********************************************************************/
+
+#include "include/replay.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEADER_SIZE (4 + 3 + 8)
+#define MAX_VARINT_SIZE 5 // a uint32_t, 7 bits at a time
+
+// Opens (truncating) `path` for recording. Returns false if it can't be created.
+bool replay_writer_open(replay_writer_t *w, const char *path) {
+	memset(w, 0, sizeof(*w));
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	return w->fd >= 0;
+}
+
+// Makes sure `n` more bytes fit in the buffer, writing it out if they don't
+static bool reserve(replay_writer_t *w, size_t n) {
+	if (w->failed) return false;
+	if (w->len + n > REPLAY_BUFFER_SIZE && !replay_flush(w)) return false;
+	return true;
+}
+
+static void put_varint(replay_writer_t *w, uint32_t v) {
+	while (v >= 0x80) {
+		w->buf[w->len++] = (uint8_t) (v | 0x80);
+		v >>= 7;
+	}
+	w->buf[w->len++] = (uint8_t) v;
+}
+
+static void put_event(replay_writer_t *w, uint32_t ms, uint8_t code) {
+	if (!reserve(w, MAX_VARINT_SIZE + 1)) return;
+	// Game time never runs backwards, but don't trust the caller with a wraparound
+	put_varint(w, ms >= w->last_ms ? ms - w->last_ms : 0);
+	w->buf[w->len++] = code;
+	if (ms > w->last_ms) w->last_ms = ms;
+}
+
+// Starts a new game in the file. Its events are timed from game time 0.
+void replay_begin_game(replay_writer_t *w, uint64_t seed) {
+	if (w->in_game) replay_end_game(w, w->last_ms);
+	if (!reserve(w, HEADER_SIZE)) return;
+
+	memcpy(&w->buf[w->len], REPLAY_MAGIC, 4);
+	w->len += 4;
+	w->buf[w->len++] = REPLAY_VERSION;
+	w->buf[w->len++] = BOARD_WIDTH;
+	w->buf[w->len++] = BOARD_HEIGHT;
+	for (uint8_t i = 0; i < 8; i++) {
+		w->buf[w->len++] = (uint8_t) (seed >> (8 * i));
+	}
+	w->last_ms = 0;
+	w->in_game = true;
+}
+
+// Logs an input applied at game time `ms`. Only touches memory unless the buffer is full.
+void replay_record(replay_writer_t *w, uint32_t ms, input_t in) {
+	if (w->in_game) put_event(w, ms, (uint8_t) in);
+}
+
+// Marks where the game stopped (game over or quit) and writes it all out
+void replay_end_game(replay_writer_t *w, uint32_t ms) {
+	if (!w->in_game) return;
+	put_event(w, ms, REPLAY_END);
+	w->in_game = false;
+	replay_flush(w);
+}
+
+// Writes out everything buffered so far. Once a write fails, recording stops for good.
+bool replay_flush(replay_writer_t *w) {
+	if (w->failed) return false;
+	size_t done = 0;
+	while (done < w->len) {
+		ssize_t n = write(w->fd, w->buf + done, w->len - done);
+		if (n < 0) {
+			w->failed = true;
+			return false;
+		}
+		done += n;
+	}
+	w->len = 0;
+	return true;
+}
+
+// Ends any game still being recorded, flushes and closes the file
+void replay_writer_close(replay_writer_t *w) {
+	if (w->fd < 0) return;
+	if (w->in_game) replay_end_game(w, w->last_ms);
+	replay_flush(w);
+	close(w->fd);
+	w->fd = -1;
+}
+
+// Reads all of `path` into memory. Returns false if it can't be read.
+bool replay_reader_open(replay_reader_t *r, const char *path) {
+	memset(r, 0, sizeof(*r));
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+
+	size_t cap = 0;
+	while (true) {
+		if (r->len == cap) {
+			cap = cap ? cap * 2 : REPLAY_BUFFER_SIZE;
+			uint8_t *grown = realloc(r->data, cap);
+			if (!grown) break;
+			r->data = grown;
+		}
+		size_t n = fread(r->data + r->len, 1, cap - r->len, f);
+		if (n == 0) break;
+		r->len += n;
+	}
+	bool ok = !ferror(f) && feof(f);
+	fclose(f);
+	if (!ok) replay_reader_close(r);
+	return ok;
+}
+
+static bool get_varint(replay_reader_t *r, uint32_t *v) {
+	*v = 0;
+	for (uint8_t shift = 0; shift < 7 * MAX_VARINT_SIZE; shift += 7) {
+		if (r->pos >= r->len) return false;
+		uint8_t byte = r->data[r->pos++];
+		*v |= (uint32_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+/* Plays the next game in the file through a fresh `g`, as fast as the engine
+ * can go. On REPLAY_OK, `g` is left as the game was when it ended.
+ */
+replay_status_t replay_play_game(replay_reader_t *r, game_t *g) {
+	if (r->pos == r->len) return REPLAY_EOF;
+	if (r->len - r->pos < HEADER_SIZE) return REPLAY_BAD;
+
+	const uint8_t *h = &r->data[r->pos];
+	if (memcmp(h, REPLAY_MAGIC, 4) != 0 || h[4] < REPLAY_OLDEST_VERSION || h[4] > REPLAY_VERSION) return REPLAY_BAD;
+	if (h[5] != BOARD_WIDTH || h[6] != BOARD_HEIGHT) return REPLAY_BAD;
+	uint64_t seed = 0;
+	for (uint8_t i = 0; i < 8; i++) {
+		seed |= (uint64_t) h[7 + i] << (8 * i);
+	}
+	r->pos += HEADER_SIZE;
+
+	game_init(g, seed);
+	uint32_t ms = 0, delta;
+	while (get_varint(r, &delta) && r->pos < r->len) {
+		uint8_t code = r->data[r->pos++];
+		ms += delta;
+		// Same calls, same game times as the front end made them
+		game_update(g, ms);
+		if (code == REPLAY_END) return REPLAY_OK;
+		if (code >= INPUT_COUNT) return REPLAY_BAD;
+		game_apply_input(g, (input_t) code);
+	}
+	return REPLAY_BAD;
+}
+
+void replay_reader_close(replay_reader_t *r) {
+	free(r->data);
+	memset(r, 0, sizeof(*r));
+}
@@ -0,0 +1,533 @@
+/*********************************************************************
+ * File: server.c                                                    *
+ * Description: hosts many games over TCP from one process. An epoll *
+ *              reactor owns the sockets; a worker pool runs games   *
+ *********************************************************************/
+
+#define _GNU_SOURCE // accept4()
+#include "include/server.h"
+#include "include/broadcast.h"
+#include "include/metrics.h"
+#include "include/pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EPOLL_EVENTS 64
+#define LONE_ESC_TICKS 2 // an ESC nothing followed for this long was the ESC key
+
+// Players get this after the switch to the alternate screen, which their
+// termbox context has already queued; spectators get it first
+const char TELNET_GREETING[6] = {
+	(char)TELNET_IAC, (char)TELNET_WILL, TELNET_OPT_ECHO,
+	(char)TELNET_IAC, (char)TELNET_WILL, TELNET_OPT_SGA
+};
+static const char FAREWELL[] = "\033[0m\033[2J\033[?25h\033[?1l\033>\033[?1049lThanks for playing!\r\n";
+
+typedef enum {
+	KEY_NONE,
+	KEY_LEFT,
+	KEY_RIGHT,
+	KEY_DOWN,
+	KEY_UP,
+	KEY_SPACE,
+	KEY_ENTER,
+	KEY_PAUSE,
+	KEY_QUIT
+} client_key_t;
+
+// A run of sessions for one pool task to tick
+typedef struct {
+	session_t **sessions;
+	size_t count;
+	uint32_t dt_ms;
+} tick_task_t;
+
+static int epoll_fd = -1, listen_fd = -1, tick_fd = -1; // &listen_fd and &tick_fd tag their epoll events
+static session_t **sessions = NULL;
+static size_t n_sessions = 0, sessions_cap = 0;
+static uint64_t next_seed;
+static uint64_t next_session_id = 0;
+static bool lean_output; // sessions present with TB_PRESENT_LEAN
+static broadcast_t broadcast; // --spectate, if broadcasting
+static bool broadcasting = false;
+static session_t *featured = NULL; // the session spectators are watching
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_handler(int sig) {
+	(void)sig; // Surpress unused parameter warning
+	stopping = 1;
+}
+
+// Output ////////////
+
+// Bytes the client hasn't been sent yet
+static size_t out_pending(session_t *s) {
+	size_t len;
+	tb_ctx_output(s->tb, &len);
+	return len;
+}
+
+// Throws away unsent output, once nobody is left to read it
+static void out_drop(session_t *s) {
+	tb_ctx_consume(s->tb, out_pending(s));
+}
+
+/* Writes as much pending output as the socket takes without blocking
+ * returns false if the client is gone
+ */
+static bool session_flush(session_t *s) {
+	size_t len, done = 0;
+	const char *out = tb_ctx_output(s->tb, &len);
+	while (done < len) {
+		ssize_t n = send(s->fd, out + done, len - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			out_drop(s);
+			return false;
+		}
+		done += n;
+	}
+	tb_ctx_consume(s->tb, done);
+	return true;
+}
+
+// Sessions ///////////
+
+static void session_new_game(session_t *s) {
+	game_init(&s->game, next_seed++);
+	renderer_invalidate(&s->renderer);
+	s->clock_ms = 0;
+	s->state = SESSION_PLAY;
+}
+
+static session_t *session_create(int fd) {
+	session_t *s = calloc(1, sizeof(session_t));
+	if (!s) return NULL;
+	s->tb = tb_ctx_new(SESSION_COLS, SESSION_ROWS);
+	if (!s->tb) {
+		free(s);
+		return NULL;
+	}
+	if (lean_output) tb_ctx_set_present_mode(s->tb, TB_PRESENT_LEAN);
+	renderer_resize(&s->renderer, SESSION_COLS, SESSION_ROWS, 0);
+	s->fd = fd;
+	s->id = next_session_id++;
+	session_new_game(s);
+	tb_ctx_send(s->tb, TELNET_GREETING, sizeof(TELNET_GREETING));
+	metrics_add(METRIC_SESSIONS, 1);
+	return s;
+}
+
+static void session_destroy(session_t *s) {
+	if (s == featured) featured = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+	close(s->fd);
+	tb_ctx_free(s->tb);
+	free(s);
+	metrics_add(METRIC_SESSIONS, -1);
+}
+
+/* Steps the telnet filter on one byte from a client, and says whether it is
+ * data (rather than part of a command). A command cut off by the end of one
+ * read carries on in `parse` with the next.
+ */
+bool telnet_filter(parse_state_t *parse, uint8_t c) {
+	switch (*parse) {
+		case PARSE_DATA:
+			if (c == TELNET_IAC) *parse = PARSE_IAC;
+			else return true;
+			break;
+		case PARSE_IAC:
+			if (c == TELNET_SB) *parse = PARSE_SB;
+			else if (c >= TELNET_WILL && c <= TELNET_DONT) *parse = PARSE_OPTION;
+			else *parse = PARSE_DATA; // IAC IAC is a literal 255, which is no key of ours
+			break;
+		case PARSE_OPTION:
+			*parse = PARSE_DATA; // we asked for what we want up front; answers aren't checked
+			break;
+		case PARSE_SB:
+			if (c == TELNET_IAC) *parse = PARSE_SB_IAC;
+			break;
+		case PARSE_SB_IAC:
+			*parse = (c == TELNET_SE) ? PARSE_DATA : PARSE_SB;
+			break;
+	}
+	return false;
+}
+
+/* Hands the bytes read since the last tick to the session's termbox context,
+ * minus telnet negotiation. Commands cut off by the end of the input carry
+ * over to the next tick in s->parse. An ESC at the very end is held back for
+ * LONE_ESC_TICKS in case the rest of an arrow key is still on its way; after
+ * that it goes through alone, which termbox reads as the ESC key.
+ */
+static void feed_input(session_t *s) {
+	char data[SESSION_INPUT_SIZE + 1];
+	uint8_t n = 0;
+	bool releasing = false;
+	if (s->esc_held) {
+		if (s->in_len == 0 && ++s->esc_ticks < LONE_ESC_TICKS) return;
+		data[n++] = '\033';
+		s->esc_held = false;
+		releasing = (s->in_len == 0);
+	}
+
+	for (uint8_t i = 0; i < s->in_len; i++) {
+		if (telnet_filter(&s->parse, s->in[i])) data[n++] = (char)s->in[i];
+	}
+	s->in_len = 0;
+
+	if (!releasing && n > 0 && data[n - 1] == '\033') {
+		n--;
+		s->esc_held = true;
+		s->esc_ticks = 0;
+	}
+	if (n > 0 && tb_ctx_feed(s->tb, data, n) != TB_OK) s->closing = true;
+}
+
+// What a key event from the client means to its session
+static client_key_t event_key(const struct tb_event *ev) {
+	if (ev->type != TB_EVENT_KEY) return KEY_NONE;
+	switch (ev->key) {
+		case TB_KEY_ARROW_LEFT: return KEY_LEFT;
+		case TB_KEY_ARROW_RIGHT: return KEY_RIGHT;
+		case TB_KEY_ARROW_DOWN: return KEY_DOWN;
+		case TB_KEY_ARROW_UP: return KEY_UP;
+		case TB_KEY_ENTER: return KEY_ENTER; // telnet sends CR NUL or CR LF; the rest is ignored
+		case TB_KEY_ESC:
+		case TB_KEY_CTRL_C:
+		case TB_KEY_CTRL_D:
+			return KEY_QUIT;
+	}
+	switch (ev->ch) {
+		case ' ': return KEY_SPACE;
+		case 'p': case 'P': return KEY_PAUSE;
+		case 'q': case 'Q': return KEY_QUIT;
+	}
+	return KEY_NONE;
+}
+
+static void session_key(session_t *s, client_key_t key) {
+	static const input_t INPUTS[] = {
+		[KEY_LEFT] = INPUT_LEFT, [KEY_RIGHT] = INPUT_RIGHT, [KEY_DOWN] = INPUT_SOFT_DROP,
+		[KEY_UP] = INPUT_ROTATE, [KEY_SPACE] = INPUT_HARD_DROP
+	};
+
+	if (key == KEY_QUIT) {
+		tb_ctx_send(s->tb, FAREWELL, sizeof(FAREWELL) - 1);
+		s->closing = true;
+		return;
+	}
+	switch (s->state) {
+		case SESSION_PLAY:
+			if (key == KEY_PAUSE) s->state = SESSION_PAUSE;
+			else if (key >= KEY_LEFT && key <= KEY_SPACE) {
+				game_update(&s->game, s->clock_ms);
+				game_apply_input(&s->game, INPUTS[key]);
+			}
+			break;
+		case SESSION_PAUSE:
+			if (key == KEY_PAUSE) s->state = SESSION_PLAY;
+			break;
+		case SESSION_OVER:
+			if (key == KEY_ENTER) session_new_game(s);
+			break;
+	}
+}
+
+/* One frame of one session: its keys, then gravity, then whatever changed
+ * on screen goes out to the client
+ */
+static void session_tick(session_t *s, uint32_t dt_ms) {
+	struct tb_event ev;
+	double in_ms = s->in_len ? s->in_ms : -1;
+	feed_input(s);
+	while (!s->closing && tb_ctx_peek_event(s->tb, &ev, 0) == TB_OK) {
+		session_key(s, event_key(&ev));
+	}
+	if (s->closing) return;
+
+	if (s->state == SESSION_PLAY) {
+		s->clock_ms += dt_ms;
+		game_update(&s->game, s->clock_ms);
+	}
+	if (s->game.events & GAME_EVENT_OVER) s->state = SESSION_OVER;
+	s->game.events = 0;
+
+	// A client that isn't keeping up gets no new frames until it drains. The
+	// renderer only tracks what it has drawn, so it catches up in one go later.
+	if (out_pending(s) > SESSION_OUTPUT_MAX) return;
+
+	// The same drawing as the local game, onto this session's own context. The
+	// game over text goes on every frame it's over (as in broadcast.c), so one
+	// held back above doesn't lose it.
+	tb_ctx_select(s->tb);
+	renderer_draw(&s->renderer, &s->game);
+	if (s->state == SESSION_OVER) draw_game_over_text(&s->renderer.layout);
+	bool presented = tb_present() == TB_OK;
+	metrics_add(METRIC_SESSION_TICKS, 1);
+	if (presented && tb_present_bytes() > 0) {
+		metrics_add(METRIC_PRESENTS, 1);
+		metrics_add(METRIC_PRESENT_BYTES, tb_present_bytes());
+	}
+	tb_ctx_select(NULL);
+	if (!presented || !session_flush(s)) s->closing = true;
+	else if (in_ms >= 0) metrics_latency((monotonic_ms() - in_ms) * 1000);
+}
+
+static void tick_task(void *arg) {
+	tick_task_t *task = arg;
+	for (size_t i = 0; i < task->count; i++) {
+		session_tick(task->sessions[i], task->dt_ms);
+	}
+}
+
+// Reactor ////////////
+
+static void set_interest(session_t *s, bool writable) {
+	if (s->want_writable == writable) return;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0), .data.ptr = s };
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+	s->want_writable = writable;
+}
+
+static void accept_clients() {
+	while (true) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) return; // EAGAIN once the backlog is empty (or out of fds; try next time)
+
+		if (n_sessions == sessions_cap) {
+			size_t cap = sessions_cap ? sessions_cap * 2 : 64;
+			session_t **grown = realloc(sessions, cap * sizeof(session_t *));
+			if (!grown) {
+				close(fd);
+				continue;
+			}
+			sessions = grown;
+			sessions_cap = cap;
+		}
+		session_t *s = session_create(fd);
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = s };
+		if (!s || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			if (s) session_destroy(s);
+			else close(fd);
+			continue;
+		}
+		sessions[n_sessions++] = s;
+	}
+}
+
+// Collects what the client sent for the next tick. Anything past a full
+// input buffer is dropped: nobody types that fast.
+static void read_client(session_t *s) {
+	uint8_t scratch[256];
+	while (true) {
+		size_t room = SESSION_INPUT_SIZE - s->in_len;
+		uint8_t *dest = room ? s->in + s->in_len : scratch;
+		ssize_t n = recv(s->fd, dest, room ? room : sizeof(scratch), MSG_DONTWAIT);
+		if (n > 0) {
+			if (room && s->in_len == 0) s->in_ms = monotonic_ms();
+			if (room) s->in_len += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			s->closing = true;
+			out_drop(s); // nobody left to write to
+		}
+		return;
+	}
+}
+
+// Ticks every session on the pool, then tidies up after them
+static void tick_all(pool_t *pool, uint32_t dt_ms) {
+	static tick_task_t *tasks = NULL;
+	static size_t tasks_cap = 0;
+	size_t n_tasks = (n_sessions + SESSIONS_PER_TASK - 1) / SESSIONS_PER_TASK;
+	if (n_tasks > tasks_cap) {
+		tick_task_t *grown = realloc(tasks, n_tasks * sizeof(tick_task_t));
+		if (!grown) return; // try again next tick
+		tasks = grown;
+		tasks_cap = n_tasks;
+	}
+
+	// Sessions are only ever touched by one task at a time, and the reactor
+	// waits for all of them, so nothing here needs a lock
+	for (size_t i = 0; i < n_tasks; i++) {
+		size_t first = i * SESSIONS_PER_TASK;
+		tasks[i] = (tick_task_t) {
+			.sessions = &sessions[first],
+			.count = (n_sessions - first < SESSIONS_PER_TASK) ? n_sessions - first : SESSIONS_PER_TASK,
+			.dt_ms = dt_ms
+		};
+		pool_submit(pool, tick_task, &tasks[i]);
+	}
+	pool_wait(pool);
+	metrics_add(METRIC_TICKS, 1);
+
+	for (size_t i = 0; i < n_sessions; i++) {
+		session_t *s = sessions[i];
+		if (s->closing) session_flush(s); // last words, if the socket takes them
+		if (s->closing && (out_pending(s) == 0 || !session_flush(s))) {
+			session_destroy(s);
+			sessions[i--] = sessions[--n_sessions];
+			continue;
+		}
+		set_interest(s, out_pending(s) > 0);
+	}
+}
+
+/* Spectators watch one player until they leave, then whoever has been
+ * connected the longest of those left
+ */
+static void broadcast_featured() {
+	if (!featured && n_sessions > 0) {
+		featured = sessions[0];
+		for (size_t i = 1; i < n_sessions; i++) {
+			if (sessions[i]->id < featured->id) featured = sessions[i];
+		}
+	}
+	broadcast_tick(&broadcast, featured ? &featured->game : NULL);
+}
+
+int open_listener(const char *port) {
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+	struct addrinfo *res, *ai;
+	int err = getaddrinfo(NULL, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "port %s: %s\n", port, gai_strerror(err));
+		return -1;
+	}
+
+	// Prefer a dual-stack IPv6 socket (listed first on most systems), else take what binds
+	int fd = -1;
+	for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) continue;
+		int on = 1, off = 0;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (ai->ai_family == AF_INET6) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0) perror("Couldn't listen");
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* --serve: accepts players on `port` until SIGINT/SIGTERM. Each is a session
+ * with its own game; `n_workers` threads tick them all SERVER_TICK_HZ times
+ * a second. Seeds count up from `seed`, one per game. `lean` presents every
+ * session with as few bytes as possible (see TB_PRESENT_LEAN). Spectators
+ * that connect to `spectate_port` (if not NULL) watch one of the games.
+ */
+int run_server(const char *port, const char *spectate_port, unsigned n_workers, uint64_t seed, bool lean) {
+	next_seed = seed;
+	lean_output = lean;
+	listen_fd = open_listener(port);
+	if (listen_fd < 0) return EXIT_FAILURE;
+	if (spectate_port) {
+		int fd = open_listener(spectate_port);
+		if (fd < 0) return EXIT_FAILURE;
+		if (!broadcast_init(&broadcast, fd, lean)) {
+			perror("Couldn't start the broadcast");
+			return EXIT_FAILURE;
+		}
+		broadcasting = true;
+	}
+
+	pool_t pool;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (epoll_fd < 0 || tick_fd < 0 || !pool_init(&pool, n_workers)) {
+		perror("Couldn't start the server");
+		return EXIT_FAILURE;
+	}
+	struct itimerspec every_tick = {
+		.it_interval.tv_nsec = 1000000000L / SERVER_TICK_HZ,
+		.it_value.tv_nsec = 1000000000L / SERVER_TICK_HZ
+	};
+	timerfd_settime(tick_fd, 0, &every_tick, NULL);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_fd };
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &tick_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tick_fd, &ev);
+	if (broadcasting) {
+		ev.data.ptr = &broadcast;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, broadcast.epoll_fd, &ev);
+	}
+
+	struct sigaction sa = { .sa_handler = stop_handler }; // no SA_RESTART: epoll_wait() returns
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	fprintf(stderr, "Serving on port %s with %u worker thread(s)\n", port, pool.n_workers);
+
+	double last_tick_ms = monotonic_ms();
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	while (!stopping) {
+		int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		bool tick_due = false;
+		for (int i = 0; i < n; i++) {
+			void *tag = events[i].data.ptr;
+			if (tag == &listen_fd) {
+				accept_clients();
+			}
+			else if (tag == &tick_fd) {
+				uint64_t expirations;
+				tick_due = read(tick_fd, &expirations, sizeof(expirations)) > 0;
+			}
+			else if (tag == &broadcast) {
+				broadcast_poll(&broadcast);
+			}
+			else {
+				session_t *s = tag;
+				if (events[i].events & EPOLLIN) read_client(s);
+				if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+					s->closing = true;
+					out_drop(s);
+				}
+				else if (events[i].events & EPOLLOUT) {
+					if (!session_flush(s)) s->closing = true;
+				}
+			}
+		}
+
+		// Last, since it can free sessions that later events in this batch point to
+		if (tick_due) {
+			// Game time follows the clock, not the tick count, so a late tick catches up
+			uint32_t dt_ms = (uint32_t) (monotonic_ms() - last_tick_ms);
+			last_tick_ms += dt_ms;
+			tick_all(&pool, dt_ms);
+			if (broadcasting) broadcast_featured();
+		}
+	}
+
+	// Say goodbye to everyone still here
+	for (size_t i = 0; i < n_sessions; i++) {
+		session_t *s = sessions[i];
+		tb_ctx_send(s->tb, FAREWELL, sizeof(FAREWELL) - 1);
+		session_flush(s);
+		session_destroy(s);
+	}
+	free(sessions);
+	if (broadcasting) broadcast_destroy(&broadcast);
+	pool_destroy(&pool);
+	close(tick_fd);
+	close(listen_fd);
+	close(epoll_fd);
+	fprintf(stderr, "Server stopped\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*********************************************************************
+ * File: simulate.c                                                  *
+ * Description: plays batches of headless bot games over every core  *
+ *              and writes one CSV row per game                      *
+ *********************************************************************/
+
+#include "include/simulate.h"
+#include "include/bot.h"
+#include "include/metrics.h"
+#include "include/pool.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CSV_HEADER "game,seed,over,pieces,lines,score,game_ms,wall_us,I,L,J,O,S,Z,T\n"
+#define MAX_ROW_SIZE 256
+
+// Points for clearing 1 to 4 lines at once
+static const uint32_t LINE_SCORES[5] = {0, 100, 300, 500, 800};
+
+typedef struct simulation simulation_t;
+
+/* One thread's share: its own bot (whose arenas and transposition table
+ * are then never shared), totals and output buffer. Nothing in here is
+ * touched by another thread until the batch is done.
+ */
+typedef struct {
+	simulation_t *sim;
+	bot_t bot;
+	simulate_totals_t totals;
+	size_t len;
+	char buf[SIMULATE_BUFFER_SIZE];
+} sim_worker_t;
+
+struct simulation {
+	uint64_t n_games, seed;
+	int out_fd;
+	pthread_mutex_t out_lock; // rows go out a whole buffer at a time, in whatever order they're done
+	_Atomic uint64_t next_game; // games are handed out one at a time, so no thread waits on a long one
+	_Atomic bool write_failed;
+};
+
+static bool write_all(int fd, const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n <= 0) return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void flush_rows(sim_worker_t *w) {
+	if (w->len == 0) return;
+	simulation_t *sim = w->sim;
+	metrics_lock(&sim->out_lock);
+	if (!write_all(sim->out_fd, w->buf, w->len)) atomic_store(&sim->write_failed, true);
+	pthread_mutex_unlock(&sim->out_lock);
+	w->len = 0;
+}
+
+// Game `index` of the batch, seeded seed + index however the games are split
+static void play_game(sim_worker_t *w, uint64_t index) {
+	uint64_t seed = w->sim->seed + index;
+	double start_ms = monotonic_ms();
+	game_t g;
+	game_init(&g, seed);
+	w->bot.planned = false;
+
+	uint32_t dealt[PIECE_COUNT] = {0};
+	dealt[g.active_piece.type]++;
+	uint64_t score = 0;
+	uint32_t placed = 0;
+	while (!g.over && g.pieces_placed < SIMULATE_MAX_PIECES) {
+		int in = bot_next_input(&w->bot, &g);
+		if (in >= 0) game_apply_input(&g, (input_t) in);
+		game_update(&g, g.time_ms + SIMULATE_INPUT_MS);
+		if (g.events & GAME_EVENT_LINES) score += LINE_SCORES[g.last_clear.count];
+		if (g.pieces_placed != placed && !g.over) dealt[g.active_piece.type]++;
+		placed = g.pieces_placed;
+		g.events = 0;
+	}
+
+	if (w->len + MAX_ROW_SIZE > SIMULATE_BUFFER_SIZE) flush_rows(w);
+	w->len += snprintf(w->buf + w->len, MAX_ROW_SIZE,
+	                   "%llu,%llu,%d,%u,%u,%llu,%u,%.0f,%u,%u,%u,%u,%u,%u,%u\n",
+	                   (unsigned long long) index, (unsigned long long) seed, g.over, g.pieces_placed,
+	                   g.lines_cleared, (unsigned long long) score, g.time_ms, (monotonic_ms() - start_ms) * 1000,
+	                   dealt[PIECE_I], dealt[PIECE_L], dealt[PIECE_J], dealt[PIECE_O], dealt[PIECE_S],
+	                   dealt[PIECE_Z], dealt[PIECE_T]);
+	w->totals.games++;
+	w->totals.over += g.over;
+	w->totals.pieces += g.pieces_placed;
+	w->totals.lines += g.lines_cleared;
+}
+
+// A pool task: play games until the batch has none left
+static void worker_task(void *arg) {
+	sim_worker_t *w = arg;
+	simulation_t *sim = w->sim;
+	uint64_t index;
+	while ((index = atomic_fetch_add_explicit(&sim->next_game, 1, memory_order_relaxed)) < sim->n_games) {
+		if (atomic_load_explicit(&sim->write_failed, memory_order_relaxed)) break;
+		play_game(w, index);
+	}
+	flush_rows(w);
+}
+
+/* Plays `n_games` bot games (searching `depth` pieces) on `n_threads`
+ * threads and writes a CSV header plus one row per game to `out_fd`. Game i
+ * is seeded seed + i, so its row doesn't depend on the thread count; rows
+ * come out in the order games finish.
+ * returns false if the threads couldn't be started
+ */
+bool simulate_games(uint64_t n_games, uint64_t seed, unsigned n_threads, uint8_t depth, int out_fd,
+                    simulate_totals_t *totals) {
+	memset(totals, 0, sizeof(*totals));
+	simulation_t sim = {.n_games = n_games, .seed = seed, .out_fd = out_fd};
+	pthread_mutex_init(&sim.out_lock, NULL);
+	atomic_init(&sim.next_game, 0);
+	atomic_init(&sim.write_failed, !write_all(out_fd, CSV_HEADER, strlen(CSV_HEADER)));
+
+	pool_t pool;
+	sim_worker_t *workers = calloc(n_threads, sizeof(sim_worker_t));
+	if (!workers || !pool_init(&pool, n_threads)) {
+		free(workers);
+		pthread_mutex_destroy(&sim.out_lock);
+		return false;
+	}
+	unsigned started = 0;
+	double start_ms = monotonic_ms();
+	for (; started < n_threads; started++) {
+		workers[started].sim = &sim;
+		if (!bot_init(&workers[started].bot, depth, NULL)) break; // each searches on its own thread
+		pool_submit(&pool, worker_task, &workers[started]);
+	}
+	pool_wait(&pool);
+	totals->wall_ms = monotonic_ms() - start_ms;
+	pool_destroy(&pool);
+
+	for (unsigned i = 0; i < started; i++) {
+		totals->games += workers[i].totals.games;
+		totals->over += workers[i].totals.over;
+		totals->pieces += workers[i].totals.pieces;
+		totals->lines += workers[i].totals.lines;
+		bot_destroy(&workers[i].bot);
+	}
+	totals->write_failed = atomic_load(&sim.write_failed);
+	free(workers);
+	pthread_mutex_destroy(&sim.out_lock);
+	return started > 0;
+}
@@ -0,0 +1,127 @@
+/*********************************************************************
+ * File: snapshot.c                                                  *
+ * Description: a ring of whole-game snapshots for undo, kept in a   *
+ *              memory-mapped file so a killed game can resume       *
+ *********************************************************************/
+
+#include "include/snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool header_matches(const snapshot_file_t *f) {
+	return f->version == SNAPSHOT_VERSION && f->board_width == BOARD_WIDTH
+	       && f->board_height == BOARD_HEIGHT && f->game_size == sizeof(game_t);
+}
+
+static const game_t *slot(const snapshot_ring_t *r, uint64_t i) {
+	return &r->file->slots[i % SNAPSHOT_SLOTS];
+}
+
+// The oldest snapshot that can be trusted, see snapshot_file_t
+static uint64_t oldest(uint64_t taken) {
+	return taken > SNAPSHOT_SLOTS - 1 ? taken - (SNAPSHOT_SLOTS - 1) : 0;
+}
+
+/* Maps the ring over `path` (created if need be), or over anonymous memory
+ * if `path` is NULL. A file from another build is started over; one that
+ * isn't a snapshot file at all is left alone, and this fails with EINVAL.
+ */
+bool snapshot_open(snapshot_ring_t *r, const char *path) {
+	r->fd = -1;
+	r->file = MAP_FAILED;
+	if (path) {
+		r->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (r->fd < 0) return false;
+		struct stat st;
+		char magic[4] = {0};
+		if (fstat(r->fd, &st) < 0) goto fail;
+		if (st.st_size > 0 && (pread(r->fd, magic, 4, 0) != 4 || memcmp(magic, SNAPSHOT_MAGIC, 4))) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if ((size_t) st.st_size != sizeof(snapshot_file_t) && ftruncate(r->fd, sizeof(snapshot_file_t)) < 0) goto fail;
+		r->file = mmap(NULL, sizeof(snapshot_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	} else {
+		r->file = mmap(NULL, sizeof(snapshot_file_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (r->file == MAP_FAILED) goto fail;
+
+	if (memcmp(r->file->magic, SNAPSHOT_MAGIC, 4) || !header_matches(r->file)) {
+		atomic_store(&r->file->taken, 0);
+		memcpy(r->file->magic, SNAPSHOT_MAGIC, 4);
+		r->file->version = SNAPSHOT_VERSION;
+		r->file->board_width = BOARD_WIDTH;
+		r->file->board_height = BOARD_HEIGHT;
+		r->file->game_size = sizeof(game_t);
+	}
+	return true;
+
+fail:
+	if (r->fd >= 0) close(r->fd);
+	r->fd = -1;
+	r->file = NULL;
+	return false;
+}
+
+// Unmapping doesn't wait on the disk: the kernel writes the pages back in its own time
+void snapshot_close(snapshot_ring_t *r) {
+	if (r->file) munmap(r->file, sizeof(snapshot_file_t));
+	if (r->fd >= 0) close(r->fd);
+	r->file = NULL;
+	r->fd = -1;
+}
+
+// Forgets every snapshot (a new game began), so undo never goes back past its start
+void snapshot_reset(snapshot_ring_t *r) {
+	atomic_store_explicit(&r->file->taken, 0, memory_order_release);
+}
+
+// One memcpy into the next slot, then the count that makes it part of the ring
+void snapshot_take(snapshot_ring_t *r, const game_t *g) {
+	uint64_t taken = atomic_load_explicit(&r->file->taken, memory_order_relaxed);
+	memcpy(&r->file->slots[taken % SNAPSHOT_SLOTS], g, sizeof(*g));
+	atomic_store_explicit(&r->file->taken, taken + 1, memory_order_release);
+}
+
+/* Whether `g` should be snapshotted now: SNAPSHOT_EVERY_MS after the newest
+ * snapshot, or as soon as a piece has settled, so undo lands exactly on the
+ * spawn of a piece
+ */
+bool snapshot_due(const snapshot_ring_t *r, const game_t *g) {
+	uint64_t taken = atomic_load_explicit(&r->file->taken, memory_order_relaxed);
+	if (taken == 0) return true;
+	const game_t *newest = slot(r, taken - 1);
+	return g->pieces_placed != newest->pieces_placed || g->time_ms >= newest->time_ms + SNAPSHOT_EVERY_MS;
+}
+
+// Copies the newest snapshot to `out`. Returns false if there's none.
+bool snapshot_latest(const snapshot_ring_t *r, game_t *out) {
+	uint64_t taken = atomic_load_explicit(&r->file->taken, memory_order_acquire);
+	if (taken == 0) return false;
+	*out = *slot(r, taken - 1);
+	return true;
+}
+
+/* Undo: copies to `out` the game as it was when the piece before the one
+ * `g` last placed had just settled, i.e. just as the piece `g` last placed
+ * spawned (or the oldest snapshot left, if the ring doesn't reach back that
+ * far). Everything newer is dropped, so undoing again goes back one more
+ * piece. Returns false if there's nothing to go back to.
+ */
+bool snapshot_rewind(snapshot_ring_t *r, const game_t *g, game_t *out) {
+	uint64_t taken = atomic_load_explicit(&r->file->taken, memory_order_relaxed);
+	if (taken == 0) return false;
+	uint32_t target = g->pieces_placed ? g->pieces_placed - 1 : 0;
+	uint64_t best = taken - 1;
+	for (uint64_t i = taken; i-- > oldest(taken);) {
+		if (slot(r, i)->pieces_placed < target) break;
+		best = i;
+	}
+	*out = *slot(r, best);
+	atomic_store_explicit(&r->file->taken, best + 1, memory_order_release);
+	return true;
+}
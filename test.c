@@ -0,0 +1,896 @@
+/*********************************************************************
+ * File: test.c                                                      *
+ * Description: behaviour tests for the engine and the modules that  *
+ *              drive it, one result a line                          *
+ *********************************************************************/
+
+#define TB_IMPL
+
+#include "include/termbox.h"
+#include "include/engine.h"
+#include "include/replay.h"
+#include "include/versus.h"
+#include "include/crafted.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define TEST_BOARDS 256 // crafted boards the property tests go through
+#define TEST_FRAME_MS 16 // game time between the scripted player's inputs
+#define TEST_MAX_PIECES 300 // the scripted game stops here if it hasn't topped out
+#define TEST_VERSUS_FRAMES 240 // frames each player plays in test_rollback
+#define TEST_PEER_QUEUE 8 // packets test_rollback's peer can have on their way at once
+#define TEST_TERM_COLS 80 // size of the screen test_lean_present draws on
+#define TEST_TERM_ROWS 24
+#define TEST_PRESENTS 200 // frames of random changes it presents
+
+// What the scripted game in test_replay comes to. Pinned for the standard
+// board: if a change to the engine moves these, it changed how games play.
+#define GOLDEN_SEED 2024
+#if BOARD_WIDTH == 10 && BOARD_HEIGHT == 20
+	#define GOLDEN_PIECES 70
+	#define GOLDEN_LINES 16
+	#define GOLDEN_TIME_MS 11008
+#endif
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+} test_t;
+
+static const char *current; // the test running
+static int failures; // checks failed in it
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+#define CHECK_EQ(a, b) check_eq((long long) (a), (long long) (b), #a " == " #b, __LINE__)
+
+static void check(bool ok, const char *what, int line) {
+	if (ok) return;
+	printf("test=%s FAIL line %d: %s\n", current, line, what);
+	failures++;
+}
+
+static void check_eq(long long a, long long b, const char *what, int line) {
+	if (a == b) return;
+	printf("test=%s FAIL line %d: %s (%lld vs %lld)\n", current, line, what, a, b);
+	failures++;
+}
+
+// Helpers ////////////
+
+// A piece of `type` turned to `rotation`, with the top-left of its box at x,y
+static piece_t piece_at(piece_type_t type, uint8_t rotation, int8_t x, int8_t y) {
+	return (piece_t) { .type = type, .rotation = rotation, .x = x, .y = y };
+}
+
+
+// A game seeded 1 on an empty board but for `filled` (bit x of row y), whose active piece is `p`
+static void game_with(game_t *g, const bitboard_t *filled, piece_t p) {
+	craft_game(g, 1, filled);
+	g->active_piece = p;
+	g->events = 0;
+}
+
+// Holes under each column's top plus the height of the stack, for the scripted player
+static int board_cost(const bitboard_t *bb) {
+	int cost = 0;
+	for (int8_t x = 0; x < BOARD_WIDTH; x++) {
+		int8_t y = 0;
+		while (y < BOARD_HEIGHT && !(bb->rows[y] & ROW_BIT(x))) y++;
+		cost += BOARD_HEIGHT - y;
+		for (; y < BOARD_HEIGHT; y++) cost += (bb->rows[y] & ROW_BIT(x)) ? 0 : 8;
+	}
+	return cost;
+}
+
+/* Where a simple player would put the active piece: every rotation and
+ * column it could drop from the spawn row, scored on holes and height.
+ * Returns the one it likes best, rotation counted in turns from spawn.
+ */
+static piece_t pick_target(const game_t *g, uint8_t *turns) {
+	piece_t best = g->active_piece;
+	int best_cost = -1;
+	*turns = 0;
+	for (uint8_t k = 0; k < 4; k++) {
+		for (int8_t x = -3; x < BOARD_WIDTH; x++) {
+			piece_t p = g->active_piece;
+			p.rotation = (p.rotation + k) % 4;
+			p.x = x;
+			if (piece_collides(&g->bitboard, &p)) continue;
+			p.y += game_drop_distance(g, &p);
+			bitboard_t bb = g->bitboard;
+			int8_t lines = bitboard_place(&bb, &p);
+			if (lines < 0) continue;
+			int cost = board_cost(&bb) - 10 * lines;
+			if (best_cost < 0 || cost < best_cost) {
+				best = p;
+				best_cost = cost;
+				*turns = k;
+			}
+		}
+	}
+	return best;
+}
+
+// The scripted player's side of a game: every input goes to the game and the recording
+typedef struct {
+	game_t *g;
+	replay_writer_t *w;
+	uint32_t ms;
+} script_t;
+
+static void script_wait(script_t *s, uint32_t ms) {
+	s->ms += ms;
+	game_update(s->g, s->ms);
+}
+
+static void script_input(script_t *s, input_t in) {
+	game_update(s->g, s->ms);
+	game_apply_input(s->g, in);
+	replay_record(s->w, s->ms, in);
+}
+
+/* Plays one game from `seed` the way a person might, and records it: turns,
+ * then taps or holds left/right to the chosen column, then hard drops, or on
+ * every third piece holds soft drop until it settles. With `held` false it
+ * only uses the taps a version 1 replay can hold. Returns the keys it held.
+ */
+static uint32_t play_scripted(game_t *g, replay_writer_t *w, uint64_t seed, bool held) {
+	uint32_t presses = 0;
+	script_t s = { .g = g, .w = w };
+	game_init(g, seed);
+	replay_begin_game(w, seed);
+	while (!g->over && g->pieces_placed < TEST_MAX_PIECES) {
+		if (game_clearing(g)) script_wait(&s, g->clear_until_ms - s.ms);
+		uint32_t placed = g->pieces_placed;
+		uint8_t turns;
+		piece_t target = pick_target(g, &turns);
+		for (uint8_t k = 0; k < turns; k++) {
+			script_wait(&s, TEST_FRAME_MS);
+			script_input(&s, INPUT_ROTATE);
+		}
+
+		int dx = target.x - g->active_piece.x;
+		bool left = dx < 0;
+		if (held && abs(dx) >= 3) {
+			// Held until it gets there, or until it can't go any further
+			script_wait(&s, TEST_FRAME_MS);
+			script_input(&s, left ? INPUT_PRESS_LEFT : INPUT_PRESS_RIGHT);
+			presses++;
+			for (uint32_t waited = 0; g->active_piece.x != target.x && g->pieces_placed == placed
+			     && waited < DAS_MS + ARR_MS * BOARD_WIDTH; waited++)
+				script_wait(&s, 1);
+			script_input(&s, left ? INPUT_RELEASE_LEFT : INPUT_RELEASE_RIGHT);
+		}
+		while (g->pieces_placed == placed && g->active_piece.x != target.x) {
+			int8_t x = g->active_piece.x;
+			script_wait(&s, TEST_FRAME_MS);
+			script_input(&s, left ? INPUT_LEFT : INPUT_RIGHT);
+			if (g->active_piece.x == x) break; // something's in the way
+		}
+		if (g->pieces_placed != placed) continue;
+
+		script_wait(&s, TEST_FRAME_MS);
+		if (held && placed % 3 == 2) {
+			script_input(&s, INPUT_PRESS_SOFT_DROP);
+			presses++;
+			while (!g->over && g->pieces_placed == placed) script_wait(&s, TEST_FRAME_MS);
+			script_input(&s, INPUT_RELEASE_SOFT_DROP);
+		}
+		else {
+			script_input(&s, INPUT_HARD_DROP);
+		}
+	}
+	script_wait(&s, TEST_FRAME_MS);
+	replay_end_game(w, s.ms);
+	return presses;
+}
+
+// A fresh temporary file's path, in `path` (at least 32 bytes)
+static void temp_path(char *path) {
+	strcpy(path, "/tmp/tetris-test-XXXXXX");
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("Couldn't make a temporary file");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+// Plays the first game in `path` into `g`
+static replay_status_t play_file(const char *path, game_t *g) {
+	replay_reader_t r;
+	if (!replay_reader_open(&r, path)) return REPLAY_BAD;
+	replay_status_t status = replay_play_game(&r, g);
+	if (status == REPLAY_OK && replay_play_game(&r, g) != REPLAY_EOF) status = REPLAY_BAD;
+	replay_reader_close(&r);
+	return status;
+}
+
+/* Overwrites the byte at `at` in a file (from the end if negative) with
+ * `byte`, or cuts the file short there if `byte` is negative. Returns the
+ * byte that was there.
+ */
+static int patch_file(const char *path, long at, int byte) {
+	FILE *f = fopen(path, "r+b");
+	if (!f) return -1;
+	fseek(f, at, at < 0 ? SEEK_END : SEEK_SET);
+	long pos = ftell(f);
+	int was = fgetc(f);
+	fseek(f, pos, SEEK_SET);
+	if (byte >= 0) fputc(byte, f);
+	fclose(f);
+	if (byte < 0 && truncate(path, pos) != 0) perror("truncate");
+	return was;
+}
+
+/* The other side of a match, played by the test: a socket joined to a
+ * versus_t hosting on loopback, and packets it has sent that are still on
+ * their way, to be delivered late, out of order or more than once
+ */
+typedef struct {
+	int fd;
+	uint16_t inputs[TEST_VERSUS_FRAMES];
+	uint32_t frame; // frames of its input so far
+	uint8_t queued;
+	uint8_t packets[TEST_PEER_QUEUE][VERSUS_PACKET_MAX];
+	size_t lens[TEST_PEER_QUEUE];
+} peer_t;
+
+// Joins the match `v` is hosting and starts it, at time 0
+static bool peer_join(peer_t *p, versus_t *v) {
+	struct sockaddr_storage host;
+	socklen_t len = sizeof(host);
+	if (getsockname(v->fd, (struct sockaddr *) &host, &len) < 0) return false;
+	struct sockaddr_in to = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	to.sin_port = host.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &host)->sin6_port : ((struct sockaddr_in *) &host)->sin_port;
+	p->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (p->fd < 0 || connect(p->fd, (struct sockaddr *) &to, sizeof(to)) < 0) return false;
+	uint8_t hello[2] = { VERSUS_MAGIC, VERSUS_HELLO };
+	send(p->fd, hello, sizeof(hello), 0);
+	versus_receive(v, 0);
+	return v->started;
+}
+
+// Queues an INPUTS packet of the peer's frames from `first` on, acking every frame of the host's
+static void peer_queue(peer_t *p, const versus_t *v, uint32_t first) {
+	uint8_t *buf = p->packets[p->queued];
+	uint8_t count = (uint8_t) (p->frame - first);
+	buf[0] = VERSUS_MAGIC;
+	buf[1] = VERSUS_INPUTS;
+	for (uint8_t i = 0; i < 4; i++) {
+		buf[2 + i] = (uint8_t) (v->frame >> (8 * i));
+		buf[6 + i] = (uint8_t) (first >> (8 * i));
+	}
+	buf[10] = count;
+	for (uint8_t i = 0; i < count; i++) {
+		buf[11 + 2 * i] = (uint8_t) p->inputs[first + i];
+		buf[12 + 2 * i] = (uint8_t) (p->inputs[first + i] >> 8);
+	}
+	p->lens[p->queued++] = 11 + 2 * count;
+}
+
+// Sends the queued packet `i`, and unless `again` takes it off the queue
+static void peer_deliver(peer_t *p, uint8_t i, bool again) {
+	send(p->fd, p->packets[i], p->lens[i], 0);
+	if (again) return;
+	p->queued--;
+	memcpy(p->packets[i], p->packets[p->queued], VERSUS_PACKET_MAX);
+	p->lens[i] = p->lens[p->queued];
+}
+
+// A cell as a terminal shows it: colors -1 for the default, styles a bit per SGR number
+typedef struct {
+	uint32_t ch;
+	int fg, bg;
+	uint16_t styles;
+} term_cell_t;
+
+/* Just enough of a terminal to play back what tb_present() sends: printing
+ * with auto-wrap, absolute/column/relative moves, clear and SGR. Anything
+ * else it's sent is skipped.
+ */
+typedef struct {
+	term_cell_t cells[TEST_TERM_ROWS][TEST_TERM_COLS];
+	term_cell_t pen; // colors and styles the next character is printed in
+	int x, y; // x is TEST_TERM_COLS after printing in the last column, until the next wraps
+} term_t;
+
+static void term_clear(term_t *t) {
+	for (int y = 0; y < TEST_TERM_ROWS; y++)
+		for (int x = 0; x < TEST_TERM_COLS; x++) t->cells[y][x] = (term_cell_t) { ' ', -1, -1, 0 };
+}
+
+static void term_sgr(term_t *t, const int *params, int n) {
+	static const int RESET[] = { 0 };
+	if (n == 0) {
+		params = RESET;
+		n = 1;
+	}
+	for (int i = 0; i < n; i++) {
+		int p = params[i];
+		if (p == 0) t->pen = (term_cell_t) { 0, -1, -1, 0 };
+		else if (p < 10) t->pen.styles |= 1u << p;
+		else if (p >= 30 && p <= 37) t->pen.fg = p - 30;
+		else if (p >= 40 && p <= 47) t->pen.bg = p - 40;
+		else if (p == 39) t->pen.fg = -1;
+		else if (p == 49) t->pen.bg = -1;
+		else if ((p == 38 || p == 48) && i + 2 < n && params[i + 1] == 5) {
+			*(p == 38 ? &t->pen.fg : &t->pen.bg) = params[i + 2];
+			i += 2;
+		}
+	}
+}
+
+// Plays `len` bytes of output onto the screen
+static void term_feed(term_t *t, const char *out, size_t len) {
+	for (size_t i = 0; i < len;) {
+		uint8_t c = (uint8_t) out[i++];
+		if (c == 0x1b && i < len && out[i] == '[') {
+			int params[16], n = 0, p = -1;
+			for (i++; i < len && !(out[i] >= 0x40 && out[i] <= 0x7e); i++) {
+				if (out[i] >= '0' && out[i] <= '9') p = (p < 0 ? 0 : 10 * p) + out[i] - '0';
+				else if (out[i] == ';' && n < 15) params[n++] = p < 0 ? 0 : p, p = -1;
+			}
+			if (p >= 0 || n > 0) params[n++] = p < 0 ? 0 : p;
+			if (i == len) break;
+			char final = out[i++];
+			int arg = n > 0 && params[0] > 0 ? params[0] : 1;
+			if (t->x == TEST_TERM_COLS) t->x--; // any move takes it out of the pending wrap
+			if (final == 'H') {
+				t->y = arg - 1;
+				t->x = (n > 1 && params[1] > 0 ? params[1] : 1) - 1;
+			}
+			else if (final == 'G') t->x = arg - 1;
+			else if (final == 'C') t->x += arg;
+			else if (final == 'D') t->x -= arg;
+			else if (final == 'J') term_clear(t);
+			else if (final == 'm') term_sgr(t, params, n);
+			if (t->x < 0) t->x = 0;
+			if (t->x >= TEST_TERM_COLS) t->x = TEST_TERM_COLS - 1;
+			continue;
+		}
+		if (c == 0x1b) {
+			i += i < len && out[i] == '(' ? 2 : 1; // a charset, or ESC = / ESC >
+			continue;
+		}
+		if (c < 0x20) continue;
+
+		uint32_t ch = c;
+		int more = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+		if (more) ch &= 0x3f >> more;
+		for (; more > 0 && i < len; more--) ch = ch << 6 | ((uint8_t) out[i++] & 0x3f);
+		if (t->x == TEST_TERM_COLS) {
+			t->x = 0;
+			t->y++;
+		}
+		if (t->y >= TEST_TERM_ROWS) continue;
+		t->cells[t->y][t->x] = t->pen;
+		t->cells[t->y][t->x++].ch = ch;
+	}
+}
+
+// Presents ctx and plays what it sent onto t. Returns the bytes sent.
+static size_t term_present(struct tb_ctx *ctx, term_t *t) {
+	size_t len;
+	tb_ctx_present(ctx);
+	const char *out = tb_ctx_output(ctx, &len);
+	term_feed(t, out, len);
+	tb_ctx_consume(ctx, len);
+	return len;
+}
+
+// Tests ////////////
+
+/* On crafted boards: the game's hard drop lands where stepping down does,
+ * and settles to the same board and line count as bitboard_place()
+ */
+static void test_place_matches_settle() {
+	static game_t g;
+	rng_t rng;
+	rng_seed(&rng, 1);
+	for (int i = 0; i < TEST_BOARDS; i++) {
+		bitboard_t bb;
+		piece_t from;
+		craft_board(&rng, &bb);
+		piece_t resting = craft_drop(&rng, &bb, &from);
+		game_with(&g, &bb, from);
+		CHECK_EQ(from.y + game_drop_distance(&g, &from), resting.y);
+
+		int8_t lines = bitboard_place(&bb, &resting);
+		game_hard_drop(&g);
+		if (lines < 0) {
+			CHECK(g.over);
+			continue;
+		}
+		CHECK_EQ(g.lines_cleared, lines);
+		CHECK(memcmp(&g.bitboard, &bb, sizeof(bb)) == 0);
+	}
+}
+
+// SRS kicks: off each wall, up out of the stack, and no turn at all when nothing fits
+static void test_kicks() {
+	static const bitboard_t EMPTY;
+	bitboard_t bb = EMPTY;
+
+	// T pointing right with its stem on the left wall: the flat turn kicks one right
+	piece_t p = piece_at(PIECE_T, 1, -1, 5);
+	CHECK(!piece_collides(&bb, &p));
+	CHECK(piece_rotate(&bb, &p));
+	CHECK_EQ(p.rotation, 2);
+	CHECK_EQ(p.x, 0);
+	CHECK_EQ(p.y, 5);
+
+	// Upright I on the right wall: lying down it takes the second test, one left
+	p = piece_at(PIECE_I, 1, BOARD_WIDTH - 3, 5);
+	CHECK(!piece_collides(&bb, &p));
+	CHECK(piece_rotate(&bb, &p));
+	CHECK_EQ(p.rotation, 2);
+	CHECK_EQ(p.x, BOARD_WIDTH - 4);
+	CHECK_EQ(p.y, 5);
+
+	// T on the floor, with the cells under both its own turn and the one
+	// kicked left filled: the third test lifts it a row as well
+	int8_t floor = BOARD_HEIGHT - 1;
+	bb.rows[floor] = ROW_BIT(3) | ROW_BIT(4);
+	p = piece_at(PIECE_T, 0, 3, floor - 2);
+	CHECK(!piece_collides(&bb, &p));
+	CHECK(piece_rotate(&bb, &p));
+	CHECK_EQ(p.rotation, 1);
+	CHECK_EQ(p.x, 2);
+	CHECK_EQ(p.y, floor - 3);
+
+	// Boxed in: every test collides and the piece is left as it was
+	p = piece_at(PIECE_T, 0, 3, floor - 2);
+	for (int8_t y = 0; y < BOARD_HEIGHT; y++) bb.rows[y] = FULL_ROW;
+	bb.rows[floor - 2] &= ~ROW_BIT(4);
+	bb.rows[floor - 1] &= ~(ROW_BIT(3) | ROW_BIT(4) | ROW_BIT(5));
+	CHECK(!piece_collides(&bb, &p));
+	piece_t before = p;
+	CHECK(!piece_rotate(&bb, &p));
+	CHECK(memcmp(&before, &p, sizeof(p)) == 0);
+
+	// O never turns; the game only reports a turn that happened
+	static game_t g;
+	game_with(&g, &EMPTY, piece_at(PIECE_O, 2, 3, 5));
+	CHECK(!game_rotate(&g));
+	CHECK_EQ(g.events, 0);
+	game_with(&g, &EMPTY, piece_at(PIECE_T, 1, -1, 5));
+	CHECK(game_rotate(&g));
+	CHECK(g.events & GAME_EVENT_MOVED);
+}
+
+/* Two lines cleared around one that isn't, by an upright I in the first
+ * column: they're listed top to bottom as they were, and everything above
+ * each comes down, the row between them included
+ */
+static void test_line_clear() {
+	static game_t g;
+	int8_t floor = BOARD_HEIGHT - 1;
+	bitboard_t bb = { 0 };
+	bb.rows[floor] = FULL_ROW & ~ROW_BIT(0);
+	bb.rows[floor - 1] = ROW_BIT(1) | ROW_BIT(2);
+	bb.rows[floor - 2] = FULL_ROW & ~ROW_BIT(0);
+	bb.rows[floor - 3] = ROW_BIT(3);
+	bb.rows[floor - 4] = ROW_BIT(5);
+	game_with(&g, &bb, piece_at(PIECE_I, 1, -2, 0));
+	game_t before = g;
+
+	g.time_ms = 100;
+	game_hard_drop(&g);
+	CHECK_EQ(g.lines_cleared, 2);
+	CHECK(g.events & GAME_EVENT_LINES);
+	CHECK_EQ(g.last_clear.count, 2);
+	CHECK_EQ(g.last_clear.rows[0], floor - 2);
+	CHECK_EQ(g.last_clear.rows[1], floor);
+	CHECK_EQ(g.last_clear.colors[0][0], PIECE_COLORS[PIECE_I]);
+	CHECK(memcmp(&g.last_clear.colors[1][1], &before.colors[floor][1], (BOARD_WIDTH - 1) * sizeof(uintattr_t)) == 0);
+
+	CHECK_EQ(g.bitboard.rows[floor], ROW_BIT(0) | ROW_BIT(1) | ROW_BIT(2));
+	CHECK_EQ(g.bitboard.rows[floor - 1], ROW_BIT(0) | ROW_BIT(3));
+	CHECK_EQ(g.bitboard.rows[floor - 2], ROW_BIT(5));
+	CHECK_EQ(g.bitboard.rows[floor - 3], 0);
+	CHECK(memcmp(&g.colors[floor][1], &before.colors[floor - 1][1], 2 * sizeof(uintattr_t)) == 0);
+	CHECK_EQ(g.colors[floor - 2][5], before.colors[floor - 4][5]);
+	CHECK_EQ(g.column_top[0], floor - 1);
+	CHECK_EQ(g.column_top[5], floor - 2);
+
+	// The next piece waits out the clear delay before it falls, and can't be dropped before then
+	CHECK_EQ(g.clear_until_ms, 100 + LINE_CLEAR_DELAY_MS);
+	CHECK_EQ(g.next_drop_ms, g.clear_until_ms + g.drop_speed);
+	piece_t next = g.active_piece;
+	game_apply_input(&g, INPUT_HARD_DROP);
+	game_update(&g, g.clear_until_ms + (uint32_t) g.drop_speed - 1);
+	CHECK(memcmp(&next, &g.active_piece, sizeof(next)) == 0);
+	CHECK_EQ(g.pieces_placed, before.pieces_placed + 1);
+}
+
+/* A piece that spawns already resting on the stack during a line clear
+ * waits out the clear before its lock delay starts, rather than settling
+ * in the middle of the animation
+ */
+static void test_lock_after_clear() {
+	static game_t g;
+	int8_t floor = BOARD_HEIGHT - 1;
+	bitboard_t bb = { 0 };
+	bb.rows[floor] = FULL_ROW & ~ROW_BIT(0);
+	int8_t stem = piece_spawn(PIECE_T).x + 1;
+	for (int8_t y = 1; y < floor; y++) bb.rows[y] = ROW_BIT(stem); // comes down to just under a spawned T
+	game_with(&g, &bb, piece_at(PIECE_I, 1, -2, 0));
+	g.preview[g.preview_head] = PIECE_T;
+	g.time_ms = 100;
+	game_hard_drop(&g);
+	CHECK_EQ(g.lines_cleared, 1);
+	CHECK_EQ(g.active_piece.type, PIECE_T);
+	CHECK(g.locking);
+	CHECK_EQ(g.lock_at_ms, g.clear_until_ms + LOCK_DELAY_MS);
+	CHECK(game_next_deadline(&g) <= g.lock_at_ms);
+
+	uint32_t placed = g.pieces_placed;
+	game_update(&g, g.clear_until_ms + LOCK_DELAY_MS - 1);
+	CHECK_EQ(g.pieces_placed, placed);
+	game_update(&g, g.clear_until_ms + LOCK_DELAY_MS);
+	CHECK_EQ(g.pieces_placed, placed + 1);
+}
+
+// A scripted game plays back from its recording to exactly the same game
+static void test_replay() {
+	static game_t live, played;
+	char path[32];
+	temp_path(path);
+	replay_writer_t w;
+	CHECK(replay_writer_open(&w, path));
+	CHECK_EQ(play_scripted(&live, &w, GOLDEN_SEED, false), 0);
+	replay_writer_close(&w);
+	CHECK(live.pieces_placed > 0);
+
+	CHECK_EQ(play_file(path, &played), REPLAY_OK);
+	CHECK(memcmp(&live, &played, sizeof(live)) == 0);
+	printf("# replay seed=%d pieces=%u lines=%u time_ms=%u over=%d\n", GOLDEN_SEED,
+	       played.pieces_placed, played.lines_cleared, played.time_ms, played.over);
+#ifdef GOLDEN_PIECES
+	CHECK_EQ(played.pieces_placed, GOLDEN_PIECES);
+	CHECK_EQ(played.lines_cleared, GOLDEN_LINES);
+	CHECK_EQ(played.time_ms, GOLDEN_TIME_MS);
+#endif
+
+	// Files from another version or for another board size don't play, and
+	// neither does a corrupt or cut-off one. The file ends with the last
+	// input, then a one byte delta and REPLAY_END.
+	patch_file(path, 4, REPLAY_VERSION + 1);
+	CHECK_EQ(play_file(path, &played), REPLAY_BAD);
+	patch_file(path, 4, REPLAY_VERSION);
+	patch_file(path, 5, BOARD_WIDTH + 1);
+	CHECK_EQ(play_file(path, &played), REPLAY_BAD);
+	patch_file(path, 5, BOARD_WIDTH);
+	CHECK_EQ(play_file(path, &played), REPLAY_OK);
+	int last = patch_file(path, -3, INPUT_COUNT);
+	CHECK_EQ(play_file(path, &played), REPLAY_BAD);
+	patch_file(path, -3, last);
+	patch_file(path, -1, -1);
+	CHECK_EQ(play_file(path, &played), REPLAY_BAD);
+	unlink(path);
+}
+
+// Held left/right shift once, then after DAS_MS every ARR_MS; held soft drop speeds gravity up
+static void test_held_keys() {
+	static const bitboard_t EMPTY;
+	static game_t g;
+	int8_t y = 5;
+	game_with(&g, &EMPTY, piece_at(PIECE_T, 2, 5, y));
+	g.next_drop_ms = 1000;
+
+	game_apply_input(&g, INPUT_PRESS_LEFT);
+	CHECK_EQ(g.active_piece.x, 4);
+	game_update(&g, DAS_MS - 1);
+	CHECK_EQ(g.active_piece.x, 4);
+	game_update(&g, DAS_MS);
+	CHECK_EQ(g.active_piece.x, 3);
+	game_update(&g, DAS_MS + ARR_MS - 1);
+	CHECK_EQ(g.active_piece.x, 3);
+	game_update(&g, DAS_MS + 2 * ARR_MS);
+	CHECK_EQ(g.active_piece.x, 1);
+	CHECK_EQ(g.active_piece.y, y); // no gravity yet
+
+	// Right pressed as well takes over, from its own delay, and hands back on release
+	uint32_t t = DAS_MS + 2 * ARR_MS + 1;
+	game_update(&g, t);
+	game_apply_input(&g, INPUT_PRESS_RIGHT);
+	CHECK_EQ(g.active_piece.x, 2);
+	game_update(&g, t + DAS_MS + ARR_MS);
+	CHECK_EQ(g.active_piece.x, 4);
+	game_apply_input(&g, INPUT_RELEASE_RIGHT);
+	game_update(&g, t + DAS_MS + ARR_MS + DAS_MS - 1);
+	CHECK_EQ(g.active_piece.x, 4);
+	game_update(&g, t + DAS_MS + ARR_MS + DAS_MS);
+	CHECK_EQ(g.active_piece.x, 3);
+	game_apply_input(&g, INPUT_RELEASE_LEFT);
+	game_update(&g, 900);
+	CHECK_EQ(g.active_piece.x, 3);
+
+	// Repeats stop at the wall: the press and two repeats get there from 3, the rest do nothing
+	game_apply_input(&g, INPUT_PRESS_LEFT);
+	game_update(&g, 900 + DAS_MS + 4 * ARR_MS);
+	CHECK_EQ(g.active_piece.x, 0);
+	game_apply_input(&g, INPUT_RELEASE_LEFT);
+	CHECK_EQ(g.active_piece.y, y + 1); // gravity came once, at 1000 ms
+
+	// Soft drop: a step now, then one every drop_speed / SOFT_DROP_FACTOR
+	game_with(&g, &EMPTY, piece_at(PIECE_T, 2, 3, y));
+	g.next_drop_ms = 1000;
+	uint32_t fast = (uint32_t) (g.drop_speed / SOFT_DROP_FACTOR);
+	game_apply_input(&g, INPUT_PRESS_SOFT_DROP);
+	CHECK_EQ(g.active_piece.y, y + 1);
+	game_update(&g, fast - 1);
+	CHECK_EQ(g.active_piece.y, y + 1);
+	game_update(&g, 3 * fast);
+	CHECK_EQ(g.active_piece.y, y + 4);
+	// Released: the step already due still comes, then gravity is back to normal
+	game_apply_input(&g, INPUT_RELEASE_SOFT_DROP);
+	game_update(&g, 4 * fast);
+	CHECK_EQ(g.active_piece.y, y + 5);
+	game_update(&g, 4 * fast + (uint32_t) g.drop_speed - 1);
+	CHECK_EQ(g.active_piece.y, y + 5);
+	game_update(&g, 4 * fast + (uint32_t) g.drop_speed);
+	CHECK_EQ(g.active_piece.y, y + 6);
+}
+
+/* A scripted game that holds keys records only their presses and releases,
+ * and plays back to exactly the same game. A version 1 file is the same as
+ * one that only taps but for the version byte, and still plays.
+ */
+static void test_replay_held() {
+	static game_t live, played;
+	char path[32];
+	temp_path(path);
+	replay_writer_t w;
+	CHECK(replay_writer_open(&w, path));
+	CHECK(play_scripted(&live, &w, GOLDEN_SEED + 1, true) > 0);
+	replay_writer_close(&w);
+	CHECK_EQ(play_file(path, &played), REPLAY_OK);
+	CHECK(memcmp(&live, &played, sizeof(live)) == 0);
+
+	CHECK(replay_writer_open(&w, path));
+	CHECK_EQ(play_scripted(&live, &w, GOLDEN_SEED + 1, false), 0);
+	replay_writer_close(&w);
+	patch_file(path, 4, 1);
+	CHECK_EQ(play_file(path, &played), REPLAY_OK);
+	CHECK(memcmp(&live, &played, sizeof(live)) == 0);
+	patch_file(path, 4, REPLAY_OLDEST_VERSION - 1);
+	CHECK_EQ(play_file(path, &played), REPLAY_BAD);
+	unlink(path);
+}
+
+// Garbage waits for a piece to settle without a clear, then pushes the stack up
+static void test_garbage() {
+	static game_t g, again;
+	bitboard_t bb = { 0 };
+	int8_t floor = BOARD_HEIGHT - 1;
+	bb.rows[floor] = ROW_BIT(0) | ROW_BIT(1);
+	game_with(&g, &bb, piece_at(PIECE_O, 2, 3, 0));
+	game_add_garbage(&g, 2);
+	CHECK_EQ(g.garbage_in, 2);
+	CHECK(memcmp(&g.bitboard, &bb, sizeof(bb)) == 0); // nothing rises yet
+
+	again = g;
+	game_hard_drop(&g);
+	CHECK(g.events & GAME_EVENT_GARBAGE);
+	CHECK_EQ(g.garbage_in, 0);
+	CHECK(!g.over);
+	// Two rows, full but for the same hole
+	row_t hole = FULL_ROW & ~g.bitboard.rows[floor];
+	CHECK_EQ(ROW_POPCOUNT(hole), 1);
+	CHECK_EQ(g.bitboard.rows[floor - 1], g.bitboard.rows[floor]);
+	for (int8_t x = 0; x < BOARD_WIDTH; x++)
+		CHECK_EQ(g.colors[floor][x], (hole & ROW_BIT(x)) ? TB_BLACK : GARBAGE_COLOR);
+	// The old floor and the O on it, two rows up
+	CHECK_EQ(g.bitboard.rows[floor - 2], ROW_BIT(0) | ROW_BIT(1) | ROW_BIT(4) | ROW_BIT(5));
+	CHECK_EQ(g.bitboard.rows[floor - 3], ROW_BIT(4) | ROW_BIT(5));
+	CHECK_EQ(g.column_top[0], floor - 2);
+	CHECK_EQ(g.column_top[4], floor - 3);
+	// The same game gets the same holes
+	game_hard_drop(&again);
+	CHECK(memcmp(&g.bitboard, &again.bitboard, sizeof(bb)) == 0);
+
+	// A tetris with one row on its way cancels it and sends the other 3
+	rng_t rng;
+	rng_seed(&rng, 1);
+	piece_t tetris;
+	bool found = false;
+	for (int i = 0; i < TEST_BOARDS && !found; i++) found = craft_well(&rng, &bb, &tetris);
+	CHECK(found);
+	game_with(&g, &bb, tetris);
+	game_add_garbage(&g, 1);
+	game_hard_drop(&g);
+	CHECK_EQ(g.lines_cleared, 4);
+	CHECK_EQ(g.garbage_in, 0);
+	CHECK_EQ(g.garbage_out, 3);
+	CHECK(!(g.events & GAME_EVENT_GARBAGE));
+
+	// More coming than the clear sends: what's left waits for the next piece
+	game_with(&g, &bb, tetris);
+	game_add_garbage(&g, 6);
+	game_hard_drop(&g);
+	CHECK_EQ(g.garbage_in, 2);
+	CHECK_EQ(g.garbage_out, 0);
+
+	// Garbage that pushes the stack off the top ends the game, and no more than a board's worth ever waits
+	memset(&bb, 0, sizeof(bb));
+	bb.rows[1] = ROW_BIT(0);
+	game_with(&g, &bb, piece_at(PIECE_O, 2, BOARD_WIDTH - 3, BOARD_HEIGHT - 2));
+	game_add_garbage(&g, 200);
+	CHECK_EQ(g.garbage_in, BOARD_HEIGHT);
+	g.garbage_in = 2;
+	game_hard_drop(&g);
+	CHECK(g.over);
+	CHECK(g.events & GAME_EVENT_OVER);
+}
+
+/* A match hosted on loopback against a peer whose inputs come late, out of
+ * order, more than once and now and then with a gap before them: the
+ * confirmed games come out just as stepping both in lockstep with the real
+ * inputs does. A peer gone quiet stops the host VERSUS_MAX_ROLLBACK frames on.
+ */
+static void test_rollback() {
+	static versus_t v;
+	static peer_t p;
+	static game_t lockstep[2];
+	static uint16_t mine[TEST_VERSUS_FRAMES];
+	rng_t rng;
+	rng_seed(&rng, 3);
+	for (uint32_t f = 0; f < TEST_VERSUS_FRAMES; f++) {
+		mine[f] = rng_below(&rng, 4) == 0 ? 1u << rng_below(&rng, INPUT_COUNT) : 0;
+		p.inputs[f] = rng_below(&rng, 4) == 0 ? 1u << rng_below(&rng, INPUT_COUNT) : 0;
+	}
+	CHECK(versus_open(&v, "0", GOLDEN_SEED, 0));
+	CHECK(peer_join(&p, &v));
+
+	uint32_t fed = 0; // our frames whose inputs have gone in
+	uint32_t stalls = 0;
+	for (uint32_t tick = 0; tick < 8 * TEST_VERSUS_FRAMES && !v.over && v.confirmed_frame < TEST_VERSUS_FRAMES; tick++) {
+		if (fed == v.frame && fed < TEST_VERSUS_FRAMES) {
+			for (uint8_t i = 0; i < INPUT_COUNT; i++) {
+				if (mine[fed] & (1u << i)) versus_input(&v, (input_t) i);
+			}
+			fed++;
+		}
+		double now_ms = v.start_ms + (v.frame + 1) * (double) VERSUS_FRAME_MS;
+		if (v.frame < TEST_VERSUS_FRAMES) versus_advance(&v, now_ms);
+		CHECK(v.frame <= v.heard + VERSUS_MAX_ROLLBACK);
+
+		// The peer goes quiet for a while, and the host has to wait for it
+		if (tick == 60) stalls = v.stalls;
+		if (tick >= 60 && tick < 60 + 2 * VERSUS_MAX_ROLLBACK) continue;
+		if (tick == 60 + 2 * VERSUS_MAX_ROLLBACK) {
+			CHECK(v.stalls > stalls);
+			CHECK_EQ(v.frame, (v.heard < v.acked ? v.heard : v.acked) + VERSUS_MAX_ROLLBACK);
+		}
+
+		if (p.frame < TEST_VERSUS_FRAMES && p.frame < v.heard + VERSUS_MAX_ROLLBACK) p.frame++;
+		uint32_t first = v.heard;
+		if (rng_below(&rng, 6) == 0) first += 1 + rng_below(&rng, 3);
+		if (p.queued == TEST_PEER_QUEUE) peer_deliver(&p, (uint8_t) rng_below(&rng, p.queued), false);
+		if (first < p.frame) peer_queue(&p, &v, first);
+		while (p.queued > 0 && rng_below(&rng, 2) == 0)
+			peer_deliver(&p, (uint8_t) rng_below(&rng, p.queued), rng_below(&rng, 3) == 0);
+		versus_receive(&v, now_ms);
+	}
+	CHECK(!v.over);
+	CHECK_EQ(v.confirmed_frame, TEST_VERSUS_FRAMES);
+	CHECK(v.max_rollback > 0 && v.max_rollback <= VERSUS_MAX_ROLLBACK);
+
+	game_init(&lockstep[0], GOLDEN_SEED);
+	game_init(&lockstep[1], GOLDEN_SEED);
+	for (uint32_t f = 0; f < v.confirmed_frame; f++) {
+		uint16_t in[2] = { mine[f], p.inputs[f] };
+		versus_step(lockstep, in, f);
+	}
+	CHECK(memcmp(lockstep, v.confirmed, sizeof(lockstep)) == 0);
+	CHECK(memcmp(v.games, v.confirmed, sizeof(v.games)) == 0); // nothing left to guess
+	close(p.fd);
+	versus_close(&v);
+}
+
+/* Random runs of changed cells, presented both normally and lean: the
+ * screens each stream draws on a terminal are the same every frame, and
+ * lean never takes more bytes to get there
+ */
+static void test_lean_present() {
+	static const uint32_t CHARS[] = { ' ', '#', '[', ']', '.', 0x2588, 0x2592 };
+	static const uintattr_t STYLES[] = { 0, 0, 0, TB_BOLD, TB_REVERSE, TB_BOLD | TB_UNDERLINE };
+	static term_t normal_term, lean_term;
+	struct tb_ctx *normal = tb_ctx_new(TEST_TERM_COLS, TEST_TERM_ROWS);
+	struct tb_ctx *lean = tb_ctx_new(TEST_TERM_COLS, TEST_TERM_ROWS);
+	CHECK(normal && lean);
+	if (!normal || !lean) return;
+	tb_ctx_set_present_mode(lean, TB_PRESENT_LEAN);
+	term_clear(&normal_term);
+	term_clear(&lean_term);
+
+	rng_t rng;
+	rng_seed(&rng, 5);
+	size_t normal_bytes = 0, lean_bytes = 0;
+	for (int frame = 0; frame < TEST_PRESENTS; frame++) {
+		uint32_t runs = rng_below(&rng, 40);
+		for (uint32_t r = 0; r < runs; r++) {
+			int x = (int) rng_below(&rng, TEST_TERM_COLS), y = (int) rng_below(&rng, TEST_TERM_ROWS);
+			int len = 1 + (int) rng_below(&rng, 12);
+			uintattr_t fg = (rng_below(&rng, 4) ? 1 + rng_below(&rng, 8) : TB_DEFAULT) | STYLES[rng_below(&rng, 6)];
+			uintattr_t bg = rng_below(&rng, 4) ? 1 + rng_below(&rng, 8) : TB_DEFAULT;
+			bool same_char = rng_below(&rng, 2);
+			uint32_t ch = CHARS[rng_below(&rng, 7)];
+			for (int i = 0; i < len && x + i < TEST_TERM_COLS; i++) {
+				if (!same_char) ch = CHARS[rng_below(&rng, 7)];
+				struct tb_ctx *prev = tb_ctx_select(normal);
+				tb_set_cell(x + i, y, ch, fg, bg);
+				tb_ctx_select(lean);
+				tb_set_cell(x + i, y, ch, fg, bg);
+				tb_ctx_select(prev);
+			}
+		}
+		size_t n = term_present(normal, &normal_term);
+		size_t l = term_present(lean, &lean_term);
+		normal_bytes += n;
+		lean_bytes += l;
+		CHECK(l <= n);
+		CHECK(memcmp(&normal_term.cells, &lean_term.cells, sizeof(normal_term.cells)) == 0);
+		if (failures) break;
+	}
+	printf("# lean_present normal_bytes=%zu lean_bytes=%zu\n", normal_bytes, lean_bytes);
+	tb_ctx_free(normal);
+	tb_ctx_free(lean);
+}
+
+static const test_t TESTS[] = {
+	{"place_matches_settle", test_place_matches_settle},
+	{"kicks", test_kicks},
+	{"line_clear", test_line_clear},
+	{"lock_after_clear", test_lock_after_clear},
+	{"replay", test_replay},
+	{"held_keys", test_held_keys},
+	{"replay_held", test_replay_held},
+	{"garbage", test_garbage},
+	{"rollback", test_rollback},
+	{"lean_present", test_lean_present}
+};
+#define N_TESTS (sizeof(TESTS) / sizeof(TESTS[0]))
+
+// Runs `t` and prints one line saying how it went. Returns false if it failed.
+static bool run_test(const test_t *t) {
+	current = t->name;
+	failures = 0;
+	t->run();
+	if (failures == 0) printf("test=%s ok\n", t->name);
+	fflush(stdout);
+	return failures == 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+		printf("Usage: %s [TEST...]\nWith no TEST, all of them run:", argv[0]);
+		for (size_t i = 0; i < N_TESTS; i++) printf(" %s", TESTS[i].name);
+		printf("\n");
+		return EXIT_SUCCESS;
+	}
+
+	printf("# tetris test board=%dx%d\n", BOARD_WIDTH, BOARD_HEIGHT);
+	int failed = 0;
+	if (argc == 1) {
+		for (size_t i = 0; i < N_TESTS; i++) failed += !run_test(&TESTS[i]);
+	}
+	for (int a = 1; a < argc; a++) {
+		size_t i = 0;
+		while (i < N_TESTS && strcmp(TESTS[i].name, argv[a]) != 0) i++;
+		if (i == N_TESTS) {
+			fprintf(stderr, "no test named %s\n", argv[a]);
+			failed++;
+			continue;
+		}
+		failed += !run_test(&TESTS[i]);
+	}
+	if (failed) printf("# %d failed\n", failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
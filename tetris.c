@@ -9,38 +9,240 @@
 #include "include/tetris.h"
 
 // Globals ///////////
-double drop_speed = 1000.0; // (in ms) start by moving piece down every second
-volatile uintattr_t board[BOARD_WIDTH][BOARD_HEIGHT]; // board is 2D grid of colors (the active piece is NOT part of the board)
-volatile piece_t active_piece = {0};
-pthread_mutex_t board_mutex, active_piece_mutex;
+game_t game; // all board/piece state lives in the engine, see engine.h
+renderer_t renderer = {.full_redraw = true};
+int8_t shown_flash_phase = -1; // flash phase on screen as of the last game_tick()
+double game_epoch_ms = 0, paused_at_ms = 0; // see game_clock_ms()
+bool clock_paused = true;
 pthread_t event_handler_pt;
+input_queue_t input_queue; // keys from the event handler pthread to the main loop
+atomic_bool input_stopping = false; // tells the event handler pthread to finish up
+bool single_threaded = false; // poll for input on the main loop instead of a pthread
+bool fixed_seed = false; // --seed: every game is dealt the same pieces
+uint64_t game_seed = 0;
+bool recording = false; // --record: every game's inputs go to `recorder`
+replay_writer_t recorder = {.fd = -1};
+bool autoplay = false; // --autoplay: the bot plays, keys only pause and quit
+uint8_t bot_depth = 0; // --bot-depth, 0 = the default for the mode
+unsigned n_threads = 0; // --threads, for the bot or the server. 0 = one per online CPU
+const char *serve_port = NULL; // --serve: host games over TCP instead of playing one
+const char *spectate_port = NULL; // --spectate: let people watch one of the served games
+bool lean_output = false; // --lean: present with as few bytes as possible (TB_PRESENT_LEAN)
+const char *save_path = NULL; // --save: where the snapshots live, so a killed game resumes
+snapshot_ring_t snapshots; // the current game every SNAPSHOT_EVERY_MS, for 'u' (see snapshot.h)
+const char *versus_where = NULL; // --versus: [HOST:]PORT of the match
+const char *metrics_port = NULL; // --metrics: where the counters are scraped
+versus_t match; // the --versus match, both games in it
+renderer_t versus_renderers[2]; // this side's board on the left, the other's on the right
+bool versus_fits = false; // both boards fit on the screen
+bot_t bot;
+pool_t bot_pool;
+uint32_t next_bot_move_ms = 0; // game time of the bot's next input
+long frame_ns = 1000000000L / FRAME_HZ; // --fps: frame interval for gravity ticks and presents
+bool frame_dirty = false; // the back buffer has changes that haven't been presented
+double last_present_ms = 0;
+histogram_t input_latency; // key press to the tb_present() that showed what it did (us)
+histogram_t tick_jitter; // how late engine deadlines (gravity, lock delay, line clears) were acted on (us)
+histogram_t draw_time; // renderer_draw() (us)
+histogram_t present_time; // tb_present() (us)
+histogram_t frame_bytes; // what each tb_present() sent (bytes, not us)
+double pending_inputs_ms[MAX_PENDING_INPUTS]; // when the keys the next present will show were pressed
+uint8_t n_pending_inputs = 0;
+const char *stats_path = NULL; // --stats: where the histograms are dumped
+volatile sig_atomic_t stats_dump_requested = 0; // set by SIGUSR1
+bool stats_overlay = false; // the histograms are shown beside the board
+bool paused_for_size = false; // the terminal got too small for the board mid-game
 game_state_t GAME_STATE = PAUSE;
 //////////////////////
 
-int main(void) {
+static const struct option LONG_OPTIONS[] = {
+	{"single-thread", no_argument, NULL, 's'},
+	{"fps", required_argument, NULL, 'f'},
+	{"seed", required_argument, NULL, 'S'},
+	{"record", required_argument, NULL, 'r'},
+	{"replay", required_argument, NULL, 'R'},
+	{"autoplay", no_argument, NULL, 'a'},
+	{"bot-depth", required_argument, NULL, 'd'},
+	{"threads", required_argument, NULL, 'j'},
+	{"serve", required_argument, NULL, 'l'},
+	{"spectate", required_argument, NULL, 'w'},
+	{"stats", required_argument, NULL, 't'},
+	{"lean", no_argument, NULL, 'b'},
+	{"save", required_argument, NULL, 'k'},
+	{"simulate", required_argument, NULL, 'n'},
+	{"versus", required_argument, NULL, 'V'},
+	{"metrics", required_argument, NULL, 'M'},
+	{"help", no_argument, NULL, 'h'},
+	{0, 0, 0, 0}
+};
+
+void print_usage(FILE *out, const char *prog) {
+	fprintf(out,
+		"Usage: %s [options]\n"
+		"  -s, --single-thread  handle input, gravity and drawing on one thread with poll()\n"
+		"  -f, --fps N          present at most N frames per second (default %d)\n"
+		"  -S, --seed N         seed the piece randomizer with N (default: the clock)\n"
+		"  -r, --record FILE    save a replay of every game played to FILE\n"
+		"  -R, --replay FILE    play the games in FILE back headless and print how they went\n"
+		"  -a, --autoplay       let the bot play\n"
+		"  -d, --bot-depth N    pieces the bot looks at, the active one included (1-%d, default %d)\n"
+		"  -j, --threads N      threads for the bot's search or the server (default: one per CPU)\n"
+		"  -l, --serve PORT     host games for anyone who connects (telnet) to PORT\n"
+		"  -w, --spectate PORT  with --serve, show one of the games to anyone who connects to PORT\n"
+		"  -t, --stats FILE     append latency histograms to FILE on SIGUSR1 and at exit\n"
+		"  -b, --lean           send as few bytes per frame as possible, for slow links\n"
+		"  -k, --save FILE      keep the game in FILE as it's played, and pick it up from there next time\n"
+		"  -n, --simulate N     let the bot play N games headless on every core, one CSV row each to stdout\n"
+		"                       (bot depth %d unless --bot-depth says otherwise)\n"
+		"  -V, --versus PORT    host a head to head match with garbage on UDP PORT\n"
+		"                       (HOST:PORT instead joins the match hosted there)\n"
+		"  -M, --metrics PORT   serve live counters as Prometheus text on http://localhost:PORT/metrics\n"
+		"  -h, --help           show this message\n", prog, FRAME_HZ, BOT_MAX_DEPTH, BOT_DEFAULT_DEPTH,
+		SIMULATE_DEFAULT_DEPTH);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	uint64_t simulate_n = 0;
+	while ((opt = getopt_long(argc, argv, "sf:S:r:R:ad:j:l:w:t:bk:n:V:M:h", LONG_OPTIONS, NULL)) != -1) {
+		switch (opt) {
+			case 's':
+				single_threaded = true;
+				break;
+			case 'f': {
+				long fps = strtol(optarg, NULL, 10);
+				if (fps <= 0 || fps > 1000) {
+					fprintf(stderr, "--fps must be between 1 and 1000\n");
+					return EXIT_FAILURE;
+				}
+				frame_ns = 1000000000L / fps;
+				break;
+			}
+			case 'S': {
+				char *end;
+				game_seed = strtoull(optarg, &end, 0);
+				if (*optarg == '\0' || *end != '\0') {
+					fprintf(stderr, "--seed must be a number\n");
+					return EXIT_FAILURE;
+				}
+				fixed_seed = true;
+				break;
+			}
+			case 'r':
+				if (!replay_writer_open(&recorder, optarg)) {
+					perror(optarg);
+					return EXIT_FAILURE;
+				}
+				recording = true;
+				break;
+			case 'R':
+				return play_replay(optarg);
+			case 'a':
+				autoplay = true;
+				break;
+			case 'd': {
+				long depth = strtol(optarg, NULL, 10);
+				if (depth < 1 || depth > BOT_MAX_DEPTH) {
+					fprintf(stderr, "--bot-depth must be between 1 and %d\n", BOT_MAX_DEPTH);
+					return EXIT_FAILURE;
+				}
+				bot_depth = depth;
+				break;
+			}
+			case 'j': {
+				long threads = strtol(optarg, NULL, 10);
+				if (threads < 1 || threads > 256) {
+					fprintf(stderr, "--threads must be between 1 and 256\n");
+					return EXIT_FAILURE;
+				}
+				n_threads = threads;
+				break;
+			}
+			case 'l':
+				serve_port = optarg;
+				break;
+			case 'w':
+				spectate_port = optarg;
+				break;
+			case 't':
+				stats_path = optarg;
+				break;
+			case 'b':
+				lean_output = true;
+				break;
+			case 'k':
+				save_path = optarg;
+				break;
+			case 'n': {
+				char *end;
+				simulate_n = strtoull(optarg, &end, 10);
+				if (*optarg == '\0' || *end != '\0' || simulate_n == 0) {
+					fprintf(stderr, "--simulate needs a number of games\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			}
+			case 'V':
+				versus_where = optarg;
+				break;
+			case 'M':
+				metrics_port = optarg;
+				break;
+			case 'h':
+				print_usage(stdout, argv[0]);
+				return EXIT_SUCCESS;
+			default:
+				print_usage(stderr, argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (spectate_port && !serve_port) {
+		fprintf(stderr, "--spectate needs --serve\n");
+		return EXIT_FAILURE;
+	}
+	// Before anything starts counting, and before the terminal is taken over
+	if (metrics_port && !metrics_serve(metrics_port)) return EXIT_FAILURE;
+	if (simulate_n) return simulate(simulate_n);
+	if (versus_where && (serve_port || autoplay || recording || save_path)) {
+		fprintf(stderr, "--versus can't be used with --serve, --autoplay, --record or --save\n");
+		return EXIT_FAILURE;
+	}
+	if (versus_where) return play_versus(versus_where);
+	if (!bot_depth) bot_depth = BOT_DEFAULT_DEPTH;
+	if (save_path && serve_port) {
+		fprintf(stderr, "--save can't be used with --serve\n");
+		return EXIT_FAILURE;
+	}
+	// Before the terminal is taken over, so the error can be seen
+	if (!serve_port && !snapshot_open(&snapshots, save_path)) {
+		perror(save_path ? save_path : "snapshots");
+		return EXIT_FAILURE;
+	}
+	if (serve_port) return run_server(serve_port, spectate_port, thread_count(), fixed_seed ? game_seed : clock_seed(), lean_output);
+
 	tb_init();
+	keyboard_enable();
+	if (lean_output) tb_set_present_mode(TB_PRESENT_LEAN);
+	tb_defer_resize(1); // the event handler pthread only reports resizes, see resize_screen()
 	initialize();
-	
-	double remaining_wait_time_ms = drop_speed, loop_time_taken_ms = 0;
-    struct timespec sleep_ts;
-    clock_t start, stop;
+	if (single_threaded) run_event_loop(); // never returns
+
+	// Frames are scheduled against absolute deadlines on the monotonic clock,
+	// so time spent rendering never pushes gravity back. Input wakes the loop
+	// up in between and is handled straight away.
+	int frame_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (frame_timerfd < 0)
+		quit(EXIT_FAILURE, "Couldn't create timerfd");
+	struct timespec next_frame;
+	clock_gettime(CLOCK_MONOTONIC, &next_frame);
     while (true) {
+        handle_queued_input();
+        check_stats_dump();
         switch (GAME_STATE) {
             case PLAY:
-                start = clock();
-                // Move piece down and re-render to display change (rendering handled in move)
-                move_active_piece(DOWN);
-                stop = clock();
-
-                loop_time_taken_ms = ((double) (stop - start) * 1000.0) / CLOCKS_PER_SEC;
-                remaining_wait_time_ms = drop_speed - loop_time_taken_ms;
-
-				// Sleep if necessary
-                if (remaining_wait_time_ms > 0) {
-                    sleep_ts.tv_sec = ((long) remaining_wait_time_ms) / 1000; // cast is safe to truncate since guaranteed > 0
-                    sleep_ts.tv_nsec = (long) (fmod(remaining_wait_time_ms, 1000.0) * 1000000);
-                    nanosleep(&sleep_ts, &sleep_ts);
-                }
+                // Bring the game up to date and re-render to display any change
+                game_tick();
                 break;
 
             case GAME_OVER:
@@ -55,33 +257,346 @@ int main(void) {
                 quit(EXIT_SUCCESS, "Game over!");
                 break;
         }
+        present_frame(); // picks up anything held back since the last frame
+        wait_for_frame(frame_timerfd, &next_frame);
     }
 	
 	// We should never hit this. Any exit should happen through quit().
 	exit(EXIT_FAILURE);
 }
 
+/* --replay: runs every game in the file through the engine, with no terminal
+ * and no waiting, and reports how each one ended and how long it took
+ */
+int play_replay(const char *path) {
+	replay_reader_t reader;
+	if (!replay_reader_open(&reader, path)) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	static game_t g; // no need for a game_t on the stack
+	replay_status_t status;
+	unsigned games = 0;
+	while (true) {
+		double start_ms = monotonic_ms();
+		status = replay_play_game(&reader, &g);
+		if (status != REPLAY_OK) break;
+		games++;
+		printf("game %u: seed %llu, %s after %.1f s: %u pieces, %u lines (replayed in %.2f ms)\n",
+		       games, (unsigned long long) g.seed, g.over ? "game over" : "quit",
+		       g.time_ms / 1000.0, g.pieces_placed, g.lines_cleared, monotonic_ms() - start_ms);
+	}
+	replay_reader_close(&reader);
+
+	if (status == REPLAY_BAD) {
+		fprintf(stderr, "%s: not a valid replay (game %u)\n", path, games + 1);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* --simulate: plays the games headless (see simulate.c), the CSV to stdout
+ * and how fast it went to stderr
+ */
+int simulate(uint64_t n_games) {
+	simulate_totals_t totals;
+	uint64_t seed = fixed_seed ? game_seed : clock_seed();
+	unsigned threads = thread_count();
+	if (!simulate_games(n_games, seed, threads, bot_depth ? bot_depth : SIMULATE_DEFAULT_DEPTH, STDOUT_FILENO, &totals)) {
+		fprintf(stderr, "Couldn't start the simulation's threads\n");
+		return EXIT_FAILURE;
+	}
+	double s = totals.wall_ms / 1000;
+	fprintf(stderr, "%llu games (%llu topped out) from seed %llu on %u threads in %.2f s: "
+	        "%.1f games/s, %.0f pieces/s, %.1f lines/game\n",
+	        (unsigned long long) totals.games, (unsigned long long) totals.over, (unsigned long long) seed,
+	        threads, s, totals.games / s, totals.pieces / s, totals.games ? (double) totals.lines / totals.games : 0);
+	if (totals.write_failed) {
+		perror("Couldn't write the results");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* --versus: one match against whoever is at the other end (see versus.h),
+ * from a poll() loop of its own on the terminal and the socket. This side's
+ * board is on the left. Returns once the player quits or the other side is
+ * gone.
+ */
+int play_versus(const char *where) {
+	if (!versus_open(&match, where, fixed_seed ? game_seed : clock_seed(), monotonic_ms())) return EXIT_FAILURE;
+	versus_where = where;
+	tb_init();
+	keyboard_enable();
+	if (lean_output) tb_set_present_mode(TB_PRESENT_LEAN);
+	int ttyfd, resizefd;
+	if (tb_get_fds(&ttyfd, &resizefd) != TB_OK) {
+		tb_shutdown();
+		fprintf(stderr, "Couldn't get terminal fds\n");
+		return EXIT_FAILURE;
+	}
+	layout_versus();
+
+	struct pollfd fds[3] = {
+		{.fd = ttyfd, .events = POLLIN},
+		{.fd = resizefd, .events = POLLIN},
+		{.fd = match.fd, .events = POLLIN}
+	};
+	const char *exit_msg = NULL;
+	struct tb_event event;
+	bool drawn_done = false; // what the status line said of versus_done() when last drawn
+	frame_dirty = true;
+	while (!exit_msg) {
+		// Up to the next frame, but never so long that a silent opponent goes
+		// unnoticed, or that a redraw held back below waits past its time
+		double wait_ms = fmin(versus_next_ms(&match) - monotonic_ms(), INPUT_POLL_MS);
+		if (frame_dirty) wait_ms = fmin(wait_ms, last_present_ms + VERSUS_FRAME_MS - monotonic_ms());
+		if (poll(fds, 3, wait_ms > 0 ? (int) ceil(wait_ms) : 0) < 0 && errno != EINTR) {
+			exit_msg = "poll() failed";
+			break;
+		}
+		if ((fds[0].revents | fds[1].revents) & (POLLIN | POLLHUP)) {
+			while (!exit_msg && tb_peek_event(&event, 0) == TB_OK)
+				exit_msg = versus_event(&event);
+		}
+
+		double now_ms = monotonic_ms();
+		if (versus_receive(&match, now_ms)) frame_dirty = true;
+		if (versus_advance(&match, now_ms)) frame_dirty = true;
+		if (!match.over && versus_gone(&match, now_ms)) exit_msg = "Your opponent is gone";
+		if (versus_done(&match, now_ms) != drawn_done) frame_dirty = true;
+
+		// Only when something changed, and as present_frame() does, at most once a frame
+		if (frame_dirty && now_ms - last_present_ms >= VERSUS_FRAME_MS) {
+			drawn_done = versus_done(&match, now_ms);
+			draw_versus(now_ms);
+			tb_present();
+			frame_dirty = false;
+			last_present_ms = now_ms;
+		}
+	}
+
+	keyboard_disable();
+	tb_shutdown();
+	versus_close(&match);
+	printf("Tetris exited: %s\n", exit_msg);
+	return EXIT_SUCCESS;
+}
+
+/* Handles a key (or a resize) in --versus. Returns why to stop, or NULL to
+ * carry on.
+ */
+const char *versus_event(const struct tb_event *event) {
+	frame_dirty = true;
+	if (event->type == TB_EVENT_RESIZE) {
+		layout_versus();
+		return NULL;
+	}
+	if (event->type != TB_EVENT_KEY) return NULL;
+	bool released = event->mod & KEY_MOD_RELEASE;
+	if (!released && (event->key == TB_KEY_ESC || event->key == TB_KEY_CTRL_C || event->ch == 'q')) {
+		if (!match.over) return "Left the match";
+		bool lost = match.confirmed[match.me].over, won = match.confirmed[1 - match.me].over;
+		return lost && won ? "A draw!" : lost ? "You lost!" : "You won!";
+	}
+	int in = key_input(event);
+	if (in >= 0 && match.started && !match.over) versus_input(&match, (input_t) in);
+	return NULL;
+}
+
+// Both boards side by side over the whole screen but the status line
+void layout_versus() {
+	int half = tb_width() / 2, rows = tb_height() - 1;
+	versus_fits = renderer_resize_at(&versus_renderers[0], 0, half, rows, 0);
+	versus_fits &= renderer_resize_at(&versus_renderers[1], half, tb_width() - half, rows, 0);
+	tb_clear();
+	renderer_invalidate(&versus_renderers[0]);
+	renderer_invalidate(&versus_renderers[1]);
+}
+
+/* Draws both games as this side has them. They're re-run from the last
+ * confirmed frame whenever the other player's inputs arrive, so any cell may
+ * have changed: every row is checked against what's on screen.
+ */
+void draw_versus(double now_ms) {
+	int bottom = tb_height() - 1;
+	if (!match.started || !versus_fits) {
+		const char *text = !versus_fits ? "Make the terminal bigger" : match.host ? "Waiting for an opponent on port" : "Calling";
+		tb_clear();
+		tb_printf(0, bottom / 2, TB_WHITE, TB_DEFAULT, "%s %s...", text, versus_fits ? versus_where : "");
+		renderer_invalidate(&versus_renderers[0]);
+		renderer_invalidate(&versus_renderers[1]);
+		return;
+	}
+
+	for (uint8_t i = 0; i < 2; i++) {
+		uint8_t player = i == 0 ? match.me : 1 - match.me;
+		game_t *g = &match.games[player];
+		g->dirty_rows = ~0ULL;
+		renderer_draw(&versus_renderers[i], g);
+		if (match.over) {
+			const char *text = g->over ? " TOPPED OUT " : " WINNER ";
+			draw_board_text(&versus_renderers[i].layout, BOARD_HEIGHT / 2, TB_BLACK, TB_WHITE, text);
+		}
+	}
+
+	// Once over, the result is confirmed when the other side has acked the frames that ended it
+	const char *end = !match.over ? ""
+	                  : !versus_done(&match, now_ms) ? " | confirming, ESC to quit"
+	                  : match.acked >= match.confirmed_frame ? " | result confirmed, ESC to quit" : " | ESC to quit";
+	char status[160];
+	int len = snprintf(status, sizeof(status), "you: %u lines, %u incoming | frame %u, rollback %u (max %u), waits %u, %u B/packet%s",
+	                   match.games[match.me].lines_cleared, match.games[match.me].garbage_in, match.frame, match.rollback,
+	                   match.max_rollback, match.stalls, match.packet_bytes, end);
+	tb_print(0, bottom, TB_WHITE, TB_DEFAULT, status);
+	for (int x = len; x < tb_width(); x++) tb_set_cell(x, bottom, ' ', TB_DEFAULT, TB_DEFAULT);
+}
+
+/* Sleeps until the frame after `next_frame`, or until the event handler
+ * pthread queues some input, whichever comes first. Only a frame that came
+ * due moves `next_frame` on. If the loop has fallen more than a frame behind
+ * (say, the 3-2-1 countdown ran), the schedule restarts from now instead of
+ * rushing through the missed frames.
+ */
+void wait_for_frame(int timerfd, struct timespec *next_frame) {
+	struct timespec due = *next_frame;
+	due.tv_nsec += frame_ns;
+	if (due.tv_nsec >= 1000000000L) {
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000L;
+	}
+	struct itimerspec spec = {.it_value = due};
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, NULL);
+
+	struct pollfd fds[2] = {
+		{.fd = timerfd, .events = POLLIN},
+		{.fd = input_queue.wake_fd, .events = POLLIN}
+	};
+	if (poll(fds, 2, -1) < 0 || !(fds[0].revents & POLLIN)) return; // input (or a signal) came first
+
+	uint64_t expirations;
+	read(timerfd, &expirations, sizeof(expirations));
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	*next_frame = due;
+	if (now.tv_sec - due.tv_sec > 1
+	    || (now.tv_sec - due.tv_sec) * 1000000000L + (now.tv_nsec - due.tv_nsec) > frame_ns)
+		*next_frame = now;
+}
+
+/* Main loop for --single-thread. Instead of a pthread blocking in
+ * tb_poll_event(), the tty and resize fds from tb_get_fds() are polled next
+ * to a timerfd armed for the game's next deadline, so input, gravity and
+ * drawing all happen here.
+ */
+void run_event_loop() {
+	int ttyfd, resizefd;
+	if (tb_get_fds(&ttyfd, &resizefd) != TB_OK)
+		quit(EXIT_FAILURE, "Couldn't get terminal fds");
+
+	int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerfd < 0)
+		quit(EXIT_FAILURE, "Couldn't create timerfd");
+
+	struct pollfd fds[3] = {
+		{.fd = ttyfd, .events = POLLIN},
+		{.fd = resizefd, .events = POLLIN},
+		{.fd = timerfd, .events = POLLIN}
+	};
+	struct tb_event event;
+	while (GAME_STATE != QUIT) {
+		check_stats_dump();
+		arm_tick_timer(timerfd);
+		if (poll(fds, 3, -1) < 0) {
+			if (errno == EINTR) continue;
+			quit(EXIT_FAILURE, "poll() failed");
+		}
+
+		if (fds[2].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(timerfd, &expirations, sizeof(expirations)) > 0 && GAME_STATE == PLAY)
+				game_tick();
+		}
+
+		// termbox reads and parses whatever arrived; drain all of it
+		if ((fds[0].revents | fds[1].revents) & (POLLIN | POLLHUP)) {
+			while (GAME_STATE != QUIT && tb_peek_event(&event, 0) == TB_OK)
+				handle_event(&event, monotonic_ms());
+		}
+		present_frame();
+	}
+	close(timerfd);
+	quit(EXIT_SUCCESS, "Game over!");
+}
+
+/* Arms `timerfd` for the next moment the loop has work: the engine's next
+ * deadline, the next step of a line clear flash, or a present that
+ * present_frame() held back. Disarms it if there's nothing to wait for.
+ */
+void arm_tick_timer(int timerfd) {
+	struct itimerspec spec = {0};
+	double wake_ms = INFINITY;
+	if (GAME_STATE == PLAY) {
+		uint32_t deadline_ms = game_next_deadline(&game);
+		int8_t phase = flash_phase(&game);
+		if (phase >= 0) {
+			uint32_t phase_end_ms = game.clear_until_ms - LINE_CLEAR_DELAY_MS + (phase + 1) * FLASH_DELAY_MS;
+			if (phase_end_ms < deadline_ms) deadline_ms = phase_end_ms;
+		}
+		if (autoplay && !game_clearing(&game) && next_bot_move_ms < deadline_ms)
+			deadline_ms = next_bot_move_ms;
+		wake_ms = game_epoch_ms + deadline_ms;
+	}
+	if (frame_dirty)
+		wake_ms = fmin(wake_ms, last_present_ms + frame_ns / 1000000.0);
+
+	if (wake_ms < INFINITY) {
+		spec.it_value.tv_sec = (time_t) (wake_ms / 1000.0);
+		spec.it_value.tv_nsec = (long) (fmod(wake_ms, 1000.0) * 1000000);
+		if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+			spec.it_value.tv_nsec = 1; // all zeros would disarm it
+	}
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
 // Initializes the resources and thread(s) needed to run the game
 void initialize() {
-	// Seed RNG
-	srand(time(NULL));
-	
-	// handle inadequate window dimensions
-	if ((tb_width() < MIN_WIDTH) || (tb_height() < MIN_HEIGHT))
-		quit(EXIT_FAILURE, "Window dimensions are too small!");
-
 	// Register sigint handler to gracefully shut down
 	signal(SIGINT, sigint_handler);
 
-	// Create mutexes for board and active piece
-	if (pthread_mutex_init(&board_mutex, NULL) || pthread_mutex_init(&active_piece_mutex, NULL))
-		quit(EXIT_FAILURE, "Couldn't initialize mutex");
+	// SIGUSR1 asks for a stats dump. No SA_RESTART, so a poll() waiting on
+	// the main loop wakes up to write it.
+	if (stats_path) {
+		struct sigaction sa = {.sa_handler = sigusr1_handler};
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	// Where the event handler pthread leaves keys for the main loop
+	if (!single_threaded && !input_queue_init(&input_queue))
+		quit(EXIT_FAILURE, "Couldn't create the input queue");
+
+	// The bot's search threads
+	if (autoplay) {
+		if (!pool_init(&bot_pool, thread_count()))
+			quit(EXIT_FAILURE, "Couldn't start the bot's threads");
+		if (!bot_init(&bot, bot_depth, &bot_pool))
+			quit(EXIT_FAILURE, "Couldn't set up the bot");
+	}
 
-	// Spawn pthread for main event handler
-	if (pthread_create(&event_handler_pt, NULL, event_handler_pthread_routine, NULL))
+	// Spawn pthread for main event handler (unless the main loop polls for input itself)
+	if (!single_threaded && pthread_create(&event_handler_pt, NULL, event_handler_pthread_routine, NULL))
 		quit(EXIT_FAILURE, "Failed to create pthread for main loop");
 
-	setup_new_game();
+	// A game left unfinished in --save FILE carries on; anything else starts afresh
+	if (!resume_saved_game()) setup_new_game();
+
+	// A terminal too small for the board waits for the player to make it bigger
+	if (!layout_screen()) {
+		paused_for_size = true;
+		draw_too_small();
+		return;
+	}
 
 	// Make a call to render() the first frame
 	render();
@@ -90,478 +605,495 @@ void initialize() {
 	return;
 }
 
+/* Lays the game out for the terminal's current size (and whether the stats
+ * overlay needs room). Returns whether the board fits.
+ */
+bool layout_screen() {
+	return renderer_resize(&renderer, tb_width(), tb_height(), stats_overlay ? STATS_OVERLAY_WIDTH : 0);
+}
+
+/* The terminal is now w x h. termbox's buffers are resized here, on the
+ * thread that draws (the event handler pthread only reports the new size),
+ * and the layout is worked out again. Only a layout that moved something
+ * gets repainted; otherwise the back buffer is still right and just goes out
+ * again. A game that no longer fits pauses until it does.
+ */
+void resize_screen(int w, int h) {
+	tb_resize(w, h);
+	if (!layout_screen()) {
+		if (GAME_STATE == PLAY) {
+			pause_game();
+			paused_for_size = true;
+		}
+		draw_too_small();
+		return;
+	}
+
+	render();
+	if (GAME_STATE == GAME_OVER) draw_game_over();
+	if (paused_for_size) {
+		paused_for_size = false;
+		resume_game();
+	}
+}
+
+// What shows instead of the board while the terminal is too small for it
+void draw_too_small() {
+	tb_clear();
+	tb_printf(0, 0, TB_WHITE, TB_RED, "Too small! Need %dx%d", MIN_WIDTH, MIN_HEIGHT);
+	frame_dirty = true;
+}
+
 // Sets the board to all black and creates a fresh active piece
 void setup_new_game() {
-	pthread_mutex_lock(&board_mutex);
-	// Initialize the board to all black
-    for (uint8_t i = 0; i < BOARD_WIDTH; i++) {
-        for (uint8_t j = 0; j < BOARD_HEIGHT; j++) {
-            board[i][j] = TB_BLACK;
-        }
-    }
-	pthread_mutex_unlock(&board_mutex);
+	if (!fixed_seed) game_seed = clock_seed();
+	game_init(&game, game_seed);
+	if (recording) replay_begin_game(&recorder, game_seed);
+	bot.planned = false;
+	next_bot_move_ms = 0;
+	renderer_invalidate(&renderer); // clears away the game over screen, too
+	// New games sit at time 0 until the countdown is over
+	game_epoch_ms = paused_at_ms = monotonic_ms();
+	clock_paused = true;
+	snapshot_reset(&snapshots);
+	snapshot_take(&snapshots, &game);
+}
+
+/* Swaps `g` in for the current game, with the clock stopped at its time
+ * until the countdown (resume_game()) runs
+ */
+void restore_game(const game_t *g) {
+	game = *g;
+	game.events = 0;
+	game.held = 0; // whatever was held then isn't necessarily held now
+	game.dirty_rows = ~(uint64_t) 0;
+	bot.planned = false;
+	next_bot_move_ms = game.time_ms;
+	shown_flash_phase = -1;
+	renderer_invalidate(&renderer);
+	paused_at_ms = monotonic_ms();
+	game_epoch_ms = paused_at_ms - game.time_ms;
+	clock_paused = true;
+}
+
+/* Picks up the game --save FILE was left with, if it wasn't over. It isn't
+ * recorded: a replay has to start from the game's first piece.
+ */
+bool resume_saved_game() {
+	game_t saved;
+	if (!save_path || !snapshot_latest(&snapshots, &saved) || saved.over) return false;
+	if (fixed_seed && saved.seed != game_seed) return false; // --seed asked for a different game
+	restore_game(&saved);
+	return true;
+}
 
-	create_new_active_piece();
+/* 'u': takes back the last piece placed (or, from the game over screen, the
+ * one that ended it), and counts down into the game from the moment it
+ * spawned. Not while recording, since a replay can only go forwards, nor in
+ * --autoplay.
+ */
+void undo_piece() {
+	game_t prev;
+	if (recording || autoplay || !snapshot_rewind(&snapshots, &game, &prev)) return;
+	if (GAME_STATE == PLAY) pause_game();
+	else GAME_STATE = PAUSE;
+	restore_game(&prev);
+	render();
+	resume_game();
+}
+
+// A seed for when none was given: the time of day, in ns
+uint64_t clock_seed() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// --threads, or one thread per CPU
+unsigned thread_count() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return n_threads ? n_threads : (cpus > 0 ? cpus : 1);
+}
+
+/* Game time (ms) for the engine: the monotonic clock since the game began,
+ * minus any time spent paused
+ */
+uint32_t game_clock_ms() {
+	double now_ms = clock_paused ? paused_at_ms : monotonic_ms();
+	return (uint32_t) (now_ms - game_epoch_ms);
+}
+
+void pause_clock() {
+	if (!clock_paused) {
+		paused_at_ms = monotonic_ms();
+		clock_paused = true;
+	}
+}
+
+void resume_clock() {
+	if (clock_paused) {
+		game_epoch_ms += monotonic_ms() - paused_at_ms;
+		clock_paused = false;
+	}
 }
 
 /* Routine for a pthread to execute. As long as this pthread is alive, its loop will
- * continually poll termbox for events (including keyboard input) and handle them appropriately.
+ * continually poll termbox for events (including keyboard input) and queue them,
+ * stamped with when they arrived, for the main loop to handle. It never touches
+ * the game, so nothing the two threads share needs a lock.
  * Intended to stay alive as long as the program does.
  * 
- * Set GAME_STATE to QUIT to signal for this routine to exit
+ * Set input_stopping to signal for this routine to exit
  */
 void *event_handler_pthread_routine(void *args) {
 	(void)args; // Surpress unused parameter warning
+	// SIGUSR1 is for the main loop, which has to wake up to dump the stats
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
 	struct tb_event event = {0};
-	while (GAME_STATE != QUIT) {
-		tb_poll_event(&event);
-
-		// Handle keyboard
-        if (event.type == TB_EVENT_KEY) {
-			switch (GAME_STATE) {
-				case PLAY:
-					switch (event.key) {
-						case TB_KEY_CTRL_C:
-						case TB_KEY_ESC:
-							GAME_STATE = QUIT;
-							break;
-						case TB_KEY_ARROW_LEFT:
-							move_active_piece(LEFT);
-							break;
-						case TB_KEY_ARROW_RIGHT:
-							move_active_piece(RIGHT);
-							break;
-						case TB_KEY_ARROW_DOWN:
-							move_active_piece(DOWN);
-							break;
-						case TB_KEY_ARROW_UP:
-							rotate_active_piece();
-							break;
-						case TB_KEY_SPACE:
-							hard_drop_active_piece();
-							break;
-					}
-					switch (event.ch) {
-						case 'p':
-						case 'P':
-							pause_game();
-							break;
-						case ' ':
-							hard_drop_active_piece();
-							break;
-					}
-					break;
-
-				case GAME_OVER:
-					switch (event.key) {
-						case TB_KEY_ENTER:
-							setup_new_game();
-							render();
-							resume_game();
-							break;
-						case TB_KEY_CTRL_C:
-                        case TB_KEY_ESC:
-                            GAME_STATE = QUIT;
-                            break;
-					}
-					break;
-
-				case PAUSE:
-					switch (event.ch) {
-                        case 'p':
-                        case 'P':
-                            resume_game();
-                            break;
-                    }
+	while (!atomic_load(&input_stopping)) {
+		// Wakes up now and then to check whether it should stop
+		if (tb_peek_event(&event, INPUT_POLL_MS) != TB_OK) continue;
+		input_queue_push(&input_queue, &event, monotonic_ms()); // a full queue drops keys: nobody types that fast
+	}
+	pthread_exit(NULL);
+}
+
+/* Handles everything the event handler pthread has queued up (a burst of key
+ * repeats, say) before the main loop shows the result once
+ */
+void handle_queued_input() {
+	if (single_threaded) return;
+	queued_input_t in;
+	while (GAME_STATE != QUIT && input_queue_pop(&input_queue, &in))
+		handle_event(&in.event, in.at_ms);
+}
+
+// Handles one termbox event (keyboard input), read at `at_ms` on the
+// monotonic clock, according to the game state
+void handle_event(struct tb_event *event, double at_ms) {
+	if (event->type == TB_EVENT_RESIZE) {
+		resize_screen(event->w, event->h);
+		return;
+	}
+
+	// Released keys go through whatever the game state: a key let go
+	// while paused mustn't still be held when play resumes
+	if (event->type == TB_EVENT_KEY && (event->mod & KEY_MOD_RELEASE)) {
+		int in = key_input(event);
+		if (in >= 0) player_input((input_t) in, at_ms);
+		return;
+	}
+
+	// Handle keyboard
+	if (event->type == TB_EVENT_KEY) {
+		switch (GAME_STATE) {
+			case PLAY: {
+				int in = key_input(event);
+				if (in >= 0) player_input((input_t) in, at_ms);
+				switch (event->key) {
+					case TB_KEY_CTRL_C:
+					case TB_KEY_ESC:
+						GAME_STATE = QUIT;
+						break;
+				}
+				switch (event->ch) {
+					case 'p':
+					case 'P':
+						pause_game();
+						break;
+					case 'i':
+					case 'I':
+						toggle_stats_overlay();
+						break;
+					case 'u':
+					case 'U':
+						undo_piece();
+						break;
+				}
+				break;
 			}
+
+			case GAME_OVER:
+				switch (event->key) {
+					case TB_KEY_ENTER:
+						setup_new_game();
+						render();
+						resume_game();
+						break;
+					case TB_KEY_CTRL_C:
+					case TB_KEY_ESC:
+						GAME_STATE = QUIT;
+						break;
+				}
+				if (event->ch == 'u' || event->ch == 'U') undo_piece();
+				break;
+
+			case PAUSE:
+				switch (event->ch) {
+					case 'p':
+					case 'P':
+						resume_game();
+						break;
+				}
+				break;
+
+			case QUIT:
+				break;
 		}
 	}
-	pthread_exit(NULL);
 }
 
-/* draws a square(ish) block of `color` at x,y in GAME GRID COORDINATES */
-void draw_block(int x, int y, uintattr_t color) {
-	// x coordinate is doubled since each "block" is 2 chars wide
-	tb_print(2 * (x+1), y+1, color, TB_BLACK, "██"); // add one to account for frame
+/* The input a key event is in play (arrows and space), or -1 for none.
+ * Left, right and down can be held: once the terminal reports key releases,
+ * a press holds the key down in the engine, which repeats it on its own
+ * clock (see DAS_MS), so the terminal's repeats are dropped. Otherwise every
+ * key event is one tap, repeats and all. Releases of anything else are -1.
+ */
+int key_input(const struct tb_event *event) {
+	bool held = keyboard_reports_releases();
+	if (event->mod & KEY_MOD_RELEASE) {
+		switch (event->key) {
+			case TB_KEY_ARROW_LEFT: return INPUT_RELEASE_LEFT;
+			case TB_KEY_ARROW_RIGHT: return INPUT_RELEASE_RIGHT;
+			case TB_KEY_ARROW_DOWN: return INPUT_RELEASE_SOFT_DROP;
+		}
+		return -1;
+	}
+	bool repeat = event->mod & KEY_MOD_REPEAT;
+	switch (event->key) {
+		case TB_KEY_ARROW_LEFT: return !held ? INPUT_LEFT : repeat ? -1 : INPUT_PRESS_LEFT;
+		case TB_KEY_ARROW_RIGHT: return !held ? INPUT_RIGHT : repeat ? -1 : INPUT_PRESS_RIGHT;
+		case TB_KEY_ARROW_DOWN: return !held ? INPUT_SOFT_DROP : repeat ? -1 : INPUT_PRESS_SOFT_DROP;
+		case TB_KEY_ARROW_UP: return INPUT_ROTATE;
+		case TB_KEY_SPACE: return INPUT_HARD_DROP;
+	}
+	return event->ch == ' ' ? INPUT_HARD_DROP : -1;
 }
 
+// The digits are drawn at fixed cells near the top left of the board
+_Static_assert(BOARD_WIDTH >= 7 && BOARD_HEIGHT >= 15, "the countdown needs at least a 7x15 board");
+
 void show_321_countdown() {
+	const layout_t *l = &renderer.layout;
 	// 3
-	draw_block(3,5,TB_RED); draw_block(4,5,TB_RED); draw_block(5,5,TB_RED);
-	draw_block(6,6,TB_RED); draw_block(6,7,TB_RED); draw_block(6,8,TB_RED);
-	draw_block(4,9,TB_RED); draw_block(5,9,TB_RED); draw_block(6,10,TB_RED);
-	draw_block(6,11,TB_RED); draw_block(6,12,TB_RED); draw_block(6,13,TB_RED);
-	draw_block(3,14,TB_RED); draw_block(4,14,TB_RED); draw_block(5,14,TB_RED);
+	draw_block(l,3,5,TB_RED); draw_block(l,4,5,TB_RED); draw_block(l,5,5,TB_RED);
+	draw_block(l,6,6,TB_RED); draw_block(l,6,7,TB_RED); draw_block(l,6,8,TB_RED);
+	draw_block(l,4,9,TB_RED); draw_block(l,5,9,TB_RED); draw_block(l,6,10,TB_RED);
+	draw_block(l,6,11,TB_RED); draw_block(l,6,12,TB_RED); draw_block(l,6,13,TB_RED);
+	draw_block(l,3,14,TB_RED); draw_block(l,4,14,TB_RED); draw_block(l,5,14,TB_RED);
 	tb_present();
 	sleep(1);
 
 	// 2
 	for (uint8_t i = 2; i < BOARD_WIDTH; i++) {
         for (uint8_t j = 3; j < BOARD_HEIGHT; j++) {
-            draw_block(i, j, TB_BLACK);
+            draw_block(l, i, j, TB_BLACK);
         }
     }
-	draw_block(3,6,TB_YELLOW); draw_block(4,6,TB_YELLOW); draw_block(5,6,TB_YELLOW);
-	draw_block(6,7,TB_YELLOW); draw_block(6,8,TB_YELLOW); draw_block(6,9,TB_YELLOW);
-	draw_block(5,10,TB_YELLOW); draw_block(4,11,TB_YELLOW); draw_block(3,12,TB_YELLOW);
-	draw_block(3,13,TB_YELLOW); draw_block(4,13,TB_YELLOW); draw_block(5,13,TB_YELLOW);
-	draw_block(6,13,TB_YELLOW);
+	draw_block(l,3,6,TB_YELLOW); draw_block(l,4,6,TB_YELLOW); draw_block(l,5,6,TB_YELLOW);
+	draw_block(l,6,7,TB_YELLOW); draw_block(l,6,8,TB_YELLOW); draw_block(l,6,9,TB_YELLOW);
+	draw_block(l,5,10,TB_YELLOW); draw_block(l,4,11,TB_YELLOW); draw_block(l,3,12,TB_YELLOW);
+	draw_block(l,3,13,TB_YELLOW); draw_block(l,4,13,TB_YELLOW); draw_block(l,5,13,TB_YELLOW);
+	draw_block(l,6,13,TB_YELLOW);
 	tb_present();
 	sleep(1);
 
 	// 1
 	for (uint8_t i = 2; i < BOARD_WIDTH; i++) {
         for (uint8_t j = 3; j < BOARD_HEIGHT; j++) {
-            draw_block(i, j, TB_BLACK);
+            draw_block(l, i, j, TB_BLACK);
         }
     }
-	draw_block(5,5,TB_GREEN); draw_block(5,6,TB_GREEN); draw_block(4,6,TB_GREEN);
-	draw_block(3,7,TB_GREEN); draw_block(4,7,TB_GREEN); draw_block(5,7,TB_GREEN);
-	draw_block(4,8,TB_GREEN); draw_block(5,8,TB_GREEN); draw_block(4,9,TB_GREEN); 
-	draw_block(5,9,TB_GREEN); draw_block(4,10,TB_GREEN); draw_block(5,10,TB_GREEN);
-	draw_block(4,11,TB_GREEN); draw_block(5,11,TB_GREEN); draw_block(4,12,TB_GREEN);
-	draw_block(5,12,TB_GREEN); draw_block(4,13,TB_GREEN); draw_block(5,13,TB_GREEN);
-	draw_block(3,14,TB_GREEN); draw_block(4,14,TB_GREEN); draw_block(5,14,TB_GREEN);
-	draw_block(6,14,TB_GREEN);
+	draw_block(l,5,5,TB_GREEN); draw_block(l,5,6,TB_GREEN); draw_block(l,4,6,TB_GREEN);
+	draw_block(l,3,7,TB_GREEN); draw_block(l,4,7,TB_GREEN); draw_block(l,5,7,TB_GREEN);
+	draw_block(l,4,8,TB_GREEN); draw_block(l,5,8,TB_GREEN); draw_block(l,4,9,TB_GREEN); 
+	draw_block(l,5,9,TB_GREEN); draw_block(l,4,10,TB_GREEN); draw_block(l,5,10,TB_GREEN);
+	draw_block(l,4,11,TB_GREEN); draw_block(l,5,11,TB_GREEN); draw_block(l,4,12,TB_GREEN);
+	draw_block(l,5,12,TB_GREEN); draw_block(l,4,13,TB_GREEN); draw_block(l,5,13,TB_GREEN);
+	draw_block(l,3,14,TB_GREEN); draw_block(l,4,14,TB_GREEN); draw_block(l,5,14,TB_GREEN);
+	draw_block(l,6,14,TB_GREEN);
 	tb_present();
 	sleep(1);
+
+	// The countdown drew all over the board
+	renderer_invalidate(&renderer);
 }
 
-/* Re-renders everything on the screen
+/* Brings the back buffer up to date with the game. Only what changed since the
+ * last call gets redrawn (see renderer_draw()). Nothing reaches the terminal
+ * until present_frame().
  */
-// SHOULD BE [MOSTLY] THREAD SAFE
 void render() {
-	pthread_mutex_lock(&board_mutex);
-	pthread_mutex_lock(&active_piece_mutex);
-	tb_clear();
-	// The order in which things get rendered is important!
-	// Draw the outside frame of the board
-    for (int i = -1; i <= BOARD_WIDTH; i++) {
-        draw_block(i, -1, TB_WHITE); // Top row
-        draw_block(i, BOARD_HEIGHT, TB_WHITE); // Bottom row
-    }
-    for (int i = 0; i < BOARD_HEIGHT; i++) {
-        draw_block(-1, i, TB_WHITE); // left
-        draw_block(BOARD_WIDTH, i, TB_WHITE); // right
-    }
-
-    // Draw the board
-    for (uint8_t i = 0; i < BOARD_WIDTH; i++) {
-        for (uint8_t j = 0; j < BOARD_HEIGHT; j++) {
-            draw_block(i, j, board[i][j]);
-        }
-    }
+	double start_ms = monotonic_ms();
+	renderer_draw(&renderer, &game);
+	histogram_record(&draw_time, (monotonic_ms() - start_ms) * 1000);
+	if (stats_overlay) draw_stats_overlay();
+	frame_dirty = true;
+}
 
-    // Draw active piece
-    for (uint8_t i = 0; i < 4; i++) {
-		if (active_piece.blocks[i].y >= 0) // Don't draw blocks that are above the board (negative y)
-        	draw_block(active_piece.blocks[i].x, active_piece.blocks[i].y, active_piece.color);
-    }
-	tb_present();
-	pthread_mutex_unlock(&active_piece_mutex);
-	pthread_mutex_unlock(&board_mutex);
-    return;
-}
-
-const piece_t I_BLOCK_SINGLETON = { .color = TB_CYAN, .blocks = {{.x=4, .y=0},
-                                                                 {.x=3, .y=0},
-                                                                 {.x=5, .y=0},
-                                                                 {.x=6, .y=0}}};
-
-const piece_t L_BLOCK_SINGLETON = { .color = TB_YELLOW, .blocks = {{.x=4, .y=0},
-                                                                   {.x=5, .y=0},
-                                                                   {.x=3, .y=0},
-                                                                   {.x=3, .y=1}}};
-
-const piece_t J_BLOCK_SINGLETON = { .color = TB_BLUE, .blocks = {{.x=4, .y=0},
-                                                                 {.x=3, .y=0},
-                                                                 {.x=5, .y=0},
-                                                                 {.x=5, .y=1}}};
-
-const piece_t O_BLOCK_SINGLETON = { .color = TB_RED, .blocks = {{.x=4, .y=0},
-                                                                {.x=4, .y=1},
-                                                                {.x=5, .y=0},
-                                                                {.x=5, .y=1}}};
-
-const piece_t S_BLOCK_SINGLETON = { .color = TB_GREEN, .blocks = {{.x=4, .y=0},
-                                                                  {.x=5, .y=0},
-                                                                  {.x=3, .y=1},
-                                                                  {.x=4, .y=1}}};
-
-const piece_t Z_BLOCK_SINGLETON = { .color = TB_MAGENTA, .blocks = {{.x=4, .y=0},
-                                                                    {.x=3, .y=0},
-                                                                    {.x=4, .y=1},
-                                                                    {.x=5, .y=1}}};
-
-const piece_t T_BLOCK_SINGLETON = { .color = TB_WHITE, .blocks = {{.x=4, .y=0},
-                                                                  {.x=5, .y=0},
-                                                                  {.x=3, .y=0},
-                                                                  {.x=4, .y=1}}};
-
-const piece_t BLOCK_TYPE_NAMES[7] = {I_BLOCK_SINGLETON, L_BLOCK_SINGLETON, J_BLOCK_SINGLETON,
-                                O_BLOCK_SINGLETON, S_BLOCK_SINGLETON, Z_BLOCK_SINGLETON, 
-								T_BLOCK_SINGLETON};
-
-// THREAD SAFE
-void create_new_active_piece() {
-	pthread_mutex_lock(&active_piece_mutex);
-
-	int i = rand() % 7; // 7 pieces, semi-rand int in set {x | 0 <= x < 7}
-	
-	active_piece = BLOCK_TYPE_NAMES[i]; // copy value, not reference, so this is fine
-
-	// Check to make sure the new piece isn't on top of any existing "settled" ones
-	// If so, it's a game over.
-	bool game_over_happens = false;
-	pthread_mutex_lock(&board_mutex);
-	for (uint8_t i = 0; i < 4; i++) {
-		if (board[active_piece.blocks[i].x][active_piece.blocks[i].y] != TB_BLACK) {
-			game_over_happens = true;
+/* Flushes the back buffer to the terminal if anything was drawn, but no more
+ * than once per frame interval. A frame that comes in too soon stays dirty
+ * for the next frame tick, so bursts of moves cost one flush, not one each.
+ */
+void present_frame() {
+	double now_ms = monotonic_ms();
+	if (frame_dirty && now_ms - last_present_ms >= frame_ns / 1000000.0) {
+		tb_present();
+		double shown_ms = monotonic_ms();
+		histogram_record(&present_time, (shown_ms - now_ms) * 1000);
+		histogram_record(&frame_bytes, tb_present_bytes());
+		metrics_add(METRIC_PRESENTS, 1);
+		metrics_add(METRIC_PRESENT_BYTES, tb_present_bytes());
+		for (uint8_t i = 0; i < n_pending_inputs; i++) {
+			histogram_record(&input_latency, (shown_ms - pending_inputs_ms[i]) * 1000);
+			metrics_latency((shown_ms - pending_inputs_ms[i]) * 1000);
 		}
+		n_pending_inputs = 0;
+		frame_dirty = false;
+		last_present_ms = now_ms;
 	}
-	pthread_mutex_unlock(&board_mutex);
-	pthread_mutex_unlock(&active_piece_mutex);
-	
-	render();
-	if (game_over_happens) game_over();
 }
 
-/* Moves the active piece in the direction specified
- * returns true if the piece is still in play after the move
- * returns false if the piece "settled" on the board after the move
+/* A key press from the player, made at `at_ms` on the monotonic clock. The
+ * bot has the controls in autoplay. One that changed the game is timed until
+ * the present that shows it.
  */
-// THREAD SAFE
-bool move_active_piece(direc_t d) {
-	block_t new_blocks[4];
-	int8_t new_x=0, new_y=0;
-
-	pthread_mutex_lock(&active_piece_mutex);
-	pthread_mutex_lock(&board_mutex); // not writing to board, but want to make sure it doesn't change
-	// Check for each block in the piece if the new positions are valid
-	for (uint8_t i = 0; i < 4; i++) {
-		switch (d) {
-			case LEFT:
-				new_x = active_piece.blocks[i].x - 1;
-                new_y = active_piece.blocks[i].y; // y doesn't change
-
-                // Make sure moving left wouldn't put us through the left wall or in an already occupied space
-                if (new_x < 0 || (new_y >= 0 && board[new_x][new_y] != TB_BLACK)) {
-					pthread_mutex_unlock(&board_mutex);
-					pthread_mutex_unlock(&active_piece_mutex);
-                    return true; // This is a "valid" move, but the piece doesn't change positions
-                }
-				break;
-
-			case RIGHT:
-				new_x = active_piece.blocks[i].x + 1;
-                new_y = active_piece.blocks[i].y; // y doesn't change
-                if (new_x >= BOARD_WIDTH || (new_y >= 0 && board[new_x][new_y] != TB_BLACK)) {
-					pthread_mutex_unlock(&board_mutex);
-                    pthread_mutex_unlock(&active_piece_mutex);
-                    return true; // This is a "valid" move, but the piece doesn't change positions
-                }
-				break;
-
-			case DOWN:
-				new_x = active_piece.blocks[i].x; // x doesn't change
-                new_y = active_piece.blocks[i].y + 1;
-				if (new_y >= BOARD_HEIGHT || (new_y >= 0 && board[new_x][new_y] != TB_BLACK)) {
-					pthread_mutex_unlock(&board_mutex);
-                    pthread_mutex_unlock(&active_piece_mutex);
-					settle_active_piece(); // Render is handled by this function call
-					return false; // Piece hit the bottom of the board or another "settled" piece
-				}
-				break;
-		}
-		new_blocks[i].x = new_x;
-    	new_blocks[i].y = new_y;
-	}
-    pthread_mutex_unlock(&board_mutex);
+void player_input(input_t in, double at_ms) {
+	if (autoplay || !apply_input(in)) return;
+	if (n_pending_inputs < MAX_PENDING_INPUTS) pending_inputs_ms[n_pending_inputs++] = at_ms;
+}
 
-	// All guard clauses passed: move to new positions
-	for (uint8_t i = 0; i < 4; i++) {
-		active_piece.blocks[i] = new_blocks[i];
-	}
-	pthread_mutex_unlock(&active_piece_mutex);
-	render();
-	return true;
+// Returns whether the game changed (and so gets redrawn)
+bool apply_input(input_t in) {
+	// The engine hides the next piece while lines flash: shifts and
+	// rotations still go through as pre-moves, but drops are ignored
+	uint32_t now_ms = game_clock_ms();
+	game_update(&game, now_ms);
+	game_apply_input(&game, in);
+	if (recording) replay_record(&recorder, now_ms, in);
+	bool changed = game.events != 0;
+	handle_game_events();
+	if (snapshot_due(&snapshots, &game)) snapshot_take(&snapshots, &game);
+	return changed;
 }
 
-void rotate_active_piece() {
-	block_t new_blocks[3]; // First block (center) always stays fixed
-
-	pthread_mutex_lock(&active_piece_mutex);
-
-	// We can determine piece type by color
-	// I-Block (line piece) and O-Block (Square) have special rotations,
-	// But all others rotate clockwise around their center (defined as the first block index)
-	block_t center = active_piece.blocks[0];
-	int8_t rel_x, rel_y;
-	switch (active_piece.color) {
-		case TB_CYAN:
-			// Follows rotation for I-Block seen on freetetris.org
-			if (center.y == active_piece.blocks[1].y) {
-				// Line piece is horizontal. Make it vertical.
-				new_blocks[0].x = center.x; new_blocks[0].y = center.y-1; 
-                new_blocks[1].x = center.x; new_blocks[1].y = center.y+1;
-				new_blocks[2].x = center.x; new_blocks[2].y = center.y+2;
-			}
-			else {
-				// Line is vertical. Make it horizontal
-				new_blocks[0].x = center.x-1; new_blocks[0].y = center.y;
-                new_blocks[1].x = center.x+1; new_blocks[1].y = center.y;
-                new_blocks[2].x = center.x+2; new_blocks[2].y = center.y;
-			}
-			break;
+/* Runs gravity and lock delay up to the current game time, then redraws if
+ * anything changed (including the line clear flash moving on a step)
+ */
+void game_tick() {
+	uint32_t now_ms = game_clock_ms(), due_ms = game_next_deadline(&game);
+	if (now_ms >= due_ms)
+		histogram_record(&tick_jitter, (monotonic_ms() - (game_epoch_ms + due_ms)) * 1000);
+	game_update(&game, now_ms);
+	int8_t phase = flash_phase(&game);
+	bool flash_moved_on = (phase != shown_flash_phase);
+	shown_flash_phase = phase;
+
+	if (flash_moved_on) render();
+	handle_game_events();
+	if (snapshot_due(&snapshots, &game)) snapshot_take(&snapshots, &game);
+	if (autoplay) autoplay_tick();
+}
 
-		case TB_RED:
-			// O-Block has no rotations. Skip.
-			pthread_mutex_unlock(&active_piece_mutex);
-			return;
-			break;
+/* Lets the bot make its next move, at most one every BOT_MOVE_MS so it can
+ * be watched
+ */
+void autoplay_tick() {
+	uint32_t now_ms = game_clock_ms();
+	bool due = GAME_STATE == PLAY && !game.over && !game_clearing(&game) && now_ms >= next_bot_move_ms;
+	if (!due) return;
+
+	int in = bot_next_input(&bot, &game);
+	next_bot_move_ms = now_ms + BOT_MOVE_MS;
+	if (in >= 0) apply_input((input_t) in);
+}
 
-		default:
-			// For the non-center blocks, rotate around center clockwise
-			// Follows 2D rotation for Theta=-90 degrees
-			for (uint8_t i = 1; i < 4; i++) {
-				rel_x = active_piece.blocks[i].x - center.x;
-				rel_y = active_piece.blocks[i].y - center.y;
-				new_blocks[i-1].x = center.x - rel_y;
-				new_blocks[i-1].y = center.y + rel_x;
-			}
-			break;
-	}
+/* Reacts to whatever the engine reported since the last call:
+ * re-renders, and shows the game over screen
+ */
+void handle_game_events() {
+	uint8_t events = game.events;
+	game.events = 0;
+	if ((events & GAME_EVENT_OVER) && recording) replay_end_game(&recorder, game.time_ms);
 
-	// Make sure new rotation doesn't end up inside another settled piece or outside the board
-	// rotations that end up above the board are fine.
-	pthread_mutex_lock(&board_mutex);
-	for (uint8_t i = 0; i < 3; i++) {
-        if ((new_blocks[i].y >= 0 && board[new_blocks[i].x][new_blocks[i].y] != TB_BLACK) 
-             || (new_blocks[i].y >= BOARD_HEIGHT) 
-             || (new_blocks[i].x < 0)
-             || (new_blocks[i].x >= BOARD_WIDTH)) {
-			pthread_mutex_unlock(&board_mutex);
-			pthread_mutex_unlock(&active_piece_mutex);
-            return;
-		}
-    }
-	pthread_mutex_unlock(&board_mutex);
+	if (events == 0) return;
+	render();
+	if (events & GAME_EVENT_OVER) game_over();
+}
 
-	// All guard clauses passed: move to new positions
-    for (uint8_t i = 0; i < 3; i++) {
-        active_piece.blocks[i+1] = new_blocks[i]; // Skip first block (center)
-    }
-    pthread_mutex_unlock(&active_piece_mutex);
-    render();
+/* 'i': shows or hides the histograms beside the board. The layout makes room
+ * for them (which may move the board). Hiding them takes a full redraw, since
+ * the renderer only knows about the board.
+ */
+void toggle_stats_overlay() {
+	stats_overlay = !stats_overlay;
+	layout_screen();
+	if (!stats_overlay) renderer_invalidate(&renderer);
+	render();
 }
 
-void hard_drop_active_piece() {
-	while (move_active_piece(DOWN)) {
-		continue;
+// Percentiles (in ms, or bytes for frames) of every histogram, if the layout found room
+void draw_stats_overlay() {
+	const struct { const char *name; const histogram_t *h; } rows[] = {
+		{"key->present", &input_latency},
+		{"tick jitter", &tick_jitter},
+		{"draw", &draw_time},
+		{"present", &present_time}
+	};
+	const layout_t *l = &renderer.layout;
+	if (!l->side) return;
+	tb_printf(l->side_x, l->side_y, TB_WHITE, TB_BLACK, "%-13s%8s%8s%8s", "ms", "p50", "p99", "max");
+	for (uint8_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+		const histogram_t *h = rows[i].h;
+		tb_printf(l->side_x, l->side_y + 1 + i, TB_WHITE, TB_BLACK, "%-13s%8.2f%8.2f%8.2f", rows[i].name,
+		          histogram_percentile(h, 50) / 1000.0, histogram_percentile(h, 99) / 1000.0, h->max_us / 1000.0);
 	}
-	return;
-} 
+	int y = l->side_y + 1 + sizeof(rows) / sizeof(rows[0]);
+	tb_printf(l->side_x, y, TB_WHITE, TB_BLACK, "%-13s%8llu%8llu%8llu", "bytes/frame",
+	          (unsigned long long) histogram_percentile(&frame_bytes, 50),
+	          (unsigned long long) histogram_percentile(&frame_bytes, 99), (unsigned long long) frame_bytes.max_us);
+}
 
-/* "Settles" the active piece by writing its current position
- * to the board and creating a new active piece,
- * clearing lines if necessary
- */
-// THREAD SAFE
-void settle_active_piece() {
-	pthread_mutex_lock(&active_piece_mutex);
-    pthread_mutex_lock(&board_mutex);
-	int8_t lines_to_clear[4] = {-1, -1, -1, -1}; // Array of y-values to clear. -1 indicates no line.
-	for (uint8_t i = 0; i < 4; i++) {
-		if (active_piece.blocks[i].y < 0) {
-			// Game over
-			pthread_mutex_unlock(&active_piece_mutex);
-    		pthread_mutex_unlock(&board_mutex);	
-			render();
-			game_over();
-			return;	
-		}
-		board[active_piece.blocks[i].x][active_piece.blocks[i].y] = active_piece.color;
-
-		// Check to see if the row/line is now full
-		for (uint8_t col = 0; col < BOARD_WIDTH; col++) {
-			// If the board is black, there is no piece (line is not full)
-			if (board[col][active_piece.blocks[i].y] == TB_BLACK) break;
-			
-			// If the last block isn't black and we're still going, clear the line
-			else if (col == BOARD_WIDTH - 1) {
-				lines_to_clear[i] = active_piece.blocks[i].y;
-			}
+// Appends every histogram to --stats FILE as one block of lines
+void dump_stats(const char *why) {
+	if (!stats_path) return;
+	FILE *out = fopen(stats_path, "a");
+	if (!out) return;
+	fprintf(out, "# tetris stats (%s) at %lld\n", why, (long long) time(NULL));
+	histogram_print(&input_latency, "input_latency", out);
+	histogram_print(&tick_jitter, "tick_jitter", out);
+	histogram_print(&draw_time, "draw_time", out);
+	histogram_print(&present_time, "present_time", out);
+	histogram_print(&frame_bytes, "frame_bytes", out);
+	// Once the arenas have grown to the biggest search, mallocs stops going up
+	if (autoplay) {
+		unsigned long long mallocs = 0, probes = 0, hits = 0;
+		for (unsigned i = 0; i < bot.n_threads; i++) {
+			mallocs += bot.threads[i].arena.mallocs;
+			probes += bot.threads[i].tt_probes;
+			hits += bot.threads[i].tt_hits;
 		}
+		fprintf(out, "bot_arena resets=%llu peak_bytes=%zu mallocs=%llu\n",
+		        (unsigned long long) bot.threads[0].arena.resets, bot.arena_peak, mallocs);
+		fprintf(out, "bot_tt probes=%llu hits=%llu\n", probes, hits);
 	}
+	fclose(out);
+}
 
-	// If there are no lines to clear, skip this block
-	if (!(lines_to_clear[0] == -1 && lines_to_clear[1] == -1 && lines_to_clear[2] == -1 && lines_to_clear[3] == -1)) {
-		const long FLASH_DELAY_MS = 250; // Always less than 1 sec (1000 ms)
-		struct timespec sleep_ts;
-		sleep_ts.tv_sec = 0;
-        sleep_ts.tv_nsec = FLASH_DELAY_MS * 1000000;
-
-		// Color the lines all white
-		for (uint8_t i = 0; i < 4; i++) {
-			if (lines_to_clear[i] == -1) continue;
-
-			for (uint8_t col = 0; col < BOARD_WIDTH; col++) {
-				draw_block(col, lines_to_clear[i], TB_WHITE);
-			}
-		}
-		tb_present();
-
-		nanosleep(&sleep_ts, &sleep_ts);
-
-		// Color the lines their board color
-        for (uint8_t i = 0; i < 4; i++) {
-            if (lines_to_clear[i] == -1) continue;
-
-            for (uint8_t col = 0; col < BOARD_WIDTH; col++) {
-                draw_block(col, lines_to_clear[i], board[col][lines_to_clear[i]]);
-            }
-        }
-		tb_present();
-
-		nanosleep(&sleep_ts, &sleep_ts);
-
-		// Color the lines all white
-        for (uint8_t i = 0; i < 4; i++) {
-            if (lines_to_clear[i] == -1) continue;
-
-            for (uint8_t col = 0; col < BOARD_WIDTH; col++) {
-                draw_block(col, lines_to_clear[i], TB_WHITE);
-            }
-        }
-        tb_present();
-
-		nanosleep(&sleep_ts, &sleep_ts);
-
-		// actually remove each line from the board and move everything above down by one
-		for (uint8_t i = 0; i < 4; i++) {
-			if (lines_to_clear[i] == -1) continue;
-
-			for (uint8_t row = lines_to_clear[i]; row > 0; row--) {
-				for (uint8_t col = 0; col < BOARD_WIDTH; col++) {
-					board[col][row] = board[col][row - 1];
-				}
-			}
-
-			// Make sure to adjust any remaining lines to clear since this operation might have
-			// shifted them
-			for (uint8_t j = i + 1; j < 4; j++) {
-				if (lines_to_clear[j] != -1 && lines_to_clear[j] < lines_to_clear[i]) {
-					lines_to_clear[j]++;
-				}
-			}
-		}
-	}
+// Writes the stats out if SIGUSR1 came in since the last check
+void check_stats_dump() {
+	if (!stats_dump_requested) return;
+	stats_dump_requested = 0;
+	dump_stats("SIGUSR1");
+}
 
-	pthread_mutex_unlock(&active_piece_mutex);
-    pthread_mutex_unlock(&board_mutex);
-	
-	// Render is handled by this call
-	create_new_active_piece();
+void sigusr1_handler(int sig) {
+	(void)sig; // Surpress unused parameter warning
+	stats_dump_requested = 1;
 }
 
 void sigint_handler(int sig) {
@@ -576,15 +1108,26 @@ void sigint_handler(int sig) {
 void quit(int status, const char *exit_msg) {
 	// Signal for pthread to exit, then wait for it
 	GAME_STATE = QUIT;
-	pthread_join(event_handler_pt, NULL);
-	
-	// unlock them first, just in case
-	pthread_mutex_unlock(&board_mutex);
-    pthread_mutex_destroy(&board_mutex);
-	pthread_mutex_unlock(&active_piece_mutex);
-    pthread_mutex_destroy(&active_piece_mutex);
+	atomic_store(&input_stopping, true);
+	if (!single_threaded && event_handler_pt) pthread_join(event_handler_pt, NULL);
+	if (!single_threaded) input_queue_destroy(&input_queue);
+	dump_stats("exit");
+
+	if (autoplay) {
+		pool_destroy(&bot_pool);
+		bot_destroy(&bot);
+	}
+
+	// A game quit part way through still gets saved up to this point
+	if (recording) {
+		replay_end_game(&recorder, game_clock_ms());
+		replay_writer_close(&recorder);
+	}
+	snapshot_close(&snapshots);
 	
+	keyboard_disable();
 	tb_shutdown();
 	fprintf((status == EXIT_SUCCESS) ? stdout : stderr, "Tetris exited: %s\n", exit_msg);
+	if (recorder.failed) fprintf(stderr, "Couldn't write the replay, it is incomplete\n");
 	exit(status);
 }
@@ -0,0 +1,309 @@
+/*********************************************************************
+ * File: versus.c                                                    *
+ * Description: two players head to head over UDP. Only inputs are   *
+ *              sent; both sides run both games, rolling back to fix *
+ *              what they guessed of the other player's              *
+ *********************************************************************/
+
+#include "include/versus.h"
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HOST_MAX 256
+
+static void put_u16(uint8_t *p, uint16_t v) {
+	p[0] = (uint8_t) v;
+	p[1] = (uint8_t) (v >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+	for (uint8_t i = 0; i < 4; i++) p[i] = (uint8_t) (v >> (8 * i));
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+	return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	uint32_t v = 0;
+	for (uint8_t i = 0; i < 4; i++) v |= (uint32_t) p[i] << (8 * i);
+	return v;
+}
+
+/* A UDP socket on `port`, connected to `host`, or bound for anyone to
+ * reach if `host` is NULL
+ */
+static int open_socket(const char *host, const char *port) {
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM, .ai_flags = host ? 0 : AI_PASSIVE };
+	struct addrinfo *res, *ai;
+	int err = getaddrinfo(host, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "%s%s%s: %s\n", host ? host : "", host ? ":" : "port ", port, gai_strerror(err));
+		return -1;
+	}
+
+	// As in server.c, a dual-stack IPv6 socket if there's one to be had
+	int fd = -1;
+	for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) continue;
+		int off = 0;
+		if (!host && ai->ai_family == AF_INET6) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		if ((host ? connect(fd, ai->ai_addr, ai->ai_addrlen) : bind(fd, ai->ai_addr, ai->ai_addrlen)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0) perror(host ? "Couldn't reach the host" : "Couldn't open the port");
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* Opens a match. `where` is a PORT to host one on, dealt from `seed`, or
+ * HOST:PORT to join the one hosted there (an IPv6 HOST goes in brackets).
+ * Returns false, having said why on stderr, if the socket can't be set up.
+ */
+bool versus_open(versus_t *v, const char *where, uint64_t seed, double now_ms) {
+	memset(v, 0, sizeof(*v));
+	v->heard_ms = now_ms;
+	const char *colon = strrchr(where, ':');
+	if (!colon) {
+		v->host = true;
+		v->seed = seed;
+		v->fd = open_socket(NULL, where);
+		return v->fd >= 0;
+	}
+
+	char host[HOST_MAX];
+	const char *name = where;
+	size_t len = colon - where;
+	if (len >= 2 && where[0] == '[' && where[len - 1] == ']') {
+		name++;
+		len -= 2;
+	}
+	if (len == 0 || len >= sizeof(host)) {
+		fprintf(stderr, "%s: expected HOST:PORT\n", where);
+		return false;
+	}
+	memcpy(host, name, len);
+	host[len] = '\0';
+	v->me = 1;
+	v->fd = open_socket(host, colon + 1);
+	return v->fd >= 0;
+}
+
+void versus_close(versus_t *v) {
+	if (v->fd >= 0) close(v->fd);
+	v->fd = -1;
+}
+
+// Both games from the top, frame 0 now
+static void begin(versus_t *v, double now_ms) {
+	game_init(&v->confirmed[0], v->seed);
+	game_init(&v->confirmed[1], v->seed);
+	memcpy(v->games, v->confirmed, sizeof(v->games));
+	v->started = true;
+	v->start_ms = now_ms;
+}
+
+/* One frame of both games, run the same way on both sides: each player's
+ * inputs at the start of the frame (player 0 first), time up to its end,
+ * then the garbage either sent changes hands
+ */
+void versus_step(game_t g[2], const uint16_t in[2], uint32_t frame) {
+	for (uint8_t p = 0; p < 2; p++) {
+		for (uint8_t i = 0; i < INPUT_COUNT; i++) {
+			if (in[p] & (1u << i)) game_apply_input(&g[p], (input_t) i);
+		}
+		game_update(&g[p], (frame + 1) * VERSUS_FRAME_MS);
+	}
+	for (uint8_t p = 0; p < 2; p++) {
+		if (!g[p].garbage_out) continue;
+		game_add_garbage(&g[1 - p], g[p].garbage_out);
+		g[p].garbage_out = 0;
+	}
+}
+
+/* Moves the confirmed games on through every frame both inputs are in for,
+ * then runs the rest of our frames from there with the other player
+ * pressing nothing. That re-run is the rollback: whatever was guessed
+ * before is simply replaced.
+ */
+static void resimulate(versus_t *v, double now_ms) {
+	uint8_t other = 1 - v->me;
+	uint32_t known = v->frame < v->heard ? v->frame : v->heard;
+	while (!v->over && v->confirmed_frame < known) {
+		uint32_t f = v->confirmed_frame++;
+		uint16_t in[2] = { v->inputs[0][f % VERSUS_RING], v->inputs[1][f % VERSUS_RING] };
+		versus_step(v->confirmed, in, f);
+		if (v->confirmed[0].over || v->confirmed[1].over) {
+			v->over = true;
+			v->over_ms = now_ms;
+		}
+	}
+
+	memcpy(v->games, v->confirmed, sizeof(v->games));
+	v->rollback = 0;
+	if (v->over) return;
+	for (uint32_t f = v->confirmed_frame; f < v->frame; f++) {
+		uint16_t in[2];
+		in[v->me] = v->inputs[v->me][f % VERSUS_RING];
+		in[other] = 0;
+		versus_step(v->games, in, f);
+	}
+	v->rollback = v->frame - v->confirmed_frame;
+	if (v->rollback > v->max_rollback) v->max_rollback = v->rollback;
+}
+
+static void send_packet(versus_t *v, const uint8_t *buf, size_t len, double now_ms) {
+	send(v->fd, buf, len, 0); // lost or refused is all the same to UDP: the next one makes up for it
+	v->sent_ms = now_ms;
+}
+
+// Everything of ours the other side hasn't acked, which is never more than VERSUS_MAX_ROLLBACK frames
+static void send_inputs(versus_t *v, double now_ms) {
+	uint8_t buf[VERSUS_PACKET_MAX] = { VERSUS_MAGIC, VERSUS_INPUTS };
+	uint8_t count = (uint8_t) (v->frame - v->acked);
+	put_u32(&buf[2], v->heard);
+	put_u32(&buf[6], v->acked);
+	buf[10] = count;
+	for (uint8_t i = 0; i < count; i++) {
+		put_u16(&buf[11 + 2 * i], v->inputs[v->me][(v->acked + i) % VERSUS_RING]);
+	}
+	v->packet_bytes = 11 + 2 * count;
+	send_packet(v, buf, v->packet_bytes, now_ms);
+}
+
+static void send_start(versus_t *v, double now_ms) {
+	uint8_t buf[10] = { VERSUS_MAGIC, VERSUS_START };
+	put_u32(&buf[2], (uint32_t) v->seed);
+	put_u32(&buf[6], (uint32_t) (v->seed >> 32));
+	send_packet(v, buf, sizeof(buf), now_ms);
+}
+
+// Takes in the other player's frames that follow on from those already heard
+static void read_inputs(versus_t *v, const uint8_t *buf, size_t len) {
+	if (len < 11 || len < 11 + 2 * (size_t) buf[10]) return;
+	uint32_t ack = get_u32(&buf[2]), first = get_u32(&buf[6]);
+	uint8_t count = buf[10];
+	if (ack > v->acked && ack <= v->frame) v->acked = ack;
+	if (first > v->heard) return; // a gap: wait for a packet that covers it
+
+	uint8_t other = 1 - v->me;
+	for (uint32_t f = v->heard; f < first + count; f++) {
+		if (f >= v->frame + VERSUS_MAX_ROLLBACK) break; // it can't be this far ahead of us
+		v->inputs[other][f % VERSUS_RING] = get_u16(&buf[11 + 2 * (f - first)]);
+		v->heard = f + 1;
+	}
+}
+
+/* Reads every packet waiting. The host's first HELLO starts the match (with
+ * whoever sent it, the only peer from then on). Returns whether that changed
+ * anything there is to show: the match started, the games or an ack moved on.
+ */
+bool versus_receive(versus_t *v, double now_ms) {
+	uint8_t buf[VERSUS_PACKET_MAX];
+	uint32_t heard = v->heard, acked = v->acked;
+	bool started = v->started;
+	while (true) {
+		struct sockaddr_storage from;
+		socklen_t from_len = sizeof(from);
+		ssize_t n = recvfrom(v->fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &from_len);
+		if (n < 0) {
+			if (errno == EINTR || errno == ECONNREFUSED) continue; // refused: a packet we sent bounced
+			break;
+		}
+		if (n < 2 || buf[0] != VERSUS_MAGIC) continue;
+
+		switch (buf[1]) {
+			case VERSUS_HELLO:
+				if (!v->host) break;
+				if (!v->started) {
+					if (connect(v->fd, (struct sockaddr *) &from, from_len) < 0) break;
+					begin(v, now_ms);
+				}
+				send_start(v, now_ms); // again, if the first one was lost
+				break;
+			case VERSUS_START:
+				if (v->host || v->started || n < 10) break;
+				v->seed = get_u32(&buf[2]) | (uint64_t) get_u32(&buf[6]) << 32;
+				begin(v, now_ms);
+				break;
+			case VERSUS_INPUTS:
+				if (v->started) read_inputs(v, buf, n);
+				break;
+		}
+		v->heard_ms = now_ms;
+	}
+	if (v->heard != heard) resimulate(v, now_ms);
+	return v->heard != heard || v->acked != acked || v->started != started;
+}
+
+/* Inputs since the last frame. Within a frame presses go in before
+ * releases, so a key let go and pressed again in one frame is only pressed.
+ */
+void versus_input(versus_t *v, input_t in) {
+	if (in >= INPUT_PRESS_LEFT && in <= INPUT_PRESS_SOFT_DROP)
+		v->collecting &= ~(1u << (in - INPUT_PRESS_LEFT + INPUT_RELEASE_LEFT));
+	v->collecting |= 1u << in;
+}
+
+/* Ends every frame that's due by `now_ms`, with the inputs collected for it,
+ * and sends them. A side VERSUS_MAX_ROLLBACK frames ahead of the other waits
+ * instead, its clock held back until the other catches up. Once the match is
+ * over it only keeps sending, so the other side gets to its end too.
+ * Returns whether a frame ended or was waited out.
+ */
+bool versus_advance(versus_t *v, double now_ms) {
+	if (!v->started) {
+		if (!v->host && now_ms >= v->sent_ms + VERSUS_HELLO_MS) {
+			uint8_t hello[2] = { VERSUS_MAGIC, VERSUS_HELLO };
+			send_packet(v, hello, sizeof(hello), now_ms);
+		}
+		return false;
+	}
+
+	bool moved = false;
+	uint32_t stalls = v->stalls;
+	while (!v->over && now_ms >= v->start_ms + (v->frame + 1) * (double) VERSUS_FRAME_MS) {
+		if (v->frame >= v->heard + VERSUS_MAX_ROLLBACK || v->frame >= v->acked + VERSUS_MAX_ROLLBACK) {
+			v->start_ms += VERSUS_FRAME_MS;
+			v->stalls++;
+			continue;
+		}
+		v->inputs[v->me][v->frame % VERSUS_RING] = v->collecting;
+		v->collecting = 0;
+		v->frame++;
+		moved = true;
+	}
+	if (moved) resimulate(v, now_ms);
+	if (moved || (!versus_done(v, now_ms) && now_ms >= v->sent_ms + VERSUS_FRAME_MS)) send_inputs(v, now_ms);
+	return moved || v->stalls != stalls;
+}
+
+// When versus_advance() next has something to do, on the monotonic clock (INFINITY for never)
+double versus_next_ms(const versus_t *v) {
+	if (!v->started) return v->host ? INFINITY : v->sent_ms + VERSUS_HELLO_MS;
+	if (v->over) return versus_done(v, v->sent_ms) ? INFINITY : v->sent_ms + VERSUS_FRAME_MS;
+	return v->start_ms + (v->frame + 1) * (double) VERSUS_FRAME_MS;
+}
+
+// Nothing has come from the other side for VERSUS_TIMEOUT_MS (a host with nobody yet waits forever)
+bool versus_gone(const versus_t *v, double now_ms) {
+	if (v->host && !v->started) return false;
+	return now_ms > v->heard_ms + VERSUS_TIMEOUT_MS;
+}
+
+/* The match is over, the other side has acked every frame of ours it needs
+ * to see that, and has been sent our ack of its own since (or
+ * VERSUS_LINGER_MS went by without all that), so there is nothing left to send.
+ */
+bool versus_done(const versus_t *v, double now_ms) {
+	if (!v->over) return false;
+	return (v->acked >= v->confirmed_frame && v->sent_ms > v->over_ms) || now_ms >= v->over_ms + VERSUS_LINGER_MS;
+}